@@ -0,0 +1,361 @@
+/* End-to-end load generator for the server.
+
+ Spawns a local kvdb (or uses one already running with --no-spawn), preloads the key space and then drives it
+ from --connections sockets, each keeping --pipeline commands in flight. Reads are GETs, writes are EDITs of
+ existing keys, a separate connection issues SNAPSHOT every --snapshot-ms milliseconds. Latency of a command is
+ measured from the write of its pipeline batch to the arrival of its reply line. The result is printed as JSON.
+
+ Example:
+   ./kvdb_bench --connections 8 --pipeline 16 --duration 10 --read-ratio 0.9 --distribution zipfian --value-size 1024
+*/
+#include "../include/histogram.hpp"
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <cstring>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchConfig {
+    std::string host = "127.0.0.1";
+    int port = 18080;
+    std::string serverPath;             // defaults to the kvdb next to this binary
+    bool spawn = true;
+    int connections = 4;
+    int pipeline = 1;
+    double duration = 5.0;              // seconds
+    double readRatio = 0.9;
+    int keys = 100000;
+    std::string distribution = "uniform";
+    double zipfTheta = 0.99;
+    int valueSize = 100;
+    int snapshotMs = 0;                 // 0 = no snapshots
+};
+
+// YCSB style zipfian generator (Gray et al., "Quickly generating billion-record synthetic databases")
+class ZipfianGenerator {
+public:
+    ZipfianGenerator(uint64_t n, double theta) : n(n), theta(theta) {
+        zetan = zeta(n, theta);
+        double zeta2 = zeta(2, theta);
+        alpha = 1.0 / (1.0 - theta);
+        eta = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+    }
+
+    template<typename RNG>
+    uint64_t next(RNG& rng) {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+        double uz = u * zetan;
+        if (uz < 1.0) return 0;
+        if (uz < 1.0 + std::pow(0.5, theta)) return 1;
+        uint64_t v = (uint64_t)(n * std::pow(eta * u - eta + 1, alpha));
+        return v < n ? v : n - 1;
+    }
+
+private:
+    uint64_t n;
+    double theta, zetan, alpha, eta;
+
+    static double zeta(uint64_t n, double theta) {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; i++) sum += 1.0 / std::pow((double)i, theta);
+        return sum;
+    }
+};
+
+static int connectTo(const std::string& host, int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    struct sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(host.c_str());
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    int flag = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    return fd;
+}
+
+static bool writeAll(int fd, const std::string& data) {
+    size_t offset = 0;
+    while (offset < data.size()) {
+        ssize_t sent = send(fd, data.data() + offset, data.size() - offset, MSG_NOSIGNAL);
+        if (sent <= 0) return false;
+        offset += sent;
+    }
+    return true;
+}
+
+// Reads until `count` reply lines arrived. onLine is called for each one as soon as it is complete.
+template<typename F>
+static bool readLines(int fd, std::string& buffered, int count, F onLine) {
+    char buffer[65536];
+    while (count > 0) {
+        size_t pos;
+        while (count > 0 && (pos = buffered.find('\n')) != std::string::npos) {
+            onLine(buffered.compare(0, 5, "ERROR") == 0);
+            buffered.erase(0, pos + 1);
+            count--;
+        }
+        if (count == 0) break;
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n <= 0) return false;
+        buffered.append(buffer, n);
+    }
+    return true;
+}
+
+static std::string keyName(uint64_t i) {
+    return "key" + std::to_string(i);
+}
+
+static pid_t spawnServer(const BenchConfig& config) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        std::string port = std::to_string(config.port);
+        execl(config.serverPath.c_str(), config.serverPath.c_str(), config.host.c_str(), port.c_str(), (char*)nullptr);
+        _exit(127);
+    }
+    return pid;
+}
+
+// the spawned server is reaped on every way out of main, a failed run must not leave it holding the port
+static void stopServer(pid_t pid, int signal) {
+    if (pid > 0) {
+        kill(pid, signal);
+        waitpid(pid, nullptr, 0);
+    }
+}
+
+static bool waitForServer(const BenchConfig& config) {
+    for (int i = 0; i < 100; i++) {
+        int fd = connectTo(config.host, config.port);
+        if (fd >= 0) {
+            close(fd);
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    return false;
+}
+
+static void printHistogram(std::ostream& os, const char* name, const kvdb::LatencyHistogram& h, bool last = false) {
+    // latencies are recorded in nanoseconds and reported in microseconds
+    auto us = [](uint64_t ns) { return ns / 1000.0; };
+    os << "    \"" << name << "\": {\"count\": " << h.count()
+       << ", \"mean_us\": " << us((uint64_t)h.mean())
+       << ", \"p50_us\": " << us(h.percentile(50))
+       << ", \"p90_us\": " << us(h.percentile(90))
+       << ", \"p99_us\": " << us(h.percentile(99))
+       << ", \"p999_us\": " << us(h.percentile(99.9))
+       << ", \"max_us\": " << us(h.max()) << "}" << (last ? "\n" : ",\n");
+}
+
+static void usage(const char* argv0) {
+    std::cerr << "usage: " << argv0 << " [--host H] [--port P] [--server PATH] [--no-spawn]\n"
+              << "       [--connections N] [--pipeline D] [--duration SECONDS] [--read-ratio R]\n"
+              << "       [--keys K] [--distribution uniform|zipfian] [--zipf-theta T]\n"
+              << "       [--value-size BYTES] [--snapshot-ms MS]\n";
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    std::string self = argv[0];
+    size_t slash = self.rfind('/');
+    config.serverPath = (slash == std::string::npos ? std::string(".") : self.substr(0, slash)) + "/kvdb";
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        auto next = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                usage(argv[0]);
+                exit(1);
+            }
+            return argv[++i];
+        };
+        if (arg == "--host") config.host = next();
+        else if (arg == "--port") config.port = std::stoi(next());
+        else if (arg == "--server") config.serverPath = next();
+        else if (arg == "--no-spawn") config.spawn = false;
+        else if (arg == "--connections") config.connections = std::stoi(next());
+        else if (arg == "--pipeline") config.pipeline = std::stoi(next());
+        else if (arg == "--duration") config.duration = std::stod(next());
+        else if (arg == "--read-ratio") config.readRatio = std::stod(next());
+        else if (arg == "--keys") config.keys = std::stoi(next());
+        else if (arg == "--distribution") config.distribution = next();
+        else if (arg == "--zipf-theta") config.zipfTheta = std::stod(next());
+        else if (arg == "--value-size") config.valueSize = std::stoi(next());
+        else if (arg == "--snapshot-ms") config.snapshotMs = std::stoi(next());
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (config.connections < 1 || config.pipeline < 1 || config.keys < 1 ||
+        (config.distribution != "uniform" && config.distribution != "zipfian")) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    pid_t serverPid = -1;
+    if (config.spawn) {
+        serverPid = spawnServer(config);
+    }
+    if (!waitForServer(config)) {
+        std::cerr << "Could not reach server at " << config.host << ":" << config.port << std::endl;
+        stopServer(serverPid, SIGKILL);
+        return 1;
+    }
+
+    std::string value(config.valueSize, 'v');
+
+    // preload the key space with pipelined SETs so every GET hits and every EDIT finds its key
+    {
+        int fd = connectTo(config.host, config.port);
+        if (fd < 0) {
+            std::cerr << "Preload failed: could not connect to " << config.host << ":" << config.port << std::endl;
+            stopServer(serverPid, SIGTERM);
+            return 1;
+        }
+        std::string buffered;
+        const int batch = 1000;
+        for (int start = 0; start < config.keys; start += batch) {
+            int end = std::min(config.keys, start + batch);
+            std::string data;
+            for (int k = start; k < end; k++) {
+                data += "SET " + keyName(k) + " " + value + "\n";
+            }
+            if (!writeAll(fd, data) || !readLines(fd, buffered, end - start, [](bool) {})) {
+                std::cerr << "Preload failed" << std::endl;
+                close(fd);
+                stopServer(serverPid, SIGTERM);
+                return 1;
+            }
+        }
+        close(fd);
+    }
+
+    ZipfianGenerator zipf(config.keys, config.zipfTheta);
+    bool zipfian = config.distribution == "zipfian";
+
+    kvdb::LatencyHistogram readLatency, writeLatency, snapshotLatency;
+    std::atomic<uint64_t> errors{0};
+    std::atomic<bool> stop{false};
+
+    auto worker = [&](int id) {
+        int fd = connectTo(config.host, config.port);
+        if (fd < 0) {
+            errors++;
+            return;
+        }
+        std::mt19937_64 rng(id * 7919 + 17);
+        std::uniform_real_distribution<double> coin(0.0, 1.0);
+        std::uniform_int_distribution<uint64_t> uniform(0, config.keys - 1);
+        std::vector<bool> isRead(config.pipeline);
+        std::string buffered;
+
+        while (!stop) {
+            std::string data;
+            for (int i = 0; i < config.pipeline; i++) {
+                uint64_t k = zipfian ? zipf.next(rng) : uniform(rng);
+                isRead[i] = coin(rng) < config.readRatio;
+                if (isRead[i]) data += "GET " + keyName(k) + "\n";
+                else data += "EDIT " + keyName(k) + " " + value + "\n";
+            }
+            auto sentAt = Clock::now();
+            if (!writeAll(fd, data)) {
+                errors++;
+                break;
+            }
+            int index = 0;
+            bool ok = readLines(fd, buffered, config.pipeline, [&](bool error) {
+                uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - sentAt).count();
+                (isRead[index++] ? readLatency : writeLatency).record(ns);
+                if (error) errors++;
+            });
+            if (!ok) {
+                errors++;
+                break;
+            }
+        }
+        close(fd);
+    };
+
+    auto snapshotter = [&]() {
+        int fd = connectTo(config.host, config.port);
+        if (fd < 0) {
+            errors++;
+            return;
+        }
+        std::string buffered;
+        while (!stop) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(config.snapshotMs));
+            auto sentAt = Clock::now();
+            if (!writeAll(fd, "SNAPSHOT\n") || !readLines(fd, buffered, 1, [](bool) {})) break;
+            snapshotLatency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - sentAt).count());
+        }
+        close(fd);
+    };
+
+    auto begin = Clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < config.connections; i++) {
+        threads.emplace_back(worker, i);
+    }
+    if (config.snapshotMs > 0) {
+        threads.emplace_back(snapshotter);
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(config.duration));
+    stop = true;
+    for (auto& t : threads) {
+        t.join();
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+
+    stopServer(serverPid, SIGTERM);
+
+    uint64_t ops = readLatency.count() + writeLatency.count();
+    kvdb::LatencyHistogram all;
+    all.merge(readLatency);
+    all.merge(writeLatency);
+
+    std::ostream& os = std::cout;
+    os << "{\n";
+    os << "  \"config\": {\"connections\": " << config.connections << ", \"pipeline\": " << config.pipeline
+       << ", \"duration_s\": " << config.duration << ", \"read_ratio\": " << config.readRatio
+       << ", \"keys\": " << config.keys << ", \"distribution\": \"" << config.distribution << "\""
+       << ", \"zipf_theta\": " << config.zipfTheta << ", \"value_size\": " << config.valueSize
+       << ", \"snapshot_ms\": " << config.snapshotMs << "},\n";
+    os << "  \"elapsed_s\": " << elapsed << ",\n";
+    os << "  \"ops\": " << ops << ",\n";
+    os << "  \"errors\": " << errors.load() << ",\n";
+    os << "  \"throughput_ops_per_s\": " << (elapsed > 0 ? ops / elapsed : 0) << ",\n";
+    os << "  \"latency\": {\n";
+    printHistogram(os, "all", all);
+    printHistogram(os, "read", readLatency);
+    printHistogram(os, "write", writeLatency);
+    printHistogram(os, "snapshot", snapshotLatency, true);
+    os << "  }\n";
+    os << "}\n";
+    return 0;
+}
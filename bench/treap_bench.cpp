@@ -0,0 +1,306 @@
+/* Microbenchmarks for PersistentTreap.hpp (Google Benchmark).
+
+ Every benchmark is run for Treap<int, int> and Treap<std::string, std::string>, parameterized by the
+ number of keys in the store and (for string keys) the key length. Writes are applied to the same base
+ root on every iteration - the treap is persistent, so the base version and therefore the store size stay
+ unchanged while each iteration still pays for a full path copy.
+
+ nodes/op and values/op report how many slots of nodes<Key, Value> / values<Value> a single operation
+ appends, bytes/op is the memory those slots take.
+*/
+#include <benchmark/benchmark.h>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "../include/PersistentTreap.hpp"
+
+template<typename T>
+T makeKey(int i, int keyLength);
+
+template<>
+int makeKey<int>(int i, int) {
+    return i;
+}
+
+template<>
+std::string makeKey<std::string>(int i, int keyLength) {
+    std::string digits = std::to_string(i);
+    if ((int)digits.size() >= keyLength) return digits;
+    return std::string(keyLength - digits.size(), 'k') + digits;
+}
+
+template<typename T>
+T makeValue(int i);
+
+template<>
+int makeValue<int>(int i) {
+    return i * 10;
+}
+
+template<>
+std::string makeValue<std::string>(int i) {
+    return "value" + std::to_string(i);
+}
+
+template<typename Key, typename Value>
+void resetStore() {
+    nodes<Key, Value>.clear();
+    nodes<Key, Value>.add(Node<Key, Value>());
+    values<Value>.clear();
+    versions<Key, Value>.clear();
+}
+
+template<typename Key, typename Value>
+Treap<Key, Value> buildStore(int size, int keyLength) {
+    resetStore<Key, Value>();
+    Treap<Key, Value> store;
+    for (int i = 0; i < size; i++) {
+        store.insert(makeKey<Key>(i, keyLength), makeValue<Value>(i));
+    }
+    return store;
+}
+
+// keys used by the timed loop, generated up front so key construction isn't measured
+template<typename Key>
+std::vector<Key> sampleKeys(int count, int from, int range, int keyLength) {
+    std::mt19937 gen(42);
+    std::uniform_int_distribution<int> dist(from, from + range - 1);
+    std::vector<Key> keys;
+    keys.reserve(count);
+    for (int i = 0; i < count; i++) {
+        keys.push_back(makeKey<Key>(dist(gen), keyLength));
+    }
+    return keys;
+}
+
+template<typename Key, typename Value>
+struct ArenaCounter {
+    int nodesBefore = nodes<Key, Value>.size();
+    int valuesBefore = values<Value>.size();
+
+    void report(benchmark::State& state) {
+        double ops = (double)state.iterations();
+        if (ops == 0) return;
+        double nodesPerOp = (nodes<Key, Value>.size() - nodesBefore) / ops;
+        double valuesPerOp = (values<Value>.size() - valuesBefore) / ops;
+        state.counters["nodes/op"] = nodesPerOp;
+        state.counters["values/op"] = valuesPerOp;
+        state.counters["bytes/op"] = nodesPerOp * sizeof(Node<Key, Value>) + valuesPerOp * sizeof(Value);
+    }
+};
+
+constexpr int SAMPLE = 4096;
+
+template<typename Key, typename Value>
+static void BM_Insert(benchmark::State& state) {
+    int size = state.range(0), keyLength = state.range(1);
+    Treap<Key, Value> base = buildStore<Key, Value>(size, keyLength);
+    auto keys = sampleKeys<Key>(SAMPLE, size, SAMPLE, keyLength);     // not in the store yet
+    Value value = makeValue<Value>(1);
+    ArenaCounter<Key, Value> counter;
+    size_t i = 0;
+    for (auto _ : state) {
+        Treap<Key, Value> t = base;
+        t.insert(keys[i++ % SAMPLE], value);
+        benchmark::DoNotOptimize(t.root);
+    }
+    counter.report(state);
+}
+
+template<typename Key, typename Value>
+static void BM_Find(benchmark::State& state) {
+    int size = state.range(0), keyLength = state.range(1);
+    Treap<Key, Value> store = buildStore<Key, Value>(size, keyLength);
+    auto keys = sampleKeys<Key>(SAMPLE, 0, size, keyLength);
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(store.find_ptr(keys[i++ % SAMPLE]));
+    }
+}
+
+template<typename Key, typename Value>
+static void BM_FindMiss(benchmark::State& state) {
+    int size = state.range(0), keyLength = state.range(1);
+    Treap<Key, Value> store = buildStore<Key, Value>(size, keyLength);
+    auto keys = sampleKeys<Key>(SAMPLE, size, SAMPLE, keyLength);
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(store.find_ptr(keys[i++ % SAMPLE]));
+    }
+}
+
+template<typename Key, typename Value>
+static void BM_Remove(benchmark::State& state) {
+    int size = state.range(0), keyLength = state.range(1);
+    Treap<Key, Value> base = buildStore<Key, Value>(size, keyLength);
+    auto keys = sampleKeys<Key>(SAMPLE, 0, size, keyLength);
+    ArenaCounter<Key, Value> counter;
+    size_t i = 0;
+    for (auto _ : state) {
+        Treap<Key, Value> t = base;
+        t.remove(keys[i++ % SAMPLE]);
+        benchmark::DoNotOptimize(t.root);
+    }
+    counter.report(state);
+}
+
+template<typename Key, typename Value>
+static void BM_Edit(benchmark::State& state) {
+    int size = state.range(0), keyLength = state.range(1);
+    Treap<Key, Value> base = buildStore<Key, Value>(size, keyLength);
+    auto keys = sampleKeys<Key>(SAMPLE, 0, size, keyLength);
+    Value value = makeValue<Value>(7);
+    ArenaCounter<Key, Value> counter;
+    size_t i = 0;
+    for (auto _ : state) {
+        Treap<Key, Value> t = base;
+        t.edit(keys[i++ % SAMPLE], value);
+        benchmark::DoNotOptimize(t.root);
+    }
+    counter.report(state);
+}
+
+template<typename Key, typename Value>
+static void BM_Snapshot(benchmark::State& state) {
+    int size = state.range(0), keyLength = state.range(1);
+    Treap<Key, Value> store = buildStore<Key, Value>(size, keyLength);
+    for (auto _ : state) {
+        snapshot(store);
+    }
+    state.counters["versions"] = versions<Key, Value>.size();
+}
+
+// lookups against version 0 after 64 snapshots with 1% of the keys edited between each of them
+template<typename Key, typename Value>
+static void BM_VersionedFind(benchmark::State& state) {
+    int size = state.range(0), keyLength = state.range(1);
+    Treap<Key, Value> store = buildStore<Key, Value>(size, keyLength);
+    auto edits = sampleKeys<Key>(std::max(1, size / 100), 0, size, keyLength);
+    for (int v = 0; v < 64; v++) {
+        snapshot(store);
+        for (auto& key : edits) {
+            store.edit(key, makeValue<Value>(v));
+        }
+    }
+    Treap<Key, Value> oldest = rollback<Key, Value>(0);
+    auto keys = sampleKeys<Key>(SAMPLE, 0, size, keyLength);
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(oldest.find_ptr(keys[i++ % SAMPLE]));
+    }
+}
+
+// the same lookups as BM_Find, issued as batches of 64 through find_slots; the time is per key
+template<typename Key, typename Value>
+static void BM_FindBatched(benchmark::State& state) {
+    int size = state.range(0), keyLength = state.range(1);
+    Treap<Key, Value> store = buildStore<Key, Value>(size, keyLength);
+    auto keys = sampleKeys<Key>(SAMPLE, 0, size, keyLength);
+    int slots[64];
+    size_t i = 0;
+    for (auto _ : state) {
+        store.find_slots(store.root, keys.data() + i, 64, slots);
+        benchmark::DoNotOptimize(slots);
+        i = (i + 64) % SAMPLE;
+    }
+    state.SetItemsProcessed(state.iterations() * 64);
+}
+
+// a store that has taken writes: every edit path-copies to the end of the arena, so neighbouring nodes
+// of the current tree end up far apart. 4 edits per key.
+template<typename Key, typename Value>
+Treap<Key, Value> buildAgedStore(int size, int keyLength) {
+    Treap<Key, Value> store = buildStore<Key, Value>(size, keyLength);
+    auto edits = sampleKeys<Key>(size * 4, 0, size, keyLength);
+    for (auto& key : edits) {
+        store.edit(key, makeValue<Value>(1));
+    }
+    return store;
+}
+
+template<typename Key, typename Value>
+static void BM_FindAged(benchmark::State& state) {
+    int size = state.range(0), keyLength = state.range(1);
+    Treap<Key, Value> store = buildAgedStore<Key, Value>(size, keyLength);
+    auto keys = sampleKeys<Key>(SAMPLE, 0, size, keyLength);
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(store.find_ptr(keys[i++ % SAMPLE]));
+    }
+}
+
+// same store after relayout(): the current tree copied to the end of the arena in BFS order
+template<typename Key, typename Value>
+static void BM_FindRelaidOut(benchmark::State& state) {
+    int size = state.range(0), keyLength = state.range(1);
+    Treap<Key, Value> store = buildAgedStore<Key, Value>(size, keyLength);
+    store.root = relayout<Key, Value>(store.root);
+    auto keys = sampleKeys<Key>(SAMPLE, 0, size, keyLength);
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(store.find_ptr(keys[i++ % SAMPLE]));
+    }
+}
+
+template<typename Key, typename Value>
+static void BM_Save(benchmark::State& state) {
+    int size = state.range(0), keyLength = state.range(1);
+    Treap<Key, Value> store = buildStore<Key, Value>(size, keyLength);
+    snapshot(store);
+    size_t bytes = 0;
+    for (auto _ : state) {
+        std::ostringstream os;
+        save<Key, Value>(os, store.root);
+        bytes = os.str().size();
+    }
+    state.SetBytesProcessed(state.iterations() * bytes);
+}
+
+template<typename Key, typename Value>
+static void BM_Load(benchmark::State& state) {
+    int size = state.range(0), keyLength = state.range(1);
+    Treap<Key, Value> store = buildStore<Key, Value>(size, keyLength);
+    snapshot(store);
+    std::ostringstream os;
+    save<Key, Value>(os, store.root);
+    std::string dump = os.str();
+    for (auto _ : state) {
+        std::istringstream is(dump);
+        benchmark::DoNotOptimize(load<Key, Value>(is));
+    }
+    state.SetBytesProcessed(state.iterations() * dump.size());
+}
+
+// {store size, key length}; the key length is ignored for int keys
+static void IntArgs(benchmark::internal::Benchmark* b) {
+    for (int size : {1 << 10, 1 << 14, 1 << 17}) {
+        b->Args({size, 0});
+    }
+}
+
+static void StringArgs(benchmark::internal::Benchmark* b) {
+    for (int size : {1 << 10, 1 << 14, 1 << 17}) {
+        for (int keyLength : {8, 64}) {
+            b->Args({size, keyLength});
+        }
+    }
+}
+
+#define TREAP_BENCHMARK(fn)                                                     \
+    BENCHMARK_TEMPLATE(fn, int, int)->Apply(IntArgs);                           \
+    BENCHMARK_TEMPLATE(fn, std::string, std::string)->Apply(StringArgs)
+
+TREAP_BENCHMARK(BM_Insert);
+TREAP_BENCHMARK(BM_Find);
+TREAP_BENCHMARK(BM_FindMiss);
+TREAP_BENCHMARK(BM_FindBatched);
+TREAP_BENCHMARK(BM_FindAged);
+TREAP_BENCHMARK(BM_FindRelaidOut);
+TREAP_BENCHMARK(BM_Remove);
+TREAP_BENCHMARK(BM_Edit);
+TREAP_BENCHMARK(BM_Snapshot);
+TREAP_BENCHMARK(BM_VersionedFind);
+TREAP_BENCHMARK(BM_Save);
+TREAP_BENCHMARK(BM_Load);
+
+BENCHMARK_MAIN();
@@ -81,11 +81,11 @@ int main(int argc, char* argv[]) {
     while (running) { 
         std::cout << "> ";
         std::getline(std::cin, command);
-        // command.push_back('\n');
         if (command == "quit" || command == "exit") {
             running = false;
             break;
         }
+        command.push_back('\n');   // server executes one command per line
         
         // Send command
         if (send(clientSocket, command.c_str(), command.length(), 0) < 0) {
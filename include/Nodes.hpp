@@ -1,6 +1,7 @@
 #ifndef _NODES_HPP_
 #define _NODES_HPP_
 #include<vector>
+#include "Values.hpp"
 
 template<typename Key, typename Value>
 struct Node;
@@ -9,12 +10,15 @@ template<typename Key, typename Value>
 class Nodes {
 private:
     std :: vector<Node<Key, Value>> nodes;
+    size_t keyBytes = 0;   // every node (path copies included) holds its own copy of the key
+    uint64_t generations = 0;
 public:
     Nodes() {nodes.push_back(Node<Key, Value>());}
     Nodes(const std :: vector<Node<Key, Value>>& initialNodes) : nodes(initialNodes) {}
 
 
     int add(const Node<Key, Value>& node) {
+        keyBytes += payloadBytes(node.key);
         nodes.push_back(node);
         return (int)nodes.size() - 1;
     }
@@ -24,6 +28,7 @@ public:
     }
 
     int add(int id){
+        keyBytes += payloadBytes(nodes[id].key);
         nodes.push_back(nodes[id]);
         return (int)nodes.size() - 1;
     }
@@ -32,8 +37,32 @@ public:
         return nodes.size();
     }
 
+    size_t byteSize() const {
+        return keyBytes;
+    }
+
+    // changes whenever the slots are thrown away (clear/assign), so slot numbers from before mean nothing
+    uint64_t generation() const {
+        return generations;
+    }
+
     void clear(){
         nodes.clear();
+        keyBytes = 0;
+        generations++;
+    }
+
+    // replaces every slot at once (image loader), slot 0 included
+    void assign(std :: vector<Node<Key, Value>> &&all){
+        nodes = std::move(all);
+        keyBytes = 0;
+        generations++;
+        for(auto &node : nodes)  keyBytes += payloadBytes(node.key);
+    }
+
+    // only a hint: starts loading the slot into the cache while the caller still works on its parent
+    void prefetch(int index) const {
+        __builtin_prefetch(nodes.data() + index);
     }
 
     Node<Key, Value>& operator[](int index) {
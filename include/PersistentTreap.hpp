@@ -124,14 +124,73 @@ struct Treap{
     Treap() : root(0) {}
     Treap(int ROOT) : root(ROOT) {}
 
-    optional<Value> find(int T, const Key &key, const uint64_t &hkey){
-        if(!T)  return nullopt;
-        if(nodes<Key, Value>[T].hkey == hkey && nodes<Key, Value>[T].key == key)
-            return values<Value>[nodes<Key, Value>[T].vID];
-        if(nodes<Key, Value>[T].hkey > hkey || (nodes<Key, Value>[T].hkey == hkey && nodes<Key, Value>[T].key > key)){
-            return find(nodes<Key, Value>[T].p.first, key, hkey);
+    // returns a pointer straight into values<Value> so readers don't pay for a copy of the value
+    // the pointer is only valid until the next write (values<Value> may reallocate on add)
+    const Value* find_ptr(int T, const Key &key, const uint64_t &hkey){
+        int s = find_slot(T, key, hkey);
+        return s < 0 ? nullptr : &values<Value>[s];
+    }
+
+    // value slot of key, -1 when absent (for callers that keep the slot, e.g. the read cache)
+    int find_slot(int T, const Key &key, const uint64_t &hkey){
+        while(T){
+            Node<Key, Value> &node = nodes<Key, Value>[T];
+            // one of them is the next step; fetching both hides the miss behind the key comparison
+            nodes<Key, Value>.prefetch(node.p.first);
+            nodes<Key, Value>.prefetch(node.p.second);
+            if(node.hkey == hkey && node.key == key)
+                return node.vID;
+            if(node.hkey > hkey || (node.hkey == hkey && node.key > key))
+                T = node.p.first;
+            else
+                T = node.p.second;
+        }
+        return -1;
+    }
+
+    // Value slots of count keys (-1 when absent), for multi-key reads. A single descent is a chain of dependent
+    // loads, so BATCH descents are walked in lockstep instead: every round moves each unfinished one a level
+    // down and prefetches its next node, and the misses of different keys overlap.
+    static constexpr int BATCH = 8;
+
+    void find_slots(int T, const Key *keys, size_t count, int *slots){
+        int at[BATCH];
+        uint64_t hkeys[BATCH];
+        for(size_t first = 0; first < count; first += BATCH){
+            int lanes = (int)min<size_t>(BATCH, count - first);
+            for(int i = 0; i < lanes; i++){
+                at[i] = T;
+                hkeys[i] = hasher(keys[first + i]);
+                slots[first + i] = -1;
+            }
+            for(int active = T ? lanes : 0; active; ){
+                active = 0;
+                for(int i = 0; i < lanes; i++){
+                    if(!at[i])  continue;
+                    Node<Key, Value> &node = nodes<Key, Value>[at[i]];
+                    const Key &key = keys[first + i];
+                    if(node.hkey == hkeys[i] && node.key == key){
+                        slots[first + i] = node.vID;
+                        at[i] = 0;
+                        continue;
+                    }
+                    if(node.hkey > hkeys[i] || (node.hkey == hkeys[i] && node.key > key))
+                        at[i] = node.p.first;
+                    else
+                        at[i] = node.p.second;
+                    if(at[i]){
+                        nodes<Key, Value>.prefetch(at[i]);
+                        active++;
+                    }
+                }
+            }
         }
-        return find(nodes<Key, Value>[T].p.second, key, hkey);
+    }
+
+    optional<Value> find(int T, const Key &key, const uint64_t &hkey){
+        const Value* v = find_ptr(T, key, hkey);
+        if(!v)  return nullopt;
+        return *v;
     }
 
     // used when deleting to get the previous key
@@ -151,10 +210,9 @@ struct Treap{
     }
 
     int insert(int T, const Key &key, const Value &value){
-        optional<Value> v;
         uint64_t hkey = hasher(key);
-        if((v = find(T, key, hkey)).has_value()){
-            if(v == value)
+        if(const Value* v = find_ptr(T, key, hkey)){
+            if(*v == value)
                 return T;
             cerr << "Value already present !\n";
             return T;
@@ -165,7 +223,7 @@ struct Treap{
     }
 
     int remove(int T, const Key &key, const uint64_t &hkey){
-        if(!find(T, key, hkey).has_value())   return T;
+        if(!find_ptr(T, key, hkey))   return T;
         optional<Key> lt = find_lessThan(T, key, hkey);
         auto sp1 = split<Key, Value>(T, key, hkey);
         if(lt.has_value()){
@@ -187,6 +245,25 @@ struct Treap{
         return find(root, key, hkey);
     }
 
+    const Value* find_ptr(const Key &key){
+        uint64_t hkey = hasher(key);
+        return find_ptr(root, key, hkey);
+    }
+
+    int find_slot(const Key &key){
+        return find_slot(root, key, hasher(key));
+    }
+
+    vector<int> find_slots(const vector<Key> &keys){
+        vector<int> slots(keys.size());
+        find_slots(root, keys.data(), keys.size(), slots.data());
+        return slots;
+    }
+
+    bool contains(const Key &key){
+        return find_ptr(key) != nullptr;
+    }
+
     void remove(const Key &key){
         uint64_t hkey = hasher(key);
         root = remove(root, key, hkey);
@@ -197,6 +274,21 @@ struct Treap{
         root = insert(remove(root, key, hkey), key, value);
     }
 
+    // f(key, value) for every entry under T, in no particular order (the tree is ordered by key hash)
+    template<typename F>
+    void for_each(int T, F f){
+        vector<int> stack{T};
+        while(!stack.empty()){
+            int at = stack.back();
+            stack.pop_back();
+            if(!at)  continue;
+            Node<Key, Value> &node = nodes<Key, Value>[at];
+            stack.push_back(node.p.first);
+            stack.push_back(node.p.second);
+            f(node.key, values<Value>[node.vID]);
+        }
+    }
+
     int size(int T){
         if(!T)  return 0;
         return size(nodes<Key, Value>[T].p.first) + size(nodes<Key, Value>[T].p.second) + 1;
@@ -233,7 +325,7 @@ struct Treap{
             Value v;
             is >> v;
             nodes<Key, Value>.add(node);
-            values<Value>.add(v);
+            values<Value>.append(v);
         }
         int ROOT {};
         is >> ROOT;
@@ -259,6 +351,54 @@ Treap<Key, Value> rollback(int i){
     return versions<Key, Value>[i];
 }
 
+// number of distinct nodes and values reachable from the given roots (the rest only belongs to discarded
+// path copies). O(reachable nodes), shared subtrees are visited once.
+template<typename Key, typename Value>
+pair<int, int> count_reachable(const vector<int> &roots){
+    vector<char> seenNode(nodes<Key, Value>.size(), 0);
+    vector<char> seenValue(values<Value>.size(), 0);
+    vector<int> stack(roots.begin(), roots.end());
+    int liveNodes = 0, liveValues = 0;
+    while(!stack.empty()){
+        int T = stack.back();
+        stack.pop_back();
+        if(!T || seenNode[T])  continue;
+        seenNode[T] = 1;
+        liveNodes++;
+        int vID = nodes<Key, Value>[T].vID;
+        if(vID >= 0 && vID < (int)seenValue.size() && !seenValue[vID]){
+            seenValue[vID] = 1;
+            liveValues++;
+        }
+        stack.push_back(nodes<Key, Value>[T].p.first);
+        stack.push_back(nodes<Key, Value>[T].p.second);
+    }
+    return {liveNodes, liveValues};
+}
+
+// Copies the tree under root to the end of the node arena in breadth first order and returns the copy's
+// root. Writes path-copy nodes to the end of the arena, so after a while the nodes of the current tree are
+// scattered over it; in the copy the top levels, which every lookup passes, sit next to each other and a
+// node's children are close to its siblings'. The old slots stay (snapshots may use them) and the values
+// are shared, so it costs one node slot per key of the tree.
+template<typename Key, typename Value>
+int relayout(int root){
+    if(!root)  return 0;
+    int base = nodes<Key, Value>.size();
+    vector<int> order{root};
+    for(size_t i = 0; i < order.size(); i++){
+        Node<Key, Value> copy = nodes<Key, Value>[order[i]];
+        for(int *child : {&copy.p.first, &copy.p.second}){
+            if(*child){
+                order.push_back(*child);
+                *child = base + (int)order.size() - 1;
+            }
+        }
+        nodes<Key, Value>.add(copy);
+    }
+    return base;
+}
+
 template<typename Key, typename Value>
 void save(std::ostream& os, int root) {
     os << root << '\n';
@@ -302,7 +442,7 @@ int load(std::istream& is) {
     while (n--) {
         Value v;
         is >> v;
-        values<Value>.add(v);
+        values<Value>.append(v);
     }
 
     is >> n;
@@ -2,29 +2,252 @@
 #define _VALUES_HPP_
 
 #include <vector>
+#include <string>
+#include <list>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+#include <unordered_map>
+#include "value_log.hpp"
 
+// bytes of key/value data held by an entry, only used for memory statistics
+template<typename T>
+size_t payloadBytes(const T &){
+    return sizeof(T);
+}
+
+inline size_t payloadBytes(const std :: string &s){
+    return s.size();
+}
+
+// With dedup enabled the store is content addressed: add() of a value that is already stored returns the
+// existing slot instead of a new one, so repeated values (status flags, common JSON blobs) are held once in
+// memory and in every dump. Slots are still never modified, nodes just share them. refs counts the adds
+// that resolved to a slot, for reclaiming slots later.
+//
+// With spilling enabled (string values only) values of at least spillThreshold bytes go to a ValueLog and
+// their slot only keeps the location. Reading such a slot goes through a small LRU cache, so memory is the
+// tree plus the small and the recently read values. A value pushed out of the cache is kept (pinned) until
+// releaseReads() or the next write, so references handed out by one command stay valid until its reply is
+// sent, however many other spilled values the command reads.
 template<typename Value>
 class Values{
 private:
     std :: vector<Value> values;
+    size_t bytes = 0;
+    bool dedup = false;
+    std :: unordered_map<size_t, int> byHash;     // content hash -> slot holding that content
+    std :: vector<uint32_t> refs;
+    uint64_t sharedAdds = 0, savedBytes = 0;
+
+    struct Location{
+        uint64_t offset;
+        uint32_t length;
+    };
+    std :: unique_ptr<ValueLog> log;
+    size_t spillThreshold = 0;
+    std :: unordered_map<int, Location> spilled;
+    size_t spilledBytes = 0;
+    // most recently read spilled values first
+    std :: list<std :: pair<int, Value>> cache;
+    std :: unordered_map<int, typename std :: list<std :: pair<int, Value>>::iterator> cached;
+    std :: list<std :: pair<int, Value>> pinned;  // evicted since the last releaseReads(), may still be referenced
+    size_t cacheCapacity = 0, cachedBytes = 0;
+    uint64_t cacheHits = 0, cacheMisses = 0;
+
+    void index(int id, const Value &content){
+        byHash.emplace(std :: hash<Value>{}(content), id);  // on a collision the first value keeps the entry
+        refs.push_back(1);
+    }
+
+    // moves a large value of slot id to the log
+    void spill(int id){
+        if constexpr (std :: is_same_v<Value, std :: string>){
+            if(log && values[id].size() >= spillThreshold){
+                spilled[id] = {log->append(values[id]), (uint32_t)values[id].size()};
+                spilledBytes += values[id].size();
+                Value().swap(values[id]);
+            }
+        }
+    }
+
+    Value& readSpilled(int index, const Location &location){
+        auto it = cached.find(index);
+        if(it != cached.end()){
+            cacheHits++;
+            cache.splice(cache.begin(), cache, it->second);
+            return it->second->second;
+        }
+        cacheMisses++;
+        cache.emplace_front(index, Value());
+        if constexpr (std :: is_same_v<Value, std :: string>){
+            log->read(location.offset, location.length, cache.front().second);
+        }
+        cached[index] = cache.begin();
+        cachedBytes += location.length;
+        // the value just read always stays, its reference is handed out. Evicted entries move to pinned,
+        // splice keeps their addresses
+        while(cachedBytes > cacheCapacity && cache.size() > 1){
+            cachedBytes -= payloadBytes(cache.back().second);
+            cached.erase(cache.back().first);
+            pinned.splice(pinned.end(), cache, std :: prev(cache.end()));
+        }
+        return cache.front().second;
+    }
+
+    // equal content without going through the cache: a spilled slot of another length is no candidate, only a
+    // real candidate costs a read from the log
+    bool sameContent(int id, const Value &value) const{
+        if(!spilled.empty()){
+            auto it = spilled.find(id);
+            if(it != spilled.end()){
+                if constexpr (std :: is_same_v<Value, std :: string>){
+                    if(it->second.length != value.size())  return false;
+                }
+                bool same = false;
+                visit(id, [&](const Value &content){ same = content == value; });
+                return same;
+            }
+        }
+        return values[id] == value;
+    }
+
+    void dropSpilled(){
+        spilled.clear();
+        spilledBytes = 0;
+        cache.clear();
+        pinned.clear();
+        cached.clear();
+        cachedBytes = 0;
+        if(log)  log->reset();
+    }
 public:
 
     int add(const Value value){
+        if(dedup){
+            auto it = byHash.find(std :: hash<Value>{}(value));
+            if(it != byHash.end() && sameContent(it->second, value)){
+                refs[it->second]++;
+                sharedAdds++;
+                savedBytes += payloadBytes(value);
+                return it->second;
+            }
+        }
+        return append(value);
+    }
+
+    // always a new slot: loaders use it so the slots stay those of the file
+    int append(const Value value){
+        releaseReads();
+        bytes += payloadBytes(value);
         values.push_back(value);
-        return (int)values.size() - 1;
+        int id = (int)values.size() - 1;
+        if(dedup)  index(id, values[id]);
+        spill(id);
+        return id;
+    }
+
+    void enableDedup(bool on){
+        dedup = on;
+        byHash.clear();
+        refs.clear();
+        if(on){
+            for(int i = 0; i < (int)values.size(); i++)  visit(i, [&](const Value &content){ index(i, content); });
+        }
+    }
+
+    bool dedupEnabled() const{
+        return dedup;
+    }
+
+    // values of at least threshold bytes written from now on go to the log at path, cacheBytes of them are
+    // kept in memory after being read
+    void enableSpill(const std :: string &path, size_t threshold, size_t cacheBytes){
+        static_assert(std :: is_same_v<Value, std :: string>, "only string values can be spilled");
+        log = std :: make_unique<ValueLog>(path);
+        spillThreshold = threshold;
+        cacheCapacity = cacheBytes;
+    }
+
+    // adds that resolved to the slot (1 without dedup)
+    uint32_t references(int index) const{
+        return dedup ? refs[index] : 1;
+    }
+
+    // adds that reused an existing slot, and the bytes they did not store
+    uint64_t deduplicated() const{
+        return sharedAdds;
+    }
+
+    uint64_t bytesSaved() const{
+        return savedBytes;
     }
 
+    size_t spilledCount() const{ return spilled.size(); }
+    size_t spilledByteSize() const{ return spilledBytes; }
+    uint64_t spillCacheHits() const{ return cacheHits; }
+    uint64_t spillCacheMisses() const{ return cacheMisses; }
+
     int size() const{
         return values.size();
     }
 
+    // total payload of all stored values (every version's values, not just the live ones)
+    size_t byteSize() const{
+        return bytes;
+    }
+
     void clear(){
         values.clear();
+        bytes = 0;
+        byHash.clear();
+        refs.clear();
+        dropSpilled();
+    }
+
+    // replaces every slot at once (image loader)
+    void assign(std :: vector<Value> &&all){
+        dropSpilled();
+        values = std::move(all);
+        bytes = 0;
+        for(auto &value : values)  bytes += payloadBytes(value);
+        enableDedup(dedup);
+        for(int i = 0; i < (int)values.size(); i++)  spill(i);
+    }
+
+    // f(value) without going through the cache, may run on several threads at once (image writers)
+    template<typename F>
+    void visit(int index, F f) const{
+        if(!spilled.empty()){
+            auto it = spilled.find(index);
+            if(it != spilled.end()){
+                Value content;
+                if constexpr (std :: is_same_v<Value, std :: string>){
+                    log->read(it->second.offset, it->second.length, content);
+                }
+                f(static_cast<const Value&>(content));
+                return;
+            }
+        }
+        f(values[index]);
+    }
+
+    // evicted spilled values are freed here (the server calls it once a reply is sent) or by the next write
+    void releaseReads(){
+        pinned.clear();
     }
 
+    // a reference to a spilled value lives in the cache, or in pinned once evicted: valid until the next
+    // write, like any other slot, or until releaseReads()
     Value& operator[](int index) {
+        if(!spilled.empty()){
+            auto it = spilled.find(index);
+            if(it != spilled.end())  return readSpilled(index, it->second);
+        }
         return values[index];
     }
 };
 
-#endif
\ No newline at end of file
+#endif
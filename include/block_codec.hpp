@@ -0,0 +1,117 @@
+#ifndef BLOCK_CODEC_HPP
+#define BLOCK_CODEC_HPP
+
+// Small LZ77 codec for image blocks, using the LZ4 block format: a sequence is
+//
+//      token (literal length << 4 | match length - 4), [more literal length], literals,
+//      u16 offset, [more match length]
+//
+// a length nibble of 15 continues in the following bytes (255 means "add and keep reading"), the last
+// sequence has literals only. Greedy matching through a 4096 entry hash table of 4 byte prefixes: not the
+// best ratio, but a few hundred MB/s and no dependency. Repetitive keys/values (common prefixes, repeated
+// JSON fields, values copied across version slots) compress well.
+
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+
+namespace codec {
+
+constexpr size_t MIN_MATCH = 4;
+constexpr size_t LAST_LITERALS = 5;     // the format ends with at least 5 literals
+constexpr size_t MATCH_LIMIT = 12;      // no match starts in the last 12 bytes
+
+inline uint32_t read32(const char *p){
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline void putLength(std::string &out, size_t length){
+    while(length >= 255){
+        out.push_back((char)255);
+        length -= 255;
+    }
+    out.push_back((char)length);
+}
+
+// appends the compressed form of src to out
+inline void compress(const char *src, size_t size, std::string &out){
+    uint32_t table[4096] = {};      // position + 1 of the last 4 byte prefix with this hash
+    size_t anchor = 0, pos = 0;
+    auto emit = [&](size_t literals, size_t offset, size_t matchLength){
+        size_t token = std::min<size_t>(literals, 15) << 4;
+        if(matchLength)  token |= std::min<size_t>(matchLength - MIN_MATCH, 15);
+        out.push_back((char)token);
+        if(literals >= 15)  putLength(out, literals - 15);
+        out.append(src + anchor, literals);
+        if(matchLength){
+            out.push_back((char)(offset & 0xFF));
+            out.push_back((char)(offset >> 8));
+            if(matchLength - MIN_MATCH >= 15)  putLength(out, matchLength - MIN_MATCH - 15);
+        }
+    };
+
+    if(size > MATCH_LIMIT){
+        while(pos + MATCH_LIMIT < size){
+            uint32_t sequence = read32(src + pos);
+            uint32_t hash = (sequence * 2654435761u) >> 20;
+            size_t candidate = table[hash];
+            table[hash] = (uint32_t)pos + 1;
+            if(candidate == 0 || pos - (candidate - 1) > 0xFFFF || read32(src + candidate - 1) != sequence){
+                pos++;
+                continue;
+            }
+            size_t match = candidate - 1;
+            size_t length = MIN_MATCH;
+            while(pos + length + LAST_LITERALS < size && src[match + length] == src[pos + length])  length++;
+            emit(pos - anchor, pos - match, length);
+            pos += length;
+            anchor = pos;
+        }
+    }
+    emit(size - anchor, 0, 0);
+}
+
+// decompresses exactly rawSize bytes into out, false on any malformed input (never reads or writes out of bounds)
+inline bool decompress(const char *src, size_t size, std::string &out, size_t rawSize){
+    out.resize(rawSize);
+    const uint8_t *in = reinterpret_cast<const uint8_t*>(src), *inEnd = in + size;
+    size_t written = 0;
+    auto readLength = [&](size_t &length) -> bool {
+        uint8_t more;
+        do{
+            if(in == inEnd)  return false;
+            more = *in++;
+            length += more;
+        }while(more == 255);
+        return true;
+    };
+    while(in < inEnd){
+        uint8_t token = *in++;
+        size_t literals = token >> 4;
+        if(literals == 15 && !readLength(literals))  return false;
+        if((size_t)(inEnd - in) < literals || rawSize - written < literals)  return false;
+        std::memcpy(&out[written], in, literals);
+        in += literals;
+        written += literals;
+        if(in == inEnd)  break;     // last sequence
+
+        if(inEnd - in < 2)  return false;
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        size_t length = token & 15;
+        if(length == 15 && !readLength(length))  return false;
+        length += MIN_MATCH;
+        if(offset == 0 || offset > written || rawSize - written < length)  return false;
+        // byte by byte: the match may overlap what it is copying
+        for(size_t i = 0; i < length; i++, written++)  out[written] = out[written - offset];
+    }
+    return written == rawSize;
+}
+
+}
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef BLOOM_HPP
+#define BLOOM_HPP
+
+// Bloom filters over the keys of retained versions, so a VGET of a key a snapshot never had is answered
+// without walking that snapshot's tree. Snapshots never change, so a version's filter is built once (on its
+// first lookup, one walk over its tree) and stays right for as long as the version has the same root in the
+// same node arena (a LOAD starts a new generation of slots).
+// Filters are saved with the binary image and installed again by the loader.
+
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include "PersistentTreap.hpp"
+
+class BloomFilter{
+public:
+    BloomFilter() = default;
+
+    // about 1% false positives at 10 bits per key
+    explicit BloomFilter(size_t keys, size_t bitsPerKey = 10)
+        : hashes(std::max<uint32_t>(1, std::min<uint32_t>(30, (uint32_t)std::lround(bitsPerKey * 0.69)))),
+          bits((std::max<size_t>(keys * bitsPerKey, 64) + 63) / 64) {}
+
+    BloomFilter(uint32_t hashCount, std::vector<uint64_t> words) : hashes(hashCount), bits(std::move(words)) {}
+
+    // hkey is the key's FNV hash (Node::hkey), mixed again since FNV spreads the low bits poorly
+    void add(uint64_t hkey){
+        forEachBit(hkey, [&](uint64_t bit){ bits[bit / 64] |= 1ull << (bit % 64); return true; });
+    }
+
+    bool mayContain(uint64_t hkey) const{
+        if(bits.empty())  return true;
+        return forEachBit(hkey, [&](uint64_t bit){ return (bits[bit / 64] >> (bit % 64)) & 1; });
+    }
+
+    uint32_t hashCount() const{ return hashes; }
+    const std::vector<uint64_t>& words() const{ return bits; }
+
+private:
+    uint32_t hashes = 0;
+    std::vector<uint64_t> bits;
+
+    // double hashing: bit i = h + i * delta (mod size), stops early when visit returns false
+    template<typename Visit>
+    bool forEachBit(uint64_t hkey, Visit visit) const{
+        uint64_t h = hkey ^ (hkey >> 33);
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        uint64_t delta = (h >> 29) | 1;
+        uint64_t size = bits.size() * 64;
+        for(uint32_t i = 0; i < hashes; i++, h += delta){
+            if(!visit(h % size))  return false;
+        }
+        return true;
+    }
+};
+
+// filter per entry of versions<Key, Value>, tagged with the root it was built for
+template<typename Key, typename Value>
+class VersionFilters{
+public:
+    // false only if key is certainly not in version v
+    bool mayContain(int v, uint64_t hkey){
+        if(v < 0 || v >= (int)versions<Key, Value>.size())  return true;
+        if(!current(v))  build(v);
+        if(entries[v].filter.mayContain(hkey))  return true;
+        negatives++;
+        return false;
+    }
+
+    void build(int v){
+        int root = versions<Key, Value>[v].root;
+        std::vector<uint64_t> hkeys;
+        std::vector<int> stack{root};
+        while(!stack.empty()){
+            int T = stack.back();
+            stack.pop_back();
+            if(!T)  continue;
+            hkeys.push_back(nodes<Key, Value>[T].hkey);
+            stack.push_back(nodes<Key, Value>[T].p.first);
+            stack.push_back(nodes<Key, Value>[T].p.second);
+        }
+        BloomFilter filter(hkeys.size());
+        for(uint64_t hkey : hkeys)  filter.add(hkey);
+        install(v, root, std::move(filter));
+    }
+
+    void install(int v, int root, BloomFilter &&filter){
+        if((int)entries.size() <= v)  entries.resize(v + 1);
+        entries[v].root = root;
+        entries[v].generation = nodes<Key, Value>.generation();
+        entries[v].filter = std::move(filter);
+    }
+
+    // built filters that still match their version, f(v, root, filter)
+    template<typename F>
+    void forEachCurrent(F f){
+        for(int v = 0; v < (int)entries.size(); v++){
+            if(current(v))  f(v, entries[v].root, entries[v].filter);
+        }
+    }
+
+    void clear(){
+        entries.clear();
+    }
+
+    size_t builtCount(){
+        size_t count = 0;
+        forEachCurrent([&](int, int, const BloomFilter&){ count++; });
+        return count;
+    }
+
+    uint64_t negativeCount() const{ return negatives; }
+
+private:
+    struct Entry{
+        int root = -1;
+        uint64_t generation = 0;
+        BloomFilter filter;
+    };
+    std::vector<Entry> entries;
+    uint64_t negatives = 0;
+
+    bool current(int v) const{
+        return v < (int)entries.size() && v < (int)versions<Key, Value>.size() && entries[v].root == versions<Key, Value>[v].root
+               && entries[v].generation == nodes<Key, Value>.generation();
+    }
+};
+
+template<typename Key, typename Value>
+VersionFilters<Key, Value> versionFilters;
+
+#endif
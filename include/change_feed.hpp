@@ -0,0 +1,76 @@
+#ifndef CHANGE_FEED_HPP
+#define CHANGE_FEED_HPP
+
+#include "change_log.hpp"
+#include <string>
+#include <unordered_map>
+#include <functional>
+#include <atomic>
+#include <cstdint>
+
+namespace kvdb {
+
+/* SUBSCRIBE CHANGES: streams every change of the ChangeLog to subscribed connections, without going
+ through the per-key watch index. Each subscriber only has a cursor (last sequence it was sent) and
+ one frame being written:
+
+     CHANGES <n> <last seq>\n
+     <seq> SET <key> <value>\n   ... n change lines (see appendChangeLine)
+
+ The log itself is the buffer. A subscriber whose socket is full simply stops advancing its cursor
+ (the server loop waits for EPOLLOUT), and is cut off with an error once it falls so far behind that
+ its cursor left the log. Runs on the server loop only.*/
+class ChangeFeed {
+public:
+    // asks the event loop to report (or stop reporting) when the socket becomes writable
+    using WriteInterest = std::function<void(int clientSocket, bool wantWrite)>;
+
+    explicit ChangeFeed(const ChangeLog& log, size_t maxBatch = 512);
+
+    void setWriteInterest(WriteInterest callback);
+
+    // start streaming the changes after `from`, false when they are no longer in the log
+    bool subscribe(int clientSocket, uint64_t from);
+    bool unsubscribe(int clientSocket);
+    void disconnect(int clientSocket);  // connection closed, drop whatever is pending
+    bool isSubscribed(int clientSocket) const;
+    size_t unsentBytes(int clientSocket) const;     // frame and replies not written yet
+
+    // replies to commands of a subscribed connection go out between frames, never inside one. Taken by
+    // value: a large reply (the SYNC image) is moved into an empty outbox instead of copied
+    void reply(int clientSocket, std::string text);
+
+    void flush(int clientSocket);       // socket became writable
+    void flushAll();                    // new changes were logged
+
+    size_t subscriberCount() const { return subscriberGauge.load(std::memory_order_relaxed); }
+    uint64_t overruns() const { return overrunCount.load(std::memory_order_relaxed); }
+    uint64_t framesSent() const { return frameCount.load(std::memory_order_relaxed); }
+
+private:
+    struct Subscriber {
+        uint64_t cursor;            // last sequence put into a frame
+        std::string outbox;         // frame (and queued replies) being written
+        size_t written = 0;
+        bool waitingForWrite = false;
+        bool closing = false;       // unsubscribed or overrun, remove once the outbox is written
+    };
+
+    const ChangeLog& log;
+    size_t maxBatch;
+    WriteInterest writeInterest;
+    std::unordered_map<int, Subscriber> subscribers;
+
+    // atomics so the metrics thread can read them
+    std::atomic<size_t> subscriberGauge{0};
+    std::atomic<uint64_t> overrunCount{0};
+    std::atomic<uint64_t> frameCount{0};
+
+    void pump(int clientSocket, Subscriber& subscriber);
+    bool writeOut(int clientSocket, Subscriber& subscriber);
+    void remove(int clientSocket);
+};
+
+}
+
+#endif
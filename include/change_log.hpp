@@ -0,0 +1,69 @@
+#ifndef CHANGE_LOG_HPP
+#define CHANGE_LOG_HPP
+
+#include <string>
+#include <deque>
+#include <cstdint>
+
+namespace kvdb {
+
+enum class ChangeType {
+    SET,
+    DEL,
+    EDIT,
+    SNAPSHOT,       // key holds the new version number
+    CHANGE,         // CHANGE (rollback), key holds the version the store was reset to
+    RELOAD          // LOAD/VLOAD or a replica loading an image, the store was replaced as a whole
+};
+
+const char* changeTypeName(ChangeType type);
+
+// one mutation of the store, sequence numbers start at 1 and grow by one per change
+struct ChangeEntry {
+    uint64_t sequence;
+    ChangeType type;
+    std::string key;
+    std::string value;
+};
+
+// "<seq> SET <key> <value>", "<seq> DEL <key>", "<seq> EDIT <key> <value>", "<seq> SNAPSHOT <version>",
+// "<seq> CHANGE <version>" or "<seq> RELOAD <command>", plus '\n'
+void appendChangeLine(std::string& out, const ChangeEntry& change);
+
+// Bounded in-memory log of the latest mutations. Every change gets the next sequence number,
+// once more than `capacity` changes are retained the oldest ones are forgotten. A watcher that
+// reconnects with the last sequence number it saw can be replayed everything after it, as long as
+// that is still in the log. Only used from the server loop, so no locking.
+class ChangeLog {
+public:
+    explicit ChangeLog(size_t capacity = 100000);
+
+    uint64_t append(ChangeType type, const std::string& key, const std::string& value);
+
+    uint64_t lastSequence() const { return nextSequence - 1; }     // 0 before the first change
+    uint64_t firstSequence() const;                                 // oldest retained entry
+    size_t size() const { return entries.size(); }
+    size_t capacity() const { return maxEntries; }
+
+    // true when every change after `since` is still retained (and since isn't in the future)
+    bool covers(uint64_t since) const;
+
+    // visits the retained entries with sequence > since, oldest first (at most `limit` of them)
+    template<typename Visit>
+    void forEachSince(uint64_t since, Visit visit, size_t limit = SIZE_MAX) const {
+        uint64_t first = firstSequence();
+        size_t start = since < first ? 0 : since - first + 1;
+        for (size_t i = start; i < entries.size() && limit > 0; i++, limit--) {
+            visit(entries[i]);
+        }
+    }
+
+private:
+    std::deque<ChangeEntry> entries;
+    size_t maxEntries;
+    uint64_t nextSequence = 1;
+};
+
+}
+
+#endif
@@ -0,0 +1,420 @@
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+// Incremental checkpoints. nodes<Key, Value>, values<Value> and versions<Key, Value> only ever grow (a write
+// appends its path copies and never touches an existing slot), so everything a checkpoint needs beyond the
+// previous one is the slots appended since then plus the new roots. A checkpoint directory holds
+//
+//      MANIFEST                 "base <file>" and then "delta <file>" lines, in the order they are applied
+//      base-<n>.img             full image (snapshot_image.hpp)
+//      delta-<n>.img            "KVDBDLT4", u32 root,
+//                               u32 first node slot, section nodes,
+//                               u32 first value slot, section values,
+//                               u32 first version, section versions,
+//                               section filters (Bloom filters built since the previous checkpoint)
+//                               (compressed, checksummed sections as in snapshot_image.hpp)
+//
+// so a checkpoint costs O(changes * log n) instead of O(store). Once mergeAfter deltas piled up a background
+// thread folds the base and the deltas into a new base (working on the files only, never on the arenas) and
+// swaps it into the manifest, which keeps restore time bounded.
+
+#include <filesystem>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <iterator>
+#include <tuple>
+#include "snapshot_image.hpp"
+
+namespace image {
+
+constexpr char DELTA_MAGIC[8] = {'K', 'V', 'D', 'B', 'D', 'L', 'T', '4'};
+
+// an image held in plain vectors, used by the background merge and by restore before it replaces the arenas
+template<typename Key, typename Value>
+struct ImageData{
+    uint32_t root = 0;
+    std::vector<NodeRecord<Key>> nodes{1};  // slot i, slot 0 unused
+    std::vector<Value> values;
+    std::vector<uint32_t> versions;
+    std::vector<FilterRecord> filters;      // of the base and every delta
+};
+
+template<typename Key, typename Value>
+void readImageData(const char *bytes, size_t size, ImageData<Key, Value> &data){
+    data.nodes.resize(1);
+    data.root = parseImage<Key, Value>(bytes, size, data.nodes, data.values, data.versions, data.filters);
+}
+
+template<typename Key, typename Value>
+void writeImageData(std::ostream &os, const ImageData<Key, Value> &data){
+    std::streampos start = os.tellp();
+    os.write(MAGIC, sizeof(MAGIC));
+    write<uint32_t>(os, data.root);
+    std::vector<BlockRef> sections[SECTIONS];
+    sections[0] = writeSection(os, data.nodes.size() - 1, [&](std::string &out, size_t i){
+        const NodeRecord<Key> &node = data.nodes[i + 1];
+        putNode(out, node.key, node.hkey, node.vID, node.y, node.left, node.right);
+    });
+    sections[1] = writeSection(os, data.values.size(), [&](std::string &out, size_t i){ put(out, data.values[i]); });
+    sections[2] = writeSection(os, data.versions.size(), [&](std::string &out, size_t i){ put<uint32_t>(out, data.versions[i]); });
+    sections[3] = writeSection(os, data.filters.size(), [&](std::string &out, size_t i){
+        putFilter(out, data.filters[i].version, data.filters[i].root, data.filters[i].filter);
+    });
+    writeIndex(os, start, sections);
+}
+
+// replaces the arenas with a decoded image (RESTORE, once the whole chain is decoded), returns its root
+template<typename Key, typename Value>
+int installImageData(ImageData<Key, Value> &&data){
+    std::vector<Node<Key, Value>> nodeSlots(data.nodes.size());
+    for(size_t i = 1; i < data.nodes.size(); i++){
+        NodeRecord<Key> &record = data.nodes[i];
+        Node<Key, Value> &node = nodeSlots[i];
+        node.key = std::move(record.key);
+        node.hkey = record.hkey;
+        node.vID = record.vID;
+        node.y = record.y;
+        node.p = {record.left, record.right};
+    }
+    install<Key, Value>(std::move(nodeSlots), std::move(data.values), data.versions, data.filters);
+    return (int)data.root;
+}
+
+// a delta only fits right behind what it was taken after
+inline void expectSlot(uint32_t first, size_t expected, const char *what){
+    if(first != expected){
+        throw std::runtime_error(std::string("checkpoint delta does not continue the ") + what + " of the chain");
+    }
+}
+
+// decodes a delta taken after nodeCount/valueCount/versionCount slots into the (empty) vectors for the new
+// slots, children and value ids may point into the earlier ones. Returns the root. The filters may belong to
+// earlier versions as well, the caller checks them against the roots.
+template<typename Key, typename Value, typename NodeT>
+uint32_t parseDelta(const char *bytes, size_t size, size_t nodeCount, size_t valueCount, size_t versionCount,
+                    std::vector<NodeT> &newNodes, std::vector<Value> &newValues, std::vector<uint32_t> &newRoots,
+                    std::vector<FilterRecord> &newFilters){
+    Cursor c{bytes, bytes + size, "checkpoint delta"};
+    expectMagic(c, DELTA_MAGIC, "checkpoint delta");
+    uint32_t root, first;
+    c.get(root);
+    c.get(first);
+    expectSlot(first, nodeCount, "nodes");
+    Section nodeSection = scanSection(c, "nodes");
+    c.get(first);
+    expectSlot(first, valueCount, "values");
+    Section valueSection = scanSection(c, "values");
+    c.get(first);
+    expectSlot(first, versionCount, "versions");
+    Section versionSection = scanSection(c, "versions");
+    Section filterSection = scanSection(c, "filters");
+    size_t nodeLimit = nodeCount + nodeSection.count, valueLimit = valueCount + valueSection.count;
+    if(root >= nodeLimit){
+        throw std::runtime_error("checkpoint delta root " + std::to_string(root) + " outside the " + std::to_string(nodeLimit) + " node slots");
+    }
+
+    decodeSection(nodeSection, newNodes, 0, [&](Cursor &block, NodeT &node, size_t i){
+        getNode(block, node, nodeCount + i, nodeLimit, valueLimit);
+    });
+    decodeSection(valueSection, newValues, 0, [](Cursor &block, Value &value, size_t){
+        block.get(value);
+    });
+    decodeSection(versionSection, newRoots, 0, [&](Cursor &block, uint32_t &versionRoot, size_t i){
+        getRoot(block, versionRoot, versionCount + i, nodeLimit);
+    });
+    decodeSection(filterSection, newFilters, 0, [](Cursor &block, FilterRecord &record, size_t){
+        getFilter(block, record);
+    });
+    return root;
+}
+
+}
+
+template<typename Key, typename Value>
+class Checkpointer{
+public:
+    struct Result{
+        bool base;                      // full image instead of a delta
+        int nodes, values, versions;    // slots written
+        size_t bytes;
+    };
+
+    explicit Checkpointer(const std::string &directory, size_t mergeAfter = 8)
+        : dir(directory), mergeAfter(mergeAfter) {}
+
+    ~Checkpointer(){
+        if(mergeThread.joinable())  mergeThread.join();
+    }
+
+    // the arenas were replaced (LOAD, replica sync), the next checkpoint has to be a full image
+    void invalidate(){
+        std::lock_guard<std::mutex> lock(mutex);
+        base.clear();
+        savedFilters.clear();
+    }
+
+    Result checkpoint(int root){
+        std::lock_guard<std::mutex> lock(mutex);
+        std::filesystem::create_directories(dir);
+        int nodeCount = nodes<Key, Value>.size(), valueCount = values<Value>.size();
+        int versionCount = versions<Key, Value>.size();
+        bool full = base.empty() || nodeCount < markNodes || valueCount < markValues || versionCount < markVersions;
+        if(full)  savedFilters.clear();
+
+        Result result{full, 0, 0, 0, 0};
+        std::vector<std::string> obsolete;
+        std::string file = fileName(full ? "base" : "delta");
+        {
+            std::ofstream os(dir / file, std::ios::binary);
+            if(full){
+                save_image<Key, Value>(os, root);
+                versionFilters<Key, Value>.forEachCurrent([&](int v, int, const BloomFilter &){ markFilterSaved(v); });
+                result.nodes = nodeCount - 1;
+                result.values = valueCount;
+                result.versions = versionCount;
+            }else{
+                writeDelta(os, root);
+                result.nodes = nodeCount - markNodes;
+                result.values = valueCount - markValues;
+                result.versions = versionCount - markVersions;
+            }
+            os.flush();
+            if(!os){
+                throw std::runtime_error("could not write " + (dir / file).string());
+            }
+            result.bytes = (size_t)os.tellp();
+        }
+        if(full){
+            if(!base.empty())  obsolete.push_back(base);
+            obsolete.insert(obsolete.end(), deltas.begin(), deltas.end());
+            base = file;
+            deltas.clear();
+        }else{
+            deltas.push_back(file);
+        }
+        writeManifest();
+        removeFiles(obsolete);
+        markNodes = nodeCount;
+        markValues = valueCount;
+        markVersions = versionCount;
+
+        if(deltas.size() >= mergeAfter && !merging){
+            if(mergeThread.joinable())  mergeThread.join();
+            merging = true;
+            mergeThread = std::thread(&Checkpointer::merge, this, base, deltas);
+        }
+        return result;
+    }
+
+    // decodes base + deltas of the manifest and only then replaces the arenas with them, returns the root.
+    // Throws std::runtime_error if any part of the chain is missing or bad (the arenas are left as they were then)
+    int restore(){
+        std::lock_guard<std::mutex> lock(mutex);
+        std::ifstream manifest(dir / "MANIFEST");
+        if(!manifest.is_open()){
+            throw std::runtime_error("no checkpoint in " + dir.string());
+        }
+        std::string kind, file, loadedBase;
+        std::vector<std::string> loadedDeltas;
+        image::ImageData<Key, Value> data;
+        while(manifest >> kind >> file){
+            std::unique_ptr<image::MappedFile> mapped;
+            try{
+                mapped = std::make_unique<image::MappedFile>((dir / file).string());
+            }catch(const std::exception &){
+                throw std::runtime_error("missing checkpoint file " + file);
+            }
+            if((kind != "base" || !loadedBase.empty()) && (kind != "delta" || loadedBase.empty())){
+                throw std::runtime_error("bad checkpoint manifest in " + dir.string());
+            }
+            try{
+                if(kind == "base"){
+                    image::readImageData(mapped->data(), mapped->size(), data);
+                    loadedBase = file;
+                }else{
+                    applyDelta(mapped->data(), mapped->size(), data);
+                    loadedDeltas.push_back(file);
+                }
+            }catch(const std::exception &e){
+                throw std::runtime_error(file + ": " + e.what());
+            }
+        }
+        if(loadedBase.empty()){
+            throw std::runtime_error("bad checkpoint manifest in " + dir.string());
+        }
+        savedFilters.clear();
+        for(auto &record : data.filters)  markFilterSaved(record.version);
+        int root = image::installImageData(std::move(data));
+        base = loadedBase;
+        deltas = loadedDeltas;
+        markNodes = nodes<Key, Value>.size();
+        markValues = values<Value>.size();
+        markVersions = versions<Key, Value>.size();
+        return root;
+    }
+
+    size_t deltaCount(){
+        std::lock_guard<std::mutex> lock(mutex);
+        return deltas.size();
+    }
+
+    bool mergeRunning() const { return merging; }
+
+    void waitForMerge(){
+        if(mergeThread.joinable())  mergeThread.join();
+    }
+
+private:
+    std::filesystem::path dir;
+    size_t mergeAfter;
+    std::mutex mutex;                   // base/deltas/manifest, shared with the merge thread
+    std::string base;                   // empty: no checkpoint yet (or invalidated)
+    std::vector<std::string> deltas;
+    int markNodes = 0, markValues = 0, markVersions = 0;     // arena sizes at the last checkpoint
+    std::vector<bool> savedFilters;     // versions whose Bloom filter is already in the chain
+    int nextFile = 0;
+    std::thread mergeThread;
+    std::atomic<bool> merging{false};
+
+    // numbers continue after the files already in the directory (earlier runs)
+    std::string fileName(const char *kind){
+        if(nextFile == 0){
+            std::error_code ignored;
+            for(auto &entry : std::filesystem::directory_iterator(dir, ignored)){
+                std::string name = entry.path().filename().string();
+                size_t dash = name.find('-');
+                if(dash != std::string::npos && name.size() > dash + 1 && isdigit((unsigned char)name[dash + 1])){
+                    nextFile = std::max(nextFile, std::stoi(name.substr(dash + 1)));
+                }
+            }
+        }
+        std::ostringstream name;
+        name << kind << "-" << std::setw(6) << std::setfill('0') << ++nextFile << ".img";
+        return name.str();
+    }
+
+    void writeDelta(std::ostream &os, int root){
+        os.write(image::DELTA_MAGIC, sizeof(image::DELTA_MAGIC));
+        image::write<uint32_t>(os, root);
+        image::write<uint32_t>(os, markNodes);
+        image::writeSection(os, nodes<Key, Value>.size() - markNodes, [&](std::string &out, size_t i){
+            const Node<Key, Value> &node = nodes<Key, Value>[markNodes + i];
+            image::putNode(out, node.key, node.hkey, node.vID, node.y, node.p.first, node.p.second);
+        });
+        image::write<uint32_t>(os, markValues);
+        image::writeSection(os, values<Value>.size() - markValues, [&](std::string &out, size_t i){
+            values<Value>.visit(markValues + i, [&](const Value &value){ image::put(out, value); });
+        });
+        image::write<uint32_t>(os, markVersions);
+        image::writeSection(os, versions<Key, Value>.size() - markVersions, [&](std::string &out, size_t i){
+            image::put<uint32_t>(out, versions<Key, Value>[markVersions + i].root);
+        });
+        // filters are built lazily (first VGET of a version), also for versions an earlier file already holds
+        std::vector<std::tuple<int, int, const BloomFilter*>> filters;
+        versionFilters<Key, Value>.forEachCurrent([&](int v, int versionRoot, const BloomFilter &filter){
+            if(v >= (int)savedFilters.size() || !savedFilters[v])  filters.emplace_back(v, versionRoot, &filter);
+        });
+        image::writeSection(os, filters.size(), [&](std::string &out, size_t i){
+            image::putFilter(out, std::get<0>(filters[i]), std::get<1>(filters[i]), *std::get<2>(filters[i]));
+        });
+        for(auto &filter : filters)  markFilterSaved(std::get<0>(filter));
+    }
+
+    void markFilterSaved(int version){
+        if(version >= (int)savedFilters.size())  savedFilters.resize(version + 1);
+        savedFilters[version] = true;
+    }
+
+    // appends one delta to an ImageData (restore and the merge thread)
+    static void applyDelta(const char *bytes, size_t size, image::ImageData<Key, Value> &data){
+        std::vector<image::NodeRecord<Key>> newNodes;
+        std::vector<Value> newValues;
+        std::vector<uint32_t> newRoots;
+        std::vector<image::FilterRecord> newFilters;
+        data.root = image::parseDelta<Key, Value>(bytes, size, data.nodes.size(), data.values.size(), data.versions.size(),
+                                                  newNodes, newValues, newRoots, newFilters);
+        std::move(newNodes.begin(), newNodes.end(), std::back_inserter(data.nodes));
+        std::move(newValues.begin(), newValues.end(), std::back_inserter(data.values));
+        data.versions.insert(data.versions.end(), newRoots.begin(), newRoots.end());
+        for(auto &record : newFilters){
+            if(record.version >= data.versions.size() || data.versions[record.version] != record.root
+               || record.filter.words().empty()){
+                throw std::runtime_error("checkpoint filter for version " + std::to_string(record.version) + " does not match it");
+            }
+        }
+        std::move(newFilters.begin(), newFilters.end(), std::back_inserter(data.filters));
+    }
+
+    // background: base + the given deltas -> new base. Checkpoints taken meanwhile only append deltas,
+    // those stay in the manifest behind the new base. If a full checkpoint replaced the base in between
+    // the result is thrown away.
+    void merge(std::string fromBase, std::vector<std::string> fromDeltas){
+        std::string merged;
+        try{
+            image::ImageData<Key, Value> data;
+            {
+                image::MappedFile mapped((dir / fromBase).string());
+                image::readImageData(mapped.data(), mapped.size(), data);
+            }
+            for(auto &delta : fromDeltas){
+                image::MappedFile mapped((dir / delta).string());
+                applyDelta(mapped.data(), mapped.size(), data);
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                merged = fileName("base");
+            }
+            std::ofstream os(dir / merged, std::ios::binary);
+            image::writeImageData(os, data);
+            os.flush();
+            if(!os)  throw std::runtime_error("could not write " + merged);
+        }catch(const std::exception &e){
+            std::cerr << "Checkpoint merge failed: " << e.what() << std::endl;
+            if(!merged.empty())  removeFiles({merged});
+            merging = false;
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        bool stillCurrent = base == fromBase && deltas.size() >= fromDeltas.size() &&
+                            std::equal(fromDeltas.begin(), fromDeltas.end(), deltas.begin());
+        if(stillCurrent){
+            base = merged;
+            deltas.erase(deltas.begin(), deltas.begin() + fromDeltas.size());
+            writeManifest();
+            fromDeltas.push_back(fromBase);
+            removeFiles(fromDeltas);
+        }else{
+            removeFiles({merged});
+        }
+        merging = false;
+    }
+
+    // written to a temporary file and renamed, a crash leaves either the old or the new manifest
+    void writeManifest(){
+        std::filesystem::path tmp = dir / "MANIFEST.tmp";
+        {
+            std::ofstream os(tmp);
+            os << "base " << base << "\n";
+            for(auto &delta : deltas)  os << "delta " << delta << "\n";
+        }
+        std::filesystem::rename(tmp, dir / "MANIFEST");
+    }
+
+    void removeFiles(const std::vector<std::string> &files){
+        for(auto &file : files){
+            std::error_code ignored;
+            std::filesystem::remove(dir / file, ignored);
+        }
+    }
+};
+
+#endif
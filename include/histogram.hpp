@@ -0,0 +1,111 @@
+#ifndef HISTOGRAM_HPP
+#define HISTOGRAM_HPP
+
+#include <atomic>
+#include <array>
+#include <cstdint>
+
+namespace kvdb {
+
+// Lock-free latency histogram with HdrHistogram-style log-linear buckets.
+// Every power of two is split into 2^SUB_BITS linear sub-buckets, so any recorded value is
+// reported with a relative error below 1/2^SUB_BITS (~3%) while the whole 64 bit range fits
+// in a fixed array. record() is a single relaxed fetch_add, cheap enough for the request path.
+class LatencyHistogram {
+public:
+    static constexpr int SUB_BITS = 5;
+    static constexpr int SUB_COUNT = 1 << SUB_BITS;
+    static constexpr int BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+    LatencyHistogram() { reset(); }
+
+    void record(uint64_t value) {
+        counts[indexOf(value)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+        uint64_t current = maxValue.load(std::memory_order_relaxed);
+        while (value > current && !maxValue.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+    }
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t max() const { return maxValue.load(std::memory_order_relaxed); }
+
+    double mean() const {
+        uint64_t n = count();
+        return n ? (double)sum.load(std::memory_order_relaxed) / n : 0.0;
+    }
+
+    // value at the given percentile (0-100), reported as the upper edge of its bucket
+    uint64_t percentile(double p) const {
+        uint64_t n = count();
+        if (n == 0) return 0;
+        uint64_t rank = (uint64_t)(p / 100.0 * n + 0.5);
+        if (rank < 1) rank = 1;
+        if (rank > n) rank = n;
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += counts[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                uint64_t upper = upperBound(i);
+                uint64_t highest = max();
+                return upper < highest ? upper : highest;
+            }
+        }
+        return max();
+    }
+
+    // number of recorded values <= bound, used for cumulative (Prometheus style) buckets
+    uint64_t countAtOrBelow(uint64_t bound) const {
+        uint64_t seen = 0;
+        int last = indexOf(bound);
+        for (int i = 0; i <= last; i++) {
+            seen += counts[i].load(std::memory_order_relaxed);
+        }
+        return seen;
+    }
+
+    uint64_t totalSum() const { return sum.load(std::memory_order_relaxed); }
+
+    void merge(const LatencyHistogram& other) {
+        for (int i = 0; i < BUCKETS; i++) {
+            uint64_t c = other.counts[i].load(std::memory_order_relaxed);
+            if (c) counts[i].fetch_add(c, std::memory_order_relaxed);
+        }
+        total.fetch_add(other.count(), std::memory_order_relaxed);
+        sum.fetch_add(other.sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        uint64_t otherMax = other.max();
+        uint64_t current = maxValue.load(std::memory_order_relaxed);
+        while (otherMax > current && !maxValue.compare_exchange_weak(current, otherMax, std::memory_order_relaxed)) {}
+    }
+
+    void reset() {
+        for (auto& c : counts) c.store(0, std::memory_order_relaxed);
+        total.store(0, std::memory_order_relaxed);
+        sum.store(0, std::memory_order_relaxed);
+        maxValue.store(0, std::memory_order_relaxed);
+    }
+
+    static int indexOf(uint64_t value) {
+        if (value < (uint64_t)SUB_COUNT) return (int)value;
+        int msb = 63 - __builtin_clzll(value);
+        int shift = msb - SUB_BITS;
+        return ((shift + 1) << SUB_BITS) + (int)((value >> shift) - SUB_COUNT);
+    }
+
+    static uint64_t upperBound(int index) {
+        if (index < SUB_COUNT) return (uint64_t)index;
+        int shift = (index >> SUB_BITS) - 1;
+        uint64_t sub = (uint64_t)(index & (SUB_COUNT - 1)) + SUB_COUNT;
+        return ((sub + 1) << shift) - 1;
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, BUCKETS> counts;
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> maxValue;
+};
+
+}
+
+#endif
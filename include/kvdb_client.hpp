@@ -0,0 +1,123 @@
+#ifndef KVDB_CLIENT_HPP
+#define KVDB_CLIENT_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <future>
+#include <functional>
+#include <optional>
+#include <utility>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <cstdint>
+
+namespace kvdb {
+
+// Called with the raw reply line (without the trailing newline), e.g. "OK value" or "ERROR Key not found".
+// A SCANAT reply ("OK <n>" and n more lines) is collected first and handed over as one string, the lines
+// joined by '\n'. If the connection drops before the reply arrives the callback gets "ERROR Connection closed".
+using ReplyCallback = std::function<void(const std::string&)>;
+
+// Called with everything after "NOTIFICATION " for events of keys watched through this client.
+using NotificationHandler = std::function<void(const std::string&)>;
+
+// One TCP connection to the server. Commands are pipelined: send() only writes the command and
+// queues the completion, a reader thread matches replies to completions in order (the server answers
+// every command of a connection in the order it was sent). NOTIFICATION lines are pushed by the server
+// at any time and are routed to the notification handler instead of a pending command.
+class Connection {
+public:
+    Connection(const std::string& host, int port);
+    ~Connection();
+
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+
+    bool isConnected() const;
+    void close();
+
+    void send(const std::string& command, ReplyCallback callback);
+    std::future<std::string> send(const std::string& command);
+
+    // writes all commands with a single send, callbacks[i] completes commands[i]
+    void sendBatch(const std::vector<std::string>& commands, std::vector<ReplyCallback> callbacks);
+
+    // one command the server answers with one line per callback (MGET), callbacks[i] gets line i
+    void sendMultiReply(const std::string& command, std::vector<ReplyCallback> callbacks);
+
+    void setNotificationHandler(NotificationHandler handler);
+
+private:
+    int socketFd;
+    std::atomic<bool> connected;
+
+    std::mutex writeMutex;                  // keeps the order of queued completions equal to the order on the wire
+    struct Pending {
+        ReplyCallback callback;
+        bool counted = false;               // "OK <n>" is followed by n lines of the same reply (SCANAT)
+    };
+    std::mutex pendingMutex;
+    std::deque<Pending> pending;
+
+    std::mutex handlerMutex;
+    NotificationHandler notificationHandler;
+
+    std::thread readerThread;
+
+    bool writeAll(const std::string& data);
+    void queueAndWrite(const std::string& data, std::vector<ReplyCallback> callbacks, std::vector<bool> counted = {});
+    void readLoop();
+    void failPending();
+};
+
+// Pool of connections to one server. Every call picks the next connection round-robin so independent
+// requests spread over several sockets, while batches stay on one connection and go out in one write.
+class Client {
+public:
+    Client(const std::string& host = "127.0.0.1", int port = 8080, int poolSize = 4);
+
+    bool isConnected() const;
+
+    // raw commands, e.g. command("SNAPSHOT")
+    std::future<std::string> command(const std::string& command);
+    void command(const std::string& command, ReplyCallback callback);
+
+    std::future<std::optional<std::string>> get(const std::string& key);
+    std::future<std::optional<std::string>> vget(int version, const std::string& key);
+    std::future<bool> set(const std::string& key, const std::string& value);
+    std::future<bool> edit(const std::string& key, const std::string& value);
+    std::future<bool> del(const std::string& key);
+
+    // multi-key helpers, results are in the same order as the input. mget is a single MGET (the server looks
+    // the keys up as one batch), mset pipelines one SET per item
+    std::future<std::vector<std::optional<std::string>>> mget(const std::vector<std::string>& keys);
+    std::future<std::vector<bool>> mset(const std::vector<std::pair<std::string, std::string>>& items);
+
+    // SCANAT: the keys starting with prefix and their values as they were at `time` (anything GETAT takes),
+    // sorted by key. nullopt when the server has no version that old (or the time doesn't parse)
+    std::future<std::optional<std::vector<std::pair<std::string, std::string>>>> scanAt(const std::string& time,
+                                                                                       const std::string& prefix = "");
+
+    // watches are registered on a dedicated connection, notifications of every connection go to the handler
+    std::future<bool> watch(const std::string& key, const std::string& operation = "ALL");
+    // resume a watch after a reconnect: changes after `sequence` are replayed first, notifications then
+    // start with their sequence number ("<seq> SET key value"), remember the last one to resume from
+    std::future<bool> watchFrom(const std::string& key, uint64_t sequence, const std::string& operation = "ALL");
+    std::future<bool> unwatch(const std::string& key, const std::string& operation = "ALL");
+    void onNotification(NotificationHandler handler);
+
+private:
+    std::vector<std::unique_ptr<Connection>> pool;
+    std::atomic<unsigned> nextConnection{0};
+
+    Connection& pick();
+    Connection& watchConnection();
+    std::future<bool> okCommand(Connection& conn, const std::string& command);
+};
+
+}
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef METRICS_SERVER_HPP
+#define METRICS_SERVER_HPP
+
+#include <string>
+#include <thread>
+#include <atomic>
+#include <functional>
+
+namespace kvdb {
+
+// Minimal HTTP listener for Prometheus scrapes. It runs on its own thread and answers every request
+// with the text produced by the render callback, which must only read thread-safe counters (atomics)
+// so a scrape never has to go through the server's request loop.
+class MetricsServer {
+public:
+    MetricsServer(const std::string& host, int port, std::function<std::string()> render);
+    ~MetricsServer();
+
+    bool start();
+    void stop();
+
+private:
+    std::string host;
+    int port;
+    std::function<std::string()> render;
+    int listenSocket;
+    std::atomic<bool> running;
+    std::thread listenerThread;
+
+    void listenLoop();
+    void handleRequest(int clientSocket);
+};
+
+}
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef READ_CACHE_HPP
+#define READ_CACHE_HPP
+
+#include <string>
+#include <string_view>
+#include <list>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+
+namespace kvdb {
+
+// Hot key -> value slot cache in front of the treap, so a GET of a hot key is one hash probe instead of a
+// root-to-leaf descent. Value slots are never modified, so an entry stays right until its key is written
+// (forget) or the whole store is replaced (invalidateAll, e.g. CHANGE/LOAD/RESTORE). invalidateAll only bumps
+// the epoch, entries of an older epoch are treated as misses and overwritten lazily.
+//
+// One LRU list plus an index into it: a hit moves the entry to the front and a full cache evicts the back,
+// so hot keys stay while stale ones (older epoch, never hit again) age out first. Used from the server loop
+// only, no locking.
+class ReadCache {
+public:
+    explicit ReadCache(size_t capacity) : capacity(std::max<size_t>(1, capacity)) {}
+
+    // value slot of key, or -1
+    int lookup(const std::string& key) {
+        auto it = index.find(key);
+        if (it == index.end() || it->second->epoch != epoch) {
+            misses++;
+            return -1;
+        }
+        hits++;
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->slot;
+    }
+
+    void insert(const std::string& key, int slot) {
+        auto it = index.find(key);
+        if (it != index.end()) {
+            it->second->slot = slot;
+            it->second->epoch = epoch;
+            lru.splice(lru.begin(), lru, it->second);
+            return;
+        }
+        if (index.size() >= capacity) {
+            // the evicted node is reused for the new key, a full cache allocates nothing per insert
+            index.erase(lru.back().key);
+            lru.splice(lru.begin(), lru, std::prev(lru.end()));
+            lru.front().key = key;
+            lru.front().slot = slot;
+            lru.front().epoch = epoch;
+        } else {
+            lru.push_front(Entry{key, slot, epoch});
+        }
+        index.emplace(lru.front().key, lru.begin());
+    }
+
+    void forget(const std::string& key) {
+        auto it = index.find(key);
+        if (it != index.end()) {
+            auto entry = it->second;
+            index.erase(it);
+            lru.erase(entry);
+        }
+    }
+
+    void invalidateAll() {
+        epoch++;
+    }
+
+    uint64_t hitCount() const { return hits; }
+    uint64_t missCount() const { return misses; }
+    size_t size() const { return index.size(); }
+
+private:
+    struct Entry {
+        std::string key;
+        int slot;
+        uint64_t epoch;
+    };
+    // most recently used first, the index keys point into the list nodes (stable while they are linked)
+    std::list<Entry> lru;
+    std::unordered_map<std::string_view, std::list<Entry>::iterator> index;
+    size_t capacity;
+    uint64_t epoch = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+}
+
+#endif
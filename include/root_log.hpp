@@ -0,0 +1,66 @@
+#ifndef ROOT_LOG_HPP
+#define ROOT_LOG_HPP
+
+#include <deque>
+#include <algorithm>
+#include <cstdint>
+
+namespace kvdb {
+
+// Root of the store after every batch of commands that changed it, with the wall clock time the batch was
+// committed at. Nodes are never freed, so every logged root is an implicit snapshot: GETAT/SCANAT find the
+// root in effect at a moment by binary search and read it like a version, without anyone having issued
+// SNAPSHOT. An entry is 16 bytes; once more than `capacity` are retained the oldest ones are forgotten.
+// A LOAD/RESTORE replaces the node arena, which makes the old roots meaningless, so the server reset()s the
+// log to the loaded root then. Only used from the server loop, no locking.
+class RootLog {
+public:
+    struct Entry {
+        int64_t timeMs;
+        int root;
+    };
+
+    explicit RootLog(size_t capacity = 1 << 22) : maxEntries(capacity) {}
+
+    // nothing is logged while the root stays the same; a clock that steps back is clamped so the log
+    // stays sorted
+    void record(int64_t timeMs, int root) {
+        if (!entries.empty()) {
+            if (entries.back().root == root) {
+                return;
+            }
+            timeMs = std::max(timeMs, entries.back().timeMs);
+        }
+        entries.push_back({timeMs, root});
+        if (entries.size() > maxEntries) {
+            entries.pop_front();
+        }
+    }
+
+    void reset(int64_t timeMs, int root) {
+        entries.clear();
+        entries.push_back({timeMs, root});
+    }
+
+    // root of the last batch committed at or before timeMs, false if that is older than the log
+    bool rootAt(int64_t timeMs, int& root) const {
+        auto it = std::upper_bound(entries.begin(), entries.end(), timeMs,
+                                   [](int64_t time, const Entry& entry) { return time < entry.timeMs; });
+        if (it == entries.begin()) {
+            return false;
+        }
+        root = std::prev(it)->root;
+        return true;
+    }
+
+    size_t size() const { return entries.size(); }
+    int64_t firstTime() const { return entries.empty() ? 0 : entries.front().timeMs; }
+
+private:
+    std::deque<Entry> entries;
+    size_t maxEntries;
+};
+
+}
+
+#endif
@@ -2,12 +2,24 @@
 #define SERVER_HPP
 
 #include "PersistentTreap.hpp"
+#include "checkpoint.hpp"
 #include "watch_manager.hpp"
+#include "change_log.hpp"
+#include "change_feed.hpp"
+#include "read_cache.hpp"
+#include "bloom.hpp"
+#include "root_log.hpp"
+#include "stats.hpp"
+#include "metrics_server.hpp"
 #include <string>
 #include <thread>
 #include <atomic>
 #include <vector>
+#include <map>
+#include <unordered_map>
 #include <mutex>
+#include <memory>
+#include <chrono>
 
 namespace kvdb {
 
@@ -20,6 +32,14 @@ public:
     void stop();            // stop server
     bool isRunning() const; // check if server is running
 
+    void enableMetrics(int metricsPort);    // serve Prometheus metrics on this port (call before start)
+    void replicaOf(const std::string& leaderHost, int leaderPort);  // run as read-only follower (call before start)
+    void enableCheckpoints(int intervalSeconds);    // CHECKPOINT every intervalSeconds (call before start)
+    void enableValueDedup();                        // identical values share one slot (call before start)
+    void enableValueSpill(size_t thresholdBytes, size_t cacheBytes);    // large values to a value log (call before start)
+    void enableReadCache(size_t entries);           // cache hot keys for GET (call before start)
+    void enableVersionFilters();                    // Bloom filters answer VGET misses (call before start)
+
 private:
     std::atomic<int> clientCounter{0};          // shared variable hence atomic for thread safety
     std::string host;
@@ -35,9 +55,99 @@ private:
     // Watch manager for event notifications
     WatchManager watchManager;
 
+    // Latest mutations with their sequence numbers, replayed to watches resumed with FROM <seq>
+    // and streamed to SUBSCRIBE CHANGES connections
+    ChangeLog changeLog;
+    ChangeFeed changeFeed{changeLog};
+    void recordChange(ChangeType type, const std::string& key, const std::string& value);
+
+    // Replication. A leader answers SYNC with a binary image of the store and then streams the change feed
+    // on that connection; a follower (leaderPort > 0) keeps such a connection open, applies what arrives
+    // and rejects writes from its own clients. All of it runs on the server loop.
+    std::string leaderHost;
+    int leaderPort = 0;
+    int leaderSocket = -1;
+    std::string leaderBuffer;                   // bytes from the leader not processed yet
+    bool awaitingImage = false;                 // SYNC sent, changes before the image are skipped
+    size_t imageBytes = 0;                      // size of the image body being received
+    uint64_t leaderSequence = 0;                // last leader change applied
+    std::chrono::steady_clock::time_point nextLeaderAttempt;
+    bool leaderConnecting = false;              // non-blocking connect in progress, finished on EPOLLOUT
+    bool isReplica() const { return leaderPort > 0; }
+    void connectToLeader(int epollFd);
+    void finishLeaderConnect(int epollFd);
+    void disconnectFromLeader(int epollFd);
+    void readFromLeader(int epollFd);
+    void requestSync();
+    bool applyFromLeader(const std::string& line);  // false for a line that doesn't parse
+
+    // CHECKPOINT [name]: incremental checkpoints into ../save/<name>/, RESTORE [name] loads them back
+    std::unique_ptr<Checkpointer<std::string, std::string>> checkpointer;
+    std::string checkpointName;
+    int checkpointInterval = 0;
+    std::chrono::steady_clock::time_point nextCheckpoint;
+    Checkpointer<std::string, std::string>& checkpointerFor(const std::string& name);
+    std::string runCheckpoint(const std::string& name);
+
+    // GET key -> value slot cache, kept in step by recordChange (--read-cache)
+    std::unique_ptr<ReadCache> readCache;
+
+    // VGET consults the snapshot's Bloom filter (bloom.hpp) before walking it (--version-filters)
+    bool versionFiltersEnabled = false;
+
+    // Named branches: writable roots forked from a snapshot or another head in O(1), sharing nodes with
+    // everything else. A connection that CHECKOUTs a branch runs its data commands there (executeOnBranch).
+    // Branches are local to this server: their writes skip the change log, watches, replicas and the read
+    // cache, their snapshots are their own, and they are dropped when the store is replaced (RELOAD).
+    struct Branch {
+        Treap<std::string, std::string> store;
+        std::vector<int> snapshots;             // roots of the branch's SNAPSHOTs, its VGET/CHANGE versions
+    };
+    std::map<std::string, Branch> branches;
+    std::unordered_map<int, std::string> checkedOut;    // client socket -> branch
+
+    // Root and time of every batch that changed the store, read by GETAT/SCANAT
+    RootLog rootLog;
+    uint64_t rootLogGeneration = 0;             // node arena generation the logged roots belong to
+    void commitRoot();                          // log store.root after a batch (server loop only)
+
+    // Counters and latency histograms reported by STATS/INFO
+    ServerStats stats;
+
+    // Optional Prometheus endpoint, runs on its own thread
+    int metricsPort = 0;
+    std::unique_ptr<MetricsServer> metricsServer;
+    std::string metricsText();
+    void publishStoreStats();                   // copy arena sizes into stats (server loop only)
+
+    // Reply to a command. Reads borrow the value straight from values<Value> instead of copying it into
+    // the reply, the header and the value are then sent together with one vectored write.
+    struct Response {
+        std::string head;                       // full reply text, or the "OK " header when value is set
+        const std::string* value = nullptr;     // borrowed from value storage, only valid until the next write
+        Response(std::string text) : head(std::move(text)) {}
+        Response(const char* text) : head(text) {}
+        Response(std::string header, const std::string* borrowed) : head(std::move(header)), value(borrowed) {}
+    };
+
     void serverLoop();                          // ?
     void handleClient(int clientSocket);        // ?
-    std::string processCommand(const std::string& command, int clientSocket);           //  execute the command on treap
+    Response processCommand(const std::string& command, int clientSocket);              //  execute the command on treap
+    void sendResponse(int clientSocket, Response&& response);                           //  scatter-gather write of the reply
+
+    // Reply bytes a client's socket would not take yet. They are written when epoll reports the socket
+    // writable instead of blocking the loop; while more than MAX_OUTBOX is queued the connection's further
+    // commands wait in partialBuffer, so a client that never reads can't grow it without bound.
+    struct Outbox {
+        std::string pending;
+        size_t written = 0;
+    };
+    static constexpr size_t MAX_OUTBOX = 4 << 20;
+    std::unordered_map<int, Outbox> outboxes;           // client socket -> unsent reply tail
+    int loopEpollFd = -1;
+    void watchWritable(int clientSocket, bool wantWrite);   // EPOLLOUT interest (outbox or change feed)
+    void flushOutbox(int clientSocket);                     // socket became writable
+    bool outboxFull(int clientSocket) const;
 
     struct Command {                            // This structre will store our command which will later be fed to Treap orz
         std::string operation;
@@ -46,7 +156,24 @@ private:
         int version;
         int clientSocket;
     };
+
+    // MULTI ... EXEC: the writes a connection queued, applied to a private copy of the root at EXEC and
+    // published only if all of them succeed and none of their keys was written by someone else since the
+    // transaction's base sequence (main store), or the branch root has not moved since MULTI (branch)
+    struct Transaction {
+        uint64_t sequence;                      // changes after it conflict with the queued keys (main store)
+        std::string branch;                     // checked out at MULTI, empty for the main store
+        int branchRoot = 0;                     // the branch's root at MULTI
+        std::vector<Command> queued;
+    };
+    std::unordered_map<int, Transaction> transactions;     // client socket -> open transaction
+
     Command parseCommand(const std::string& commandStr);    // parse the command
+    Response executeCommand(const Command& cmd);            // run a parsed command
+    Response executeOnBranch(const Command& cmd, Branch& branch);   // run a data command on a branch
+    Response executeTransaction(int clientSocket);          // EXEC
+    static std::string applyWrite(Treap<std::string, std::string>& target, const Command& cmd);  // "" or the error
+    std::string statsReport(bool live);                     // body of the STATS/INFO reply
 };
 
 }
@@ -0,0 +1,655 @@
+#ifndef SNAPSHOT_IMAGE_HPP
+#define SNAPSHOT_IMAGE_HPP
+
+// Binary image of the whole store: every node and value slot plus the current root and the version roots.
+// Same content as save()/load() in PersistentTreap.hpp, but fixed width integers and length prefixed strings
+// instead of text, so keys/values may contain spaces and nothing has to be parsed with >>.
+// Used by STORE/LOAD, checkpoints and to bootstrap replicas (SYNC), the slots keep their indices so the
+// version roots stay valid.
+//
+//      "KVDBIMG4"
+//      u32 root
+//      section nodes:    key, u64 hkey, i32 vID, i32 y, i32 left, i32 right   (slot 0 is not stored)
+//      section values:   value
+//      section versions: u32 root per version
+//      section filters:  u32 version, u32 root, u32 hashes, u32 words, u64 words  (built Bloom filters, bloom.hpp)
+//      block index:      per section u32 blocks, per block u64 offset, u64 first record, u32 records
+//      u64 offset of the block index, "KVDBIDX1"
+//
+// a section is a u32 record count followed by blocks of up to BLOCK_RECORDS records:
+//
+//      u32 records, u64 raw bytes, u64 stored bytes, u32 crc32 of the stored bytes, payload
+//
+// the payload is compressed with block_codec.hpp unless that did not make it smaller (stored == raw).
+// Offsets are from the start of the image. The index lets ImageReader look up a key in one version of an
+// image file while decompressing only the blocks on the path.
+//
+// The loader maps the file (or takes the buffer it was received in), walks the block headers once and then
+// checks and decodes the blocks on all cores. Every block is checksummed and every child index, value id and
+// version root is checked against the slot counts, a damaged image is rejected with the block or slot that
+// is wrong instead of producing a tree that crashes later.
+//
+// strings are u32 length + bytes, arithmetic types are stored as they are in memory (same host/arch).
+
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <exception>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <type_traits>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <unordered_map>
+#include <tuple>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "PersistentTreap.hpp"
+#include "block_codec.hpp"
+#include "bloom.hpp"
+
+namespace image {
+
+constexpr char MAGIC[8] = {'K', 'V', 'D', 'B', 'I', 'M', 'G', '4'};
+constexpr char INDEX_MAGIC[8] = {'K', 'V', 'D', 'B', 'I', 'D', 'X', '1'};
+constexpr uint32_t BLOCK_RECORDS = 4096;
+
+inline uint32_t crc32(const char *data, size_t length){
+    static const auto table = []{
+        std::vector<uint32_t> t(256);
+        for(uint32_t i = 0; i < 256; i++){
+            uint32_t c = i;
+            for(int k = 0; k < 8; k++)  c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[i] = c;
+        }
+        return t;
+    }();
+    uint32_t crc = 0xFFFFFFFFu;
+    for(size_t i = 0; i < length; i++){
+        crc = table[(crc ^ (uint8_t)data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+template<typename T>
+void write(std::ostream &os, const T &field){
+    static_assert(std::is_arithmetic_v<T>, "only strings and arithmetic types can be stored in an image");
+    os.write(reinterpret_cast<const char*>(&field), sizeof(T));
+}
+
+// block payloads are built in memory first, the checksum goes in front of them
+template<typename T>
+void put(std::string &out, const T &field){
+    static_assert(std::is_arithmetic_v<T>, "only strings and arithmetic types can be stored in an image");
+    out.append(reinterpret_cast<const char*>(&field), sizeof(T));
+}
+
+inline void put(std::string &out, const std::string &field){
+    put<uint32_t>(out, (uint32_t)field.size());
+    out.append(field);
+}
+
+// bounds checked reads from a mapped file or a block, `what` names the place in errors
+struct Cursor{
+    const char *p, *end;
+    std::string what;
+
+    template<typename T>
+    void get(T &field){
+        static_assert(std::is_arithmetic_v<T>, "only strings and arithmetic types can be stored in an image");
+        need(sizeof(T));
+        std::memcpy(&field, p, sizeof(T));
+        p += sizeof(T);
+    }
+
+    void get(std::string &field){
+        uint32_t length;
+        get(length);
+        need(length);
+        field.assign(p, length);
+        p += length;
+    }
+
+    void need(size_t bytes){
+        if((size_t)(end - p) < bytes){
+            throw std::runtime_error(what + " truncated");
+        }
+    }
+};
+
+// one node slot as stored in images and checkpoint deltas
+template<typename Key>
+struct NodeRecord{
+    Key key;
+    uint64_t hkey;
+    int32_t vID, y, left, right;
+};
+
+template<typename Key>
+void putNode(std::string &out, const Key &key, uint64_t hkey, int32_t vID, int32_t y, int32_t left, int32_t right){
+    put(out, key);
+    put<uint64_t>(out, hkey);
+    put<int32_t>(out, vID);
+    put<int32_t>(out, y);
+    put<int32_t>(out, left);
+    put<int32_t>(out, right);
+}
+
+template<typename Key>
+void setChildren(NodeRecord<Key> &node, int32_t left, int32_t right){
+    node.left = left;
+    node.right = right;
+}
+
+template<typename Key, typename Value>
+void setChildren(Node<Key, Value> &node, int32_t left, int32_t right){
+    node.p = {left, right};
+}
+
+// decodes a node into a NodeRecord or straight into a Node<Key, Value>, children must be below nodeLimit
+// and the value id below valueLimit
+template<typename NodeT>
+void getNode(Cursor &c, NodeT &node, size_t slot, size_t nodeLimit, size_t valueLimit){
+    int32_t left, right;
+    c.get(node.key);
+    c.get(node.hkey);
+    c.get(node.vID);
+    c.get(node.y);
+    c.get(left);
+    c.get(right);
+    if(left < 0 || right < 0 || (size_t)left >= nodeLimit || (size_t)right >= nodeLimit){
+        throw std::runtime_error("node " + std::to_string(slot) + " has child " + std::to_string((size_t)left >= nodeLimit || left < 0 ? left : right)
+                                 + " outside the " + std::to_string(nodeLimit) + " node slots");
+    }
+    if(node.vID < 0 || (size_t)node.vID >= valueLimit){
+        throw std::runtime_error("node " + std::to_string(slot) + " refers to value " + std::to_string(node.vID)
+                                 + " outside the " + std::to_string(valueLimit) + " value slots");
+    }
+    setChildren(node, left, right);
+}
+
+inline void getRoot(Cursor &c, uint32_t &root, size_t slot, size_t nodeLimit){
+    c.get(root);
+    if(root >= nodeLimit){
+        throw std::runtime_error("version " + std::to_string(slot) + " has root " + std::to_string(root)
+                                 + " outside the " + std::to_string(nodeLimit) + " node slots");
+    }
+}
+
+// Bloom filter of one version
+struct FilterRecord{
+    uint32_t version, root;
+    BloomFilter filter;
+};
+
+inline void putFilter(std::string &out, uint32_t version, uint32_t root, const BloomFilter &filter){
+    put<uint32_t>(out, version);
+    put<uint32_t>(out, root);
+    put<uint32_t>(out, filter.hashCount());
+    put<uint32_t>(out, (uint32_t)filter.words().size());
+    out.append(reinterpret_cast<const char*>(filter.words().data()), filter.words().size() * sizeof(uint64_t));
+}
+
+inline void getFilter(Cursor &c, FilterRecord &record){
+    uint32_t hashes, count;
+    c.get(record.version);
+    c.get(record.root);
+    c.get(hashes);
+    c.get(count);
+    c.need((size_t)count * sizeof(uint64_t));
+    std::vector<uint64_t> words(count);
+    std::memcpy(words.data(), c.p, (size_t)count * sizeof(uint64_t));
+    c.p += (size_t)count * sizeof(uint64_t);
+    record.filter = BloomFilter(hashes, std::move(words));
+}
+
+struct Block{
+    const char *data;
+    uint64_t rawBytes, bytes;
+    uint32_t crc;
+    size_t first, count;    // records
+};
+
+struct Section{
+    std::string name;
+    size_t count = 0;
+    std::vector<Block> blocks;
+};
+
+// where a block starts, for the block index
+struct BlockRef{
+    uint64_t offset, first;
+    uint32_t records;
+};
+
+inline void readBlockHeader(Cursor &c, Block &block, uint32_t &records){
+    c.get(records);
+    c.get(block.rawBytes);
+    c.get(block.bytes);
+    c.get(block.crc);
+    c.need(block.bytes);
+    block.data = c.p;
+    c.p += block.bytes;
+}
+
+// walks the block headers of a section without touching the payloads
+inline Section scanSection(Cursor &c, const std::string &name){
+    Section section;
+    section.name = c.what + " " + name;
+    uint32_t total;
+    c.get(total);
+    while(section.count < total){
+        Block block;
+        uint32_t records;
+        readBlockHeader(c, block, records);
+        if(records == 0 || records > total - section.count){
+            throw std::runtime_error(section.name + " block " + std::to_string(section.blocks.size()) + " has a bad record count");
+        }
+        block.first = section.count;
+        block.count = records;
+        section.count += records;
+        section.blocks.push_back(block);
+    }
+    return section;
+}
+
+// runs task(0) .. task(count - 1) on all cores, rethrows the first exception
+template<typename Task>
+void parallelFor(size_t count, Task task){
+    size_t threads = std::min<size_t>(count, std::max(1u, std::thread::hardware_concurrency()));
+    if(threads <= 1){
+        for(size_t i = 0; i < count; i++)  task(i);
+        return;
+    }
+    std::atomic<size_t> next{0};
+    std::exception_ptr error;
+    std::mutex errorMutex;
+    auto work = [&]{
+        try{
+            for(size_t i; (i = next++) < count; )  task(i);
+        }catch(...){
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if(!error)  error = std::current_exception();
+            next = count;
+        }
+    };
+    std::vector<std::thread> pool;
+    for(size_t t = 1; t < threads; t++)  pool.emplace_back(work);
+    work();
+    for(auto &thread : pool)  thread.join();
+    if(error)  std::rethrow_exception(error);
+}
+
+// writes records [0, count) as a section, put(out, i) appends record i. Blocks are built and compressed on
+// all cores, a batch at a time. Returns where the blocks went (tellp of os).
+template<typename Put>
+std::vector<BlockRef> writeSection(std::ostream &os, size_t count, Put put){
+    write<uint32_t>(os, (uint32_t)count);
+    std::vector<BlockRef> refs;
+    size_t blocks = (count + BLOCK_RECORDS - 1) / BLOCK_RECORDS;
+    const size_t batch = 64;
+    std::vector<std::string> raw(std::min(batch, blocks)), packed(raw.size());
+    for(size_t firstBlock = 0; firstBlock < blocks; firstBlock += batch){
+        size_t n = std::min(batch, blocks - firstBlock);
+        parallelFor(n, [&](size_t b){
+            size_t first = (firstBlock + b) * BLOCK_RECORDS, last = std::min<size_t>(count, first + BLOCK_RECORDS);
+            raw[b].clear();
+            for(size_t i = first; i < last; i++)  put(raw[b], i);
+            packed[b].clear();
+            codec::compress(raw[b].data(), raw[b].size(), packed[b]);
+        });
+        for(size_t b = 0; b < n; b++){
+            size_t first = (firstBlock + b) * BLOCK_RECORDS;
+            uint32_t records = (uint32_t)(std::min<size_t>(count, first + BLOCK_RECORDS) - first);
+            const std::string &payload = packed[b].size() < raw[b].size() ? packed[b] : raw[b];
+            refs.push_back({(uint64_t)os.tellp(), first, records});
+            write<uint32_t>(os, records);
+            write<uint64_t>(os, raw[b].size());
+            write<uint64_t>(os, payload.size());
+            write<uint32_t>(os, crc32(payload.data(), payload.size()));
+            os.write(payload.data(), payload.size());
+        }
+    }
+    return refs;
+}
+
+// checks one block and decodes its records into slots[0, block.count), get(cursor, slot, i) decodes record i
+template<typename T, typename Get>
+void decodeBlock(const Block &block, const std::string &where, T *slots, size_t firstIndex, Get &get){
+    if(crc32(block.data, block.bytes) != block.crc){
+        throw std::runtime_error("checksum mismatch in " + where);
+    }
+    const char *payload = block.data;
+    std::string inflated;
+    if(block.rawBytes != block.bytes){
+        // no block inflates beyond 255:1, this keeps a damaged header from allocating wildly
+        if(block.rawBytes > block.bytes * 255 + 16 || !codec::decompress(block.data, block.bytes, inflated, block.rawBytes)){
+            throw std::runtime_error("bad compressed data in " + where);
+        }
+        payload = inflated.data();
+    }
+    Cursor c{payload, payload + block.rawBytes, where};
+    for(size_t i = 0; i < block.count; i++){
+        get(c, slots[i], firstIndex + i);
+    }
+    if(c.p != c.end){
+        throw std::runtime_error(where + " has trailing bytes");
+    }
+}
+
+// checks and decodes the blocks of a section into slots[offset + record], get(cursor, slot, index) decodes one
+template<typename T, typename Get>
+void decodeSection(const Section &section, std::vector<T> &slots, size_t offset, Get get){
+    slots.resize(offset + section.count);
+    parallelFor(section.blocks.size(), [&](size_t b){
+        const Block &block = section.blocks[b];
+        decodeBlock(block, section.name + " block " + std::to_string(b), &slots[offset + block.first], offset + block.first, get);
+    });
+}
+
+inline void expectMagic(Cursor &c, const char (&expected)[8], const char *what){
+    if((size_t)(c.end - c.p) < sizeof(expected) || std::memcmp(c.p, expected, sizeof(expected)) != 0){
+        throw std::runtime_error(std::string("not a kvdb ") + what);
+    }
+    c.p += sizeof(expected);
+}
+
+constexpr int SECTIONS = 4;     // nodes, values, versions, filters
+
+inline void writeIndex(std::ostream &os, std::streampos start, const std::vector<BlockRef> (&sections)[SECTIONS]){
+    uint64_t indexOffset = (uint64_t)(os.tellp() - start);
+    for(auto &refs : sections){
+        write<uint32_t>(os, (uint32_t)refs.size());
+        for(auto &ref : refs){
+            write<uint64_t>(os, ref.offset - (uint64_t)start);
+            write<uint64_t>(os, ref.first);
+            write<uint32_t>(os, ref.records);
+        }
+    }
+    write<uint64_t>(os, indexOffset);
+    os.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+}
+
+// offset of the block index from the trailer at the end of an image
+inline uint64_t indexOffset(const char *data, size_t size){
+    Cursor tail{data + size - std::min<size_t>(size, 16), data + size, "image index"};
+    uint64_t offset;
+    tail.get(offset);
+    expectMagic(tail, INDEX_MAGIC, "image index");
+    if(offset > size - 16){
+        throw std::runtime_error("image index truncated");
+    }
+    return offset;
+}
+
+// nodeSlots[0] is the unused slot 0, returns the root. Only the output vectors are touched.
+template<typename Key, typename Value, typename NodeT>
+uint32_t parseImage(const char *data, size_t size, std::vector<NodeT> &nodeSlots, std::vector<Value> &valueSlots,
+                    std::vector<uint32_t> &roots, std::vector<FilterRecord> &filters){
+    Cursor c{data, data + size, "image"};
+    expectMagic(c, MAGIC, "image");
+    uint32_t root;
+    c.get(root);
+    Section nodeSection = scanSection(c, "nodes");
+    Section valueSection = scanSection(c, "values");
+    Section versionSection = scanSection(c, "versions");
+    Section filterSection = scanSection(c, "filters");
+    // the block index is not needed here, but a file cut short loses it first
+    if(indexOffset(data, size) != (uint64_t)(c.p - data)){
+        throw std::runtime_error("image index does not follow the sections");
+    }
+    size_t nodeLimit = nodeSection.count + 1, valueLimit = valueSection.count;
+    if(root >= nodeLimit){
+        throw std::runtime_error("image root " + std::to_string(root) + " outside the " + std::to_string(nodeLimit) + " node slots");
+    }
+
+    decodeSection(nodeSection, nodeSlots, 1, [&](Cursor &block, NodeT &node, size_t slot){
+        getNode(block, node, slot, nodeLimit, valueLimit);
+    });
+    decodeSection(valueSection, valueSlots, 0, [](Cursor &block, Value &value, size_t){
+        block.get(value);
+    });
+    decodeSection(versionSection, roots, 0, [&](Cursor &block, uint32_t &versionRoot, size_t slot){
+        getRoot(block, versionRoot, slot, nodeLimit);
+    });
+    decodeSection(filterSection, filters, 0, [](Cursor &block, FilterRecord &record, size_t){
+        getFilter(block, record);
+    });
+    for(auto &record : filters){
+        if(record.version >= roots.size() || roots[record.version] != record.root || record.filter.words().empty()){
+            throw std::runtime_error("image filter for version " + std::to_string(record.version) + " does not match it");
+        }
+    }
+    return root;
+}
+
+// whole stream in large chunks, for images that do not come from a file
+inline std::string readAll(std::istream &is){
+    std::string data;
+    std::vector<char> chunk(1 << 20);
+    while(is.read(chunk.data(), chunk.size()) || is.gcount() > 0){
+        data.append(chunk.data(), is.gcount());
+    }
+    return data;
+}
+
+// read-only mapping of a whole file
+class MappedFile{
+public:
+    explicit MappedFile(const std::string &path){
+        int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0){
+            throw std::runtime_error("cannot open " + path);
+        }
+        struct stat st;
+        if(fstat(fd, &st) == 0 && st.st_size > 0){
+            length = st.st_size;
+            void *mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(mapped == MAP_FAILED){
+                close(fd);
+                throw std::runtime_error("cannot map " + path);
+            }
+            madvise(mapped, length, MADV_WILLNEED);
+            bytes = static_cast<const char*>(mapped);
+        }
+        close(fd);
+    }
+
+    ~MappedFile(){
+        if(bytes)  munmap(const_cast<char*>(bytes), length);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    const char *bytes = nullptr;
+    size_t length = 0;
+};
+
+// Point lookups in one version of an image file, through the block index: only the blocks holding the
+// nodes on the path (and the value) are checked and decompressed, decoded blocks are kept for later lookups.
+template<typename Key, typename Value>
+class ImageReader{
+public:
+    explicit ImageReader(const std::string &path) : file(path){
+        Cursor c{file.data(), file.data() + file.size(), "image"};
+        expectMagic(c, MAGIC, "image");
+        c.get(head);
+        Cursor index{file.data() + indexOffset(file.data(), file.size()), c.end - 16, "image index"};
+        for(auto &refs : sections){
+            uint32_t blocks;
+            index.get(blocks);
+            index.need((size_t)blocks * 20);
+            refs.resize(blocks);
+            for(auto &ref : refs){
+                index.get(ref.offset);
+                index.get(ref.first);
+                index.get(ref.records);
+            }
+        }
+        nodeLimit = count(0) + 1;
+        valueLimit = count(1);
+    }
+
+    uint32_t root() const { return head; }
+    size_t versionCount() const { return count(2); }
+    size_t blocksDecoded() const { return decoded; }
+
+    uint32_t versionRoot(size_t version){
+        if(version >= versionCount()){
+            throw std::runtime_error("no version " + std::to_string(version) + " in image");
+        }
+        return record(2, version, versionBlocks, [&](Cursor &c, uint32_t &versionRoot, size_t slot){
+            getRoot(c, versionRoot, slot, nodeLimit);
+        });
+    }
+
+    std::optional<Value> find(uint32_t T, const Key &key){
+        uint64_t hkey = hasher(key);
+        auto getNodeRecord = [&](Cursor &c, NodeRecord<Key> &node, size_t slot){
+            getNode(c, node, slot + 1, nodeLimit, valueLimit);
+        };
+        if(T >= nodeLimit){
+            throw std::runtime_error("root " + std::to_string(T) + " is not in the image");
+        }
+        while(T){
+            const NodeRecord<Key> &node = record(0, T - 1, nodeBlocks, getNodeRecord);
+            if(node.hkey == hkey && node.key == key){
+                return record(1, node.vID, valueBlocks, [](Cursor &c, Value &value, size_t){ c.get(value); });
+            }
+            T = (node.hkey > hkey || (node.hkey == hkey && node.key > key)) ? node.left : node.right;
+        }
+        return std::nullopt;
+    }
+
+private:
+    MappedFile file;
+    uint32_t head;
+    std::vector<BlockRef> sections[SECTIONS];
+    size_t nodeLimit, valueLimit;
+    size_t decoded = 0;
+    std::unordered_map<size_t, std::vector<NodeRecord<Key>>> nodeBlocks;
+    std::unordered_map<size_t, std::vector<Value>> valueBlocks;
+    std::unordered_map<size_t, std::vector<uint32_t>> versionBlocks;
+
+    size_t count(int section) const {
+        return sections[section].empty() ? 0 : sections[section].back().first + sections[section].back().records;
+    }
+
+    template<typename T, typename Get>
+    const T& record(int section, size_t index, std::unordered_map<size_t, std::vector<T>> &cache, Get get){
+        const std::vector<BlockRef> &refs = sections[section];
+        if(index >= count(section)){
+            throw std::runtime_error("slot " + std::to_string(index) + " is not in the image");
+        }
+        size_t b = std::upper_bound(refs.begin(), refs.end(), index, [](size_t i, const BlockRef &ref){ return i < ref.first; })
+                   - refs.begin() - 1;
+        auto it = cache.find(b);
+        if(it == cache.end()){
+            static const char *names[SECTIONS] = {"nodes", "values", "versions", "filters"};
+            std::string where = std::string("image ") + names[section] + " block " + std::to_string(b);
+            if(refs[b].offset >= file.size()){
+                throw std::runtime_error(where + " truncated");
+            }
+            Cursor c{file.data() + refs[b].offset, file.data() + file.size(), where};
+            Block block;
+            uint32_t records;
+            readBlockHeader(c, block, records);
+            if(records != refs[b].records){
+                throw std::runtime_error(where + " does not match the block index");
+            }
+            block.first = refs[b].first;
+            block.count = records;
+            std::vector<T> slots(records);
+            decodeBlock(block, where, slots.data(), block.first, get);
+            it = cache.emplace(b, std::move(slots)).first;
+            decoded++;
+        }
+        return it->second[index - refs[b].first];
+    }
+};
+
+// replaces nodes, values, versions and filters with fully decoded slots, nothing can fail any more here
+template<typename Key, typename Value>
+void install(std::vector<Node<Key, Value>> &&nodeSlots, std::vector<Value> &&valueSlots,
+             const std::vector<uint32_t> &roots, std::vector<FilterRecord> &filters){
+    nodes<Key, Value>.assign(std::move(nodeSlots));
+    values<Value>.assign(std::move(valueSlots));
+    versions<Key, Value>.clear();
+    versions<Key, Value>.reserve(roots.size());
+    for(uint32_t versionRoot : roots){
+        versions<Key, Value>.push_back(Treap<Key, Value>((int)versionRoot));
+    }
+    versionFilters<Key, Value>.clear();
+    for(auto &record : filters){
+        versionFilters<Key, Value>.install(record.version, record.root, std::move(record.filter));
+    }
+}
+
+}
+
+template<typename Key, typename Value>
+void save_image(std::ostream &os, int root){
+    std::streampos start = os.tellp();
+    os.write(image::MAGIC, sizeof(image::MAGIC));
+    image::write<uint32_t>(os, root);
+
+    std::vector<image::BlockRef> sections[image::SECTIONS];
+    sections[0] = image::writeSection(os, nodes<Key, Value>.size() - 1, [](std::string &out, size_t i){
+        const Node<Key, Value> &node = nodes<Key, Value>[i + 1];
+        image::putNode(out, node.key, node.hkey, node.vID, node.y, node.p.first, node.p.second);
+    });
+    sections[1] = image::writeSection(os, values<Value>.size(), [](std::string &out, size_t i){
+        values<Value>.visit(i, [&](const Value &value){ image::put(out, value); });
+    });
+    sections[2] = image::writeSection(os, versions<Key, Value>.size(), [](std::string &out, size_t i){
+        image::put<uint32_t>(out, versions<Key, Value>[i].root);
+    });
+    std::vector<std::tuple<int, int, const BloomFilter*>> filters;
+    versionFilters<Key, Value>.forEachCurrent([&](int v, int versionRoot, const BloomFilter &filter){
+        filters.emplace_back(v, versionRoot, &filter);
+    });
+    sections[3] = image::writeSection(os, filters.size(), [&](std::string &out, size_t i){
+        image::putFilter(out, std::get<0>(filters[i]), std::get<1>(filters[i]), *std::get<2>(filters[i]));
+    });
+    image::writeIndex(os, start, sections);
+}
+
+// replaces nodes, values and versions with the image and returns its root, throws std::runtime_error
+// on a bad or truncated image (the whole image is decoded before anything is replaced, so the arenas are
+// left as they were then)
+template<typename Key, typename Value>
+int load_image(const char *data, size_t size){
+    std::vector<Node<Key, Value>> nodeSlots(1);
+    std::vector<Value> valueSlots;
+    std::vector<uint32_t> roots;
+    std::vector<image::FilterRecord> filters;
+    uint32_t root = image::parseImage<Key, Value>(data, size, nodeSlots, valueSlots, roots, filters);
+    image::install<Key, Value>(std::move(nodeSlots), std::move(valueSlots), roots, filters);
+    return (int)root;
+}
+
+template<typename Key, typename Value>
+int load_image(std::istream &is){
+    std::string data = image::readAll(is);
+    return load_image<Key, Value>(data.data(), data.size());
+}
+
+template<typename Key, typename Value>
+int load_image_file(const std::string &path){
+    image::MappedFile file(path);
+    return load_image<Key, Value>(file.data(), file.size());
+}
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef STATS_HPP
+#define STATS_HPP
+
+#include "histogram.hpp"
+#include <string>
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+namespace kvdb {
+
+// Counters behind the STATS/INFO command. Everything is a relaxed atomic (the histograms are
+// lock-free too) so recording from the request path costs a few uncontended increments and the
+// numbers can be read from any thread without stopping the server.
+class ServerStats {
+public:
+    enum CommandType {
+        GET, SET, DEL, EDIT, SNAPSHOT, VGET, CHANGE,
+        WATCH, UNWATCH, STORE, VSTORE, LOAD, VLOAD, STATS, MGET,
+        CAS, EXEC, CHECKPOINT, RESTORE, COMPACT, GETAT, SCANAT, OTHER,
+        COMMAND_TYPES
+    };
+
+    static CommandType commandType(const std::string& operation);
+    static const char* commandName(CommandType type);
+
+    void recordCommand(CommandType type, uint64_t latencyNs, bool error);
+
+    void connectionOpened();
+    void connectionClosed();
+
+    uint64_t commandCount(CommandType type) const { return commands[type].count.load(std::memory_order_relaxed); }
+    uint64_t commandErrors(CommandType type) const { return commands[type].errors.load(std::memory_order_relaxed); }
+    const LatencyHistogram& commandLatency(CommandType type) const { return commands[type].latency; }
+
+    uint64_t connectionsCurrent() const { return currentConnections.load(std::memory_order_relaxed); }
+    uint64_t connectionsTotal() const { return totalConnections.load(std::memory_order_relaxed); }
+
+    // Store gauges. The arenas are only safe to read on the server loop, so the loop publishes their
+    // sizes here after running commands and other threads (the metrics listener) read the copies.
+    void publishStore(uint64_t nodes, uint64_t values, uint64_t versions, uint64_t keyBytes, uint64_t valueBytes);
+    void publishDedup(uint64_t deduplicated, uint64_t bytesSaved);
+    void publishSpill(uint64_t spilledBytes, uint64_t cacheHits, uint64_t cacheMisses);
+    void publishReadCache(uint64_t entries, uint64_t hits, uint64_t misses);
+    void publishVersionFilters(uint64_t negatives);
+
+    // "get.count=10 get.errors=0 get.p50_us=3.1 ..." for every command that ran at least once
+    std::string commandReport() const;
+
+    // every counter, gauge and latency histogram in the Prometheus text exposition format
+    std::string prometheusText() const;
+
+private:
+    struct CommandStats {
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> errors{0};
+        LatencyHistogram latency;
+    };
+    std::array<CommandStats, COMMAND_TYPES> commands;
+
+    std::atomic<uint64_t> currentConnections{0};
+    std::atomic<uint64_t> totalConnections{0};
+
+    std::atomic<uint64_t> storeNodes{0};
+    std::atomic<uint64_t> storeValues{0};
+    std::atomic<uint64_t> storeVersions{0};
+    std::atomic<uint64_t> storeKeyBytes{0};
+    std::atomic<uint64_t> storeValueBytes{0};
+    std::atomic<uint64_t> valuesDeduplicated{0};
+    std::atomic<uint64_t> valueBytesSaved{0};
+    std::atomic<uint64_t> valueBytesSpilled{0};
+    std::atomic<uint64_t> spillCacheHits{0};
+    std::atomic<uint64_t> spillCacheMisses{0};
+    std::atomic<uint64_t> readCacheEntries{0};
+    std::atomic<uint64_t> readCacheHits{0};
+    std::atomic<uint64_t> readCacheMisses{0};
+    std::atomic<uint64_t> versionFilterNegatives{0};
+};
+
+}
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef SUBSCRIPTION_TRIE_HPP
+#define SUBSCRIPTION_TRIE_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+
+namespace kvdb {
+
+// Glob matching for pattern watches: '*' matches any run of characters, '?' exactly one.
+inline bool globMatch(const std::string& pattern, const std::string& text) {
+    size_t p = 0, t = 0;
+    size_t starP = std::string::npos, starT = 0;
+    while (t < text.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == text[t])) {
+            p++;
+            t++;
+        } else if (p < pattern.size() && pattern[p] == '*') {
+            starP = p++;
+            starT = t;
+        } else if (starP != std::string::npos) {
+            // let the last '*' swallow one more character and retry
+            p = starP + 1;
+            t = ++starT;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') {
+        p++;
+    }
+    return p == pattern.size();
+}
+
+// Literal part of a glob before its first wildcard, the pattern can only match keys starting with it.
+inline std::string globPrefix(const std::string& pattern) {
+    return pattern.substr(0, pattern.find_first_of("*?"));
+}
+
+// Trie of subscriptions keyed by prefix. match() walks the key once and visits the entries of every
+// node on the way, so finding all prefixes of a key costs O(key length) no matter how many
+// subscriptions are registered.
+template<typename Entry>
+class SubscriptionTrie {
+public:
+    void insert(const std::string& prefix, const Entry& entry) {
+        Node* node = &root;
+        for (char c : prefix) {
+            auto& child = node->children[c];
+            if (!child) {
+                child = std::make_unique<Node>();
+            }
+            node = child.get();
+        }
+        node->entries.push_back(entry);
+        count++;
+    }
+
+    // removes the entries at exactly `prefix` for which pred(entry) is true, prunes emptied nodes
+    template<typename Pred>
+    void remove(const std::string& prefix, Pred pred) {
+        removeFrom(&root, prefix, 0, pred);
+    }
+
+    template<typename Visit>
+    void match(const std::string& key, Visit visit) const {
+        const Node* node = &root;
+        visitAll(node, visit);
+        for (char c : key) {
+            auto it = node->children.find(c);
+            if (it == node->children.end()) {
+                return;
+            }
+            node = it->second.get();
+            visitAll(node, visit);
+        }
+    }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+private:
+    struct Node {
+        std::unordered_map<char, std::unique_ptr<Node>> children;
+        std::vector<Entry> entries;
+    };
+    Node root;
+    size_t count = 0;
+
+    template<typename Visit>
+    static void visitAll(const Node* node, Visit& visit) {
+        for (const Entry& entry : node->entries) {
+            visit(entry);
+        }
+    }
+
+    // returns true when the node became empty and can be dropped by its parent
+    template<typename Pred>
+    bool removeFrom(Node* node, const std::string& prefix, size_t depth, Pred& pred) {
+        if (depth == prefix.size()) {
+            size_t before = node->entries.size();
+            std::vector<Entry> kept;
+            for (const Entry& entry : node->entries) {
+                if (!pred(entry)) {
+                    kept.push_back(entry);
+                }
+            }
+            node->entries.swap(kept);
+            count -= before - node->entries.size();
+        } else {
+            auto it = node->children.find(prefix[depth]);
+            if (it == node->children.end()) {
+                return false;
+            }
+            if (removeFrom(it->second.get(), prefix, depth + 1, pred)) {
+                node->children.erase(it);
+            }
+        }
+        return node != &root && node->entries.empty() && node->children.empty();
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef VALUE_LOG_HPP
+#define VALUE_LOG_HPP
+
+// Append-only file for large values (key/value separation). Values<std::string> writes values above its spill
+// threshold here and keeps only (offset, length) in memory; reads go through pread. The file only mirrors
+// what is in the value arena of this process (images and checkpoints still carry the values themselves), so
+// it is truncated when opened and when the arena is cleared.
+
+#include <string>
+#include <stdexcept>
+#include <cstdint>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+class ValueLog{
+public:
+    explicit ValueLog(const std::string &path) : path(path){
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd < 0){
+            throw std::runtime_error("cannot open value log " + path + ": " + std::strerror(errno));
+        }
+    }
+
+    ~ValueLog(){
+        close(fd);
+    }
+
+    ValueLog(const ValueLog&) = delete;
+    ValueLog& operator=(const ValueLog&) = delete;
+
+    // returns the offset the bytes were written at
+    uint64_t append(const std::string &bytes){
+        uint64_t offset = end;
+        size_t done = 0;
+        while(done < bytes.size()){
+            ssize_t n = pwrite(fd, bytes.data() + done, bytes.size() - done, offset + done);
+            if(n < 0 && errno == EINTR)  continue;
+            if(n <= 0){
+                throw std::runtime_error("cannot write value log " + path + ": " + std::strerror(errno));
+            }
+            done += n;
+        }
+        end += bytes.size();
+        return offset;
+    }
+
+    // safe to call from several threads at once
+    void read(uint64_t offset, uint32_t length, std::string &out) const{
+        out.resize(length);
+        size_t done = 0;
+        while(done < length){
+            ssize_t n = pread(fd, &out[done], length - done, offset + done);
+            if(n < 0 && errno == EINTR)  continue;
+            if(n <= 0){
+                throw std::runtime_error("cannot read value log " + path + " at " + std::to_string(offset + done));
+            }
+            done += n;
+        }
+    }
+
+    void reset(){
+        if(ftruncate(fd, 0) == 0)  end = 0;
+    }
+
+    uint64_t size() const{
+        return end;
+    }
+
+private:
+    std::string path;
+    int fd;
+    uint64_t end = 0;
+};
+
+#endif
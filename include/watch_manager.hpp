@@ -10,6 +10,10 @@
 #include <condition_variable>
 #include <thread>
 #include <atomic>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include "subscription_trie.hpp"
 
 namespace kvdb {
 
@@ -21,6 +25,14 @@ enum class WatchOperation {
     ALL
 };
 
+// what the watched string is matched against: one exact key, every key starting with it,
+// or a glob pattern ('*' and '?')
+enum class WatchKind {
+    KEY,
+    PREFIX,
+    PATTERN
+};
+
 // hash function for WatchOperation
 struct WatchOperationHash {
     std::size_t operator()(const WatchOperation& op) const {
@@ -28,13 +40,14 @@ struct WatchOperationHash {
     }
 };
 
-// key for our hash map (key + operation)
+// key for our hash map (key + operation), for PREFIX/PATTERN watches key holds the prefix/pattern
 struct WatchKey {
     std::string key;
     WatchOperation operation;
+    WatchKind kind = WatchKind::KEY;
     
     bool operator==(const WatchKey& other) const {
-        return key == other.key && operation == other.operation;
+        return key == other.key && operation == other.operation && kind == other.kind;
     }
 };
 
@@ -42,54 +55,186 @@ struct WatchKey {
 struct WatchKeyHash {
     std::size_t operator()(const WatchKey& wk) const {
         return std::hash<std::string>()(wk.key) ^ 
-               (static_cast<std::size_t>(wk.operation) << 1);
+               (static_cast<std::size_t>(wk.operation) << 1) ^
+               (static_cast<std::size_t>(wk.kind) << 4);
     }
 };
 
-// Notification structure
+// whether an event (key, operation) is matched by a watch
+inline bool watchMatches(const WatchKey& watch, const std::string& key, WatchOperation operation) {
+    if (watch.operation != operation && watch.operation != WatchOperation::ALL) return false;
+    switch (watch.kind) {
+        case WatchKind::PREFIX: return key.compare(0, watch.key.size(), watch.key) == 0;
+        case WatchKind::PATTERN: return globMatch(watch.key, key);
+        default: return key == watch.key;
+    }
+}
+
+// "NOTIFICATION <op> <key> [value]\n", with a sequence number > 0 "NOTIFICATION <seq> <op> <key> [value]\n"
+std::string notificationText(uint64_t sequence, WatchOperation operation, const std::string& key,
+                             const std::string& value);
+
+// Notification structure. The message is built once per event and shared (refcounted, immutable)
+// by every subscriber's queue entry, fanning out to many watchers costs no extra copies.
 struct Notification {
     int clientSocket;
-    std::string message;
+    std::shared_ptr<const std::string> message;
+};
+
+// Per watch delivery options
+struct WatchOptions {
+    // 0 = deliver every event. Otherwise at most one notification per key every coalesceMs milliseconds:
+    // events inside the window replace each other and only the latest one is sent when it closes.
+    uint32_t coalesceMs = 0;
+    // prefix notifications with the sequence number of the change, so the client knows where to resume from
+    bool sequenced = false;
+    // set by addWatch: only events notified after the watch was added match it, even when the worker
+    // gets to an older event later
+    uint64_t since = 0;
 };
 
 class WatchManager {
 public:
-    WatchManager();
+    // shards: independent slices of the watch index (by key hash), each with its own lock
+    // workers: delivery threads, a client is always served by the same worker so its notifications stay in order
+    // maxQueuedPerClient: notifications waiting for one client before new ones are dropped
+    WatchManager(size_t shardCount = 16, size_t workerCount = 2, size_t maxQueuedPerClient = 10000);
     ~WatchManager();
 
-    // Watch registration methods - O(1) operations
-    void addWatch(int clientSocket, const std::string& key, WatchOperation operation);
-    void removeWatch(int clientSocket, const std::string& key, WatchOperation operation);
+    // Watch registration methods - O(1) operations for keys, O(prefix length) for PREFIX/PATTERN watches.
+    // Adding a watch that already exists only updates its options.
+    void addWatch(int clientSocket, const std::string& key, WatchOperation operation,
+                  WatchKind kind = WatchKind::KEY, WatchOptions options = WatchOptions());
+    void removeWatch(int clientSocket, const std::string& key, WatchOperation operation,
+                     WatchKind kind = WatchKind::KEY);
     void removeAllWatches(int clientSocket);
     
-    // Notification methods - Asynchronous
-    void notifyEvent(const std::string& key, WatchOperation operation, const std::string& value);
+    // Notification methods - Asynchronous, the event is matched against the watches on the workers
+    // sequence: position of the change in the server's change log, 0 when it isn't logged
+    void notifyEvent(const std::string& key, WatchOperation operation, const std::string& value,
+                     uint64_t sequence = 0);
+    // Queue already formatted notifications (a resumed watch catching up) ahead of any later event.
+    // Not subject to maxQueuedPerClient, the caller bounds how much is replayed.
+    void replay(int clientSocket, const std::vector<std::string>& messages);
     
-    // Start/stop notification thread
+    // Introspection for STATS
+    size_t watchCount();        // number of (client, key, operation) subscriptions
+    size_t queueDepth();        // events waiting to be matched plus notifications waiting for delivery
+    uint64_t notificationsSent() const { return sentCount.load(std::memory_order_relaxed); }
+    uint64_t notificationsFailed() const { return failedCount.load(std::memory_order_relaxed); }
+    uint64_t notificationsDropped() const { return droppedCount.load(std::memory_order_relaxed); }
+    uint64_t notificationsCoalesced() const { return coalescedCount.load(std::memory_order_relaxed); }
+    
+    // Start/stop notification threads
     void start();
     void stop();
 
 private:
-    // Fast lookup hash maps - O(1) access time
-    std::mutex watchMutex;
+    using Clock = std::chrono::steady_clock;
+
+    // One slice of the watch index. Writes to keys in different shards never wait on each other,
+    // and subscribing/unsubscribing only blocks writes to keys of the same shard.
+    struct Shard {
+        std::mutex mutex;
+        // Key+Operation -> client sockets with their options (for fast notification lookup)
+        std::unordered_map<WatchKey, std::unordered_map<int, WatchOptions>, WatchKeyHash> watchIndex;
+    };
+    std::vector<std::unique_ptr<Shard>> shards;
+    Shard& shardFor(const std::string& key);
     
-    // Key+Operation -> Set of client sockets (for fast notification lookup)
-    std::unordered_map<WatchKey, std::unordered_set<int>, WatchKeyHash> watchIndex;
+    // PREFIX and PATTERN watches in a trie keyed by the prefix (or the literal start of the glob), so a write
+    // finds every matching watch in O(key length) instead of testing each registered prefix
+    struct PatternWatch {
+        int clientSocket;
+        WatchOperation operation;
+        WatchKind kind;
+        std::string pattern;
+        WatchOptions options;
+    };
+    std::mutex patternMutex;
+    SubscriptionTrie<PatternWatch> patternIndex;
+    std::atomic<size_t> patternCount{0};    // lets the workers skip the trie lock while nobody uses them
+    std::atomic<size_t> keyWatchCount{0};   // with patternCount, lets notifyEvent skip events nobody watches
+    std::atomic<uint64_t> eventCount{0};    // numbers the events, see WatchOptions::since
     
-    // Client socket -> Set of keys+operations (for fast client cleanup)
+    // Client socket -> Set of keys+operations (for fast client cleanup), not used on the write path
+    std::mutex clientMutex;
     std::unordered_map<int, std::unordered_set<WatchKey, WatchKeyHash>> clientIndex;
+
+    // Coalescing state of one (client, key) pair while its window is open
+    struct CoalesceKey {
+        int clientSocket;
+        std::string key;
+        bool operator==(const CoalesceKey& other) const {
+            return clientSocket == other.clientSocket && key == other.key;
+        }
+    };
+    struct CoalesceKeyHash {
+        std::size_t operator()(const CoalesceKey& ck) const {
+            return std::hash<std::string>()(ck.key) ^ (static_cast<std::size_t>(ck.clientSocket) << 1);
+        }
+    };
+    struct CoalesceSlot {
+        std::shared_ptr<const std::string> latest;  // newest message of the window, not delivered yet
+        Clock::time_point windowEnd;
+        uint32_t windowMs;
+    };
+    struct WindowTimer {
+        Clock::time_point due;
+        CoalesceKey key;
+        bool operator>(const WindowTimer& other) const { return due > other.due; }
+    };
     
-    // Notification queue for asynchronous processing
-    std::mutex queueMutex;
-    std::condition_variable queueCV;
-    std::queue<Notification> notificationQueue;
+    // A write as notifyEvent saw it, shared by every worker until each has matched it
+    struct Event {
+        std::string key;
+        WatchOperation operation;
+        std::string value;
+        uint64_t sequence;
+        uint64_t number;
+    };
+
+    // Delivery worker with its own queue, notifyEvent only holds a worker's lock while pushing.
+    // Every worker sees every event and picks out the watchers it owns.
+    struct Worker {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::vector<std::shared_ptr<const Event>> events;       // not matched yet
+        std::vector<int> disconnected;                          // clients whose unsent tail is stale
+        std::queue<Notification> queue;
+        std::unordered_map<int, size_t> queuedPerClient;        // bounded by maxQueuedPerClient
+        std::unordered_map<CoalesceKey, CoalesceSlot, CoalesceKeyHash> windows;
+        std::priority_queue<WindowTimer, std::vector<WindowTimer>, std::greater<WindowTimer>> timers;
+        std::thread thread;
+        // rest of a message a full socket cut in the middle, only touched by the worker thread
+        std::unordered_map<int, std::string> unsent;
+    };
+    std::vector<std::unique_ptr<Worker>> workers;
+    Worker& workerFor(int clientSocket);
+    size_t maxQueuedPerClient;
     
-    // Notification thread for asynchronous delivery
-    std::thread notificationThread;
     std::atomic<bool> running;
+
+    // delivery counters (send failed = client went away before the notification was written,
+    // dropped = client's queue or socket was full, coalesced = replaced by a newer event inside a window)
+    std::atomic<uint64_t> sentCount{0};
+    std::atomic<uint64_t> failedCount{0};
+    std::atomic<uint64_t> droppedCount{0};
+    std::atomic<uint64_t> coalescedCount{0};
     
     // Notification thread function
-    void notificationLoop();
+    void notificationLoop(Worker& worker);
+    void match(const Worker& worker, const Event& event, std::vector<std::pair<int, WatchOptions>>& clients);
+    void deliver(Worker& worker, int clientSocket, const Notification* first, size_t count);
+    bool flushUnsent(Worker& worker, int clientSocket);
+    void unindex(int clientSocket, const WatchKey& watchKey);
+    void index(int clientSocket, const WatchKey& watchKey, WatchOptions options);
+
+    // worker.mutex must be held
+    void enqueueLocked(Worker& worker, int clientSocket, const std::shared_ptr<const std::string>& message);
+    void coalesceLocked(Worker& worker, int clientSocket, const std::string& key,
+                        const std::shared_ptr<const std::string>& message, uint32_t windowMs);
+    void fireTimersLocked(Worker& worker);
 };
 
 } // namespace kvdb
@@ -1,6 +1,7 @@
 #include "include/server.hpp"
 #include <iostream>
 #include <csignal>
+#include <vector>
 
 kvdb::Server* g_server = nullptr;
 
@@ -16,17 +17,77 @@ int main(int argc, char* argv[]) {
     std::string host = "127.0.0.1";
     int port = 8080;
     
-    // Parse command line arguments
-    if (argc > 1) {
-        host = argv[1];
+    int metricsPort = 0;
+    std::string leader;
+    int checkpointInterval = 0;
+    bool dedupValues = false;
+    size_t spillThreshold = 0;
+    size_t spillCache = 64 << 20;
+    size_t readCacheEntries = 0;
+    bool filters = false;
+
+    // Parse command line arguments: [host] [port] [--metrics-port N] [--replica-of host:port] [--checkpoint-interval S]
+    // [--dedup-values] [--spill-values BYTES] [--spill-cache BYTES] [--read-cache ENTRIES]
+    // [--version-filters]
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--metrics-port" && i + 1 < argc) {
+            metricsPort = std::stoi(argv[++i]);
+        } else if (arg == "--replica-of" && i + 1 < argc) {
+            leader = argv[++i];
+        } else if (arg == "--checkpoint-interval" && i + 1 < argc) {
+            checkpointInterval = std::stoi(argv[++i]);
+        } else if (arg == "--dedup-values") {
+            dedupValues = true;
+        } else if (arg == "--spill-values" && i + 1 < argc) {
+            spillThreshold = std::stoull(argv[++i]);
+        } else if (arg == "--spill-cache" && i + 1 < argc) {
+            spillCache = std::stoull(argv[++i]);
+        } else if (arg == "--read-cache" && i + 1 < argc) {
+            readCacheEntries = std::stoull(argv[++i]);
+        } else if (arg == "--version-filters") {
+            filters = true;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    if (positional.size() > 0) {
+        host = positional[0];
     }
-    if (argc > 2) {
-        port = std::stoi(argv[2]);
+    if (positional.size() > 1) {
+        port = std::stoi(positional[1]);
     }
     
     // Create server
     kvdb::Server server(host, port);
     g_server = &server;
+    if (metricsPort > 0) {
+        server.enableMetrics(metricsPort);
+    }
+    if (checkpointInterval > 0) {
+        server.enableCheckpoints(checkpointInterval);
+    }
+    if (dedupValues) {
+        server.enableValueDedup();
+    }
+    if (spillThreshold > 0) {
+        server.enableValueSpill(spillThreshold, spillCache);
+    }
+    if (readCacheEntries > 0) {
+        server.enableReadCache(readCacheEntries);
+    }
+    if (filters) {
+        server.enableVersionFilters();
+    }
+    if (!leader.empty()) {
+        size_t colon = leader.rfind(':');
+        if (colon == std::string::npos) {
+            std::cerr << "--replica-of expects host:port" << std::endl;
+            return 1;
+        }
+        server.replicaOf(leader.substr(0, colon), std::stoi(leader.substr(colon + 1)));
+    }
     
     // Register signal handler
     signal(SIGINT, signalHandler);
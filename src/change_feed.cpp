@@ -0,0 +1,152 @@
+#include "../include/change_feed.hpp"
+#include <sys/socket.h>
+#include <cerrno>
+
+namespace kvdb {
+
+ChangeFeed::ChangeFeed(const ChangeLog& log, size_t maxBatch) : log(log), maxBatch(maxBatch > 0 ? maxBatch : 1) {}
+
+void ChangeFeed::setWriteInterest(WriteInterest callback) {
+    writeInterest = std::move(callback);
+}
+
+bool ChangeFeed::subscribe(int clientSocket, uint64_t from) {
+    if (!log.covers(from)) {
+        return false;
+    }
+    auto inserted = subscribers.emplace(clientSocket, Subscriber{});
+    inserted.first->second.cursor = from;
+    inserted.first->second.closing = false;
+    subscriberGauge = subscribers.size();
+    return true;
+}
+
+// A frame that is half written still has to be finished, the subscriber stays until its outbox is empty.
+bool ChangeFeed::unsubscribe(int clientSocket) {
+    auto it = subscribers.find(clientSocket);
+    if (it == subscribers.end() || it->second.closing) {
+        return false;
+    }
+    it->second.closing = true;
+    pump(clientSocket, it->second);
+    return true;
+}
+
+void ChangeFeed::disconnect(int clientSocket) {
+    if (subscribers.count(clientSocket)) {
+        remove(clientSocket);
+    }
+}
+
+bool ChangeFeed::isSubscribed(int clientSocket) const {
+    return subscribers.count(clientSocket) > 0;
+}
+
+size_t ChangeFeed::unsentBytes(int clientSocket) const {
+    auto it = subscribers.find(clientSocket);
+    return it == subscribers.end() ? 0 : it->second.outbox.size() - it->second.written;
+}
+
+void ChangeFeed::reply(int clientSocket, std::string text) {
+    auto it = subscribers.find(clientSocket);
+    if (it == subscribers.end()) {
+        return;
+    }
+    if (it->second.outbox.empty()) {
+        it->second.outbox = std::move(text);
+    } else {
+        it->second.outbox += text;
+    }
+    pump(clientSocket, it->second);
+}
+
+void ChangeFeed::flush(int clientSocket) {
+    auto it = subscribers.find(clientSocket);
+    if (it != subscribers.end()) {
+        pump(clientSocket, it->second);
+    }
+}
+
+void ChangeFeed::flushAll() {
+    // pump() can remove the current subscriber, step the iterator first
+    for (auto it = subscribers.begin(); it != subscribers.end();) {
+        auto current = it++;
+        pump(current->first, current->second);
+    }
+}
+
+// Write what is pending and build the next frame until the subscriber is caught up or its socket is full.
+void ChangeFeed::pump(int clientSocket, Subscriber& subscriber) {
+    while (true) {
+        if (subscriber.written < subscriber.outbox.size()) {
+            if (!writeOut(clientSocket, subscriber)) {
+                return;             // socket full (waiting for EPOLLOUT) or gone
+            }
+            continue;
+        }
+        subscriber.outbox.clear();
+        subscriber.written = 0;
+        if (subscriber.closing) {
+            if (subscriber.waitingForWrite && writeInterest) {
+                writeInterest(clientSocket, false);
+            }
+            remove(clientSocket);
+            return;
+        }
+        if (subscriber.cursor >= log.lastSequence()) {
+            break;
+        }
+        if (!log.covers(subscriber.cursor)) {
+            overrunCount.fetch_add(1, std::memory_order_relaxed);
+            subscriber.outbox = "ERROR Change feed overrun, sequence " + std::to_string(subscriber.cursor) +
+                                " is no longer retained\n";
+            subscriber.closing = true;
+            continue;
+        }
+        size_t count = 0;
+        std::string lines;
+        log.forEachSince(subscriber.cursor, [&](const ChangeEntry& change) {
+            appendChangeLine(lines, change);
+            subscriber.cursor = change.sequence;
+            count++;
+        }, maxBatch);
+        subscriber.outbox.reserve(32 + lines.size());
+        subscriber.outbox.append("CHANGES ").append(std::to_string(count)).append(" ")
+            .append(std::to_string(subscriber.cursor)).append("\n").append(lines);
+        frameCount.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (subscriber.waitingForWrite && writeInterest) {
+        subscriber.waitingForWrite = false;
+        writeInterest(clientSocket, false);
+    }
+}
+
+// false when the socket can't take more right now (or the connection is broken)
+bool ChangeFeed::writeOut(int clientSocket, Subscriber& subscriber) {
+    while (subscriber.written < subscriber.outbox.size()) {
+        ssize_t sent = ::send(clientSocket, subscriber.outbox.data() + subscriber.written,
+                              subscriber.outbox.size() - subscriber.written, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!subscriber.waitingForWrite && writeInterest) {
+                    subscriber.waitingForWrite = true;
+                    writeInterest(clientSocket, true);
+                }
+                return false;
+            }
+            // connection broken, the event loop notices and closes it
+            remove(clientSocket);
+            return false;
+        }
+        subscriber.written += sent;
+    }
+    return true;
+}
+
+void ChangeFeed::remove(int clientSocket) {
+    subscribers.erase(clientSocket);
+    subscriberGauge = subscribers.size();
+}
+
+}
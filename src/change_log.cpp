@@ -0,0 +1,44 @@
+#include "../include/change_log.hpp"
+
+namespace kvdb {
+
+const char* changeTypeName(ChangeType type) {
+    switch (type) {
+        case ChangeType::SET: return "SET";
+        case ChangeType::DEL: return "DEL";
+        case ChangeType::EDIT: return "EDIT";
+        case ChangeType::SNAPSHOT: return "SNAPSHOT";
+        case ChangeType::CHANGE: return "CHANGE";
+        case ChangeType::RELOAD: return "RELOAD";
+    }
+    return "UNKNOWN";
+}
+
+void appendChangeLine(std::string& out, const ChangeEntry& change) {
+    out.append(std::to_string(change.sequence)).append(" ").append(changeTypeName(change.type));
+    out.append(" ").append(change.key);
+    if (change.type == ChangeType::SET || change.type == ChangeType::EDIT) {
+        out.append(" ").append(change.value);
+    }
+    out += '\n';
+}
+
+ChangeLog::ChangeLog(size_t capacity) : maxEntries(capacity > 0 ? capacity : 1) {}
+
+uint64_t ChangeLog::append(ChangeType type, const std::string& key, const std::string& value) {
+    if (entries.size() == maxEntries) {
+        entries.pop_front();
+    }
+    entries.push_back({nextSequence, type, key, value});
+    return nextSequence++;
+}
+
+uint64_t ChangeLog::firstSequence() const {
+    return entries.empty() ? nextSequence : entries.front().sequence;
+}
+
+bool ChangeLog::covers(uint64_t since) const {
+    return since <= lastSequence() && since + 1 >= firstSequence();
+}
+
+}
@@ -0,0 +1,407 @@
+#include "../include/kvdb_client.hpp"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+
+namespace kvdb {
+
+static const std::string CONNECTION_CLOSED = "ERROR Connection closed";
+static const std::string NOTIFICATION_PREFIX = "NOTIFICATION ";
+
+static bool isOk(const std::string& reply) {
+    return reply.compare(0, 2, "OK") == 0;
+}
+
+// "OK value" -> value, anything else (ERROR ...) -> nullopt
+static std::optional<std::string> okValue(const std::string& reply) {
+    if (reply.compare(0, 3, "OK ") == 0) {
+        return reply.substr(3);
+    }
+    if (reply == "OK") {
+        return std::string();
+    }
+    return std::nullopt;
+}
+
+// replies of several lines whose first line is "OK <n>"
+static bool countedReply(const std::string& command) {
+    return command.compare(0, 7, "SCANAT ") == 0 || command == "SCANAT";
+}
+
+Connection::Connection(const std::string& host, int port) : socketFd(-1), connected(false) {
+    socketFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (socketFd < 0) {
+        return;
+    }
+
+    struct sockaddr_in serverAddr {};
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_addr.s_addr = inet_addr(host.c_str());
+    serverAddr.sin_port = htons(port);
+    if (connect(socketFd, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
+        ::close(socketFd);
+        socketFd = -1;
+        return;
+    }
+
+    // pipelined commands are small writes, don't let Nagle hold them back waiting for replies
+    int flag = 1;
+    setsockopt(socketFd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+    connected = true;
+    readerThread = std::thread(&Connection::readLoop, this);
+}
+
+Connection::~Connection() {
+    close();
+    if (readerThread.joinable()) {
+        readerThread.join();
+    }
+    if (socketFd >= 0) {
+        ::close(socketFd);
+    }
+}
+
+bool Connection::isConnected() const {
+    return connected;
+}
+
+void Connection::close() {
+    if (connected.exchange(false)) {
+        // wakes the reader thread out of recv, it then fails whatever is still pending
+        shutdown(socketFd, SHUT_RDWR);
+    }
+}
+
+void Connection::setNotificationHandler(NotificationHandler handler) {
+    std::lock_guard<std::mutex> lock(handlerMutex);
+    notificationHandler = std::move(handler);
+}
+
+bool Connection::writeAll(const std::string& data) {
+    size_t offset = 0;
+    while (offset < data.size()) {
+        ssize_t sent = ::send(socketFd, data.data() + offset, data.size() - offset, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        offset += sent;
+    }
+    return true;
+}
+
+void Connection::send(const std::string& command, ReplyCallback callback) {
+    sendBatch({command}, {std::move(callback)});
+}
+
+std::future<std::string> Connection::send(const std::string& command) {
+    auto promise = std::make_shared<std::promise<std::string>>();
+    std::future<std::string> future = promise->get_future();
+    send(command, [promise](const std::string& reply) { promise->set_value(reply); });
+    return future;
+}
+
+void Connection::sendBatch(const std::vector<std::string>& commands, std::vector<ReplyCallback> callbacks) {
+    std::string data;
+    std::vector<bool> counted;
+    for (const auto& command : commands) {
+        data += command;
+        data += '\n';
+        counted.push_back(countedReply(command));
+    }
+    queueAndWrite(data, std::move(callbacks), std::move(counted));
+}
+
+void Connection::sendMultiReply(const std::string& command, std::vector<ReplyCallback> callbacks) {
+    queueAndWrite(command + "\n", std::move(callbacks));
+}
+
+void Connection::queueAndWrite(const std::string& data, std::vector<ReplyCallback> callbacks, std::vector<bool> counted) {
+    std::lock_guard<std::mutex> writeLock(writeMutex);
+    bool open;
+    {
+        // queue completions before writing so a fast reply always finds its callback. connected is checked
+        // in the same critical section: the reader clears it and takes what is pending under this lock too,
+        // so a completion is either queued before that (and failed by the reader) or not queued at all
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        open = connected;
+        if (open) {
+            for (size_t i = 0; i < callbacks.size(); i++) {
+                pending.push_back({std::move(callbacks[i]), i < counted.size() && counted[i]});
+            }
+        }
+    }
+    if (!open) {
+        for (auto& callback : callbacks) {
+            callback(CONNECTION_CLOSED);
+        }
+        return;
+    }
+    if (!writeAll(data)) {
+        close();
+    }
+}
+
+// the connection is gone: nothing can be queued any more once this took the pending completions
+void Connection::failPending() {
+    std::deque<Pending> failed;
+    {
+        std::lock_guard<std::mutex> lock(pendingMutex);
+        connected = false;
+        failed.swap(pending);
+    }
+    for (auto& entry : failed) {
+        entry.callback(CONNECTION_CLOSED);
+    }
+}
+
+void Connection::readLoop() {
+    std::string buffered;
+    char buffer[16384];
+    // a counted reply being collected: its callback, the lines so far and how many are still to come
+    ReplyCallback collecting;
+    std::string collected;
+    size_t linesLeft = 0;
+    while (true) {
+        ssize_t bytesRead = recv(socketFd, buffer, sizeof(buffer), 0);
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead <= 0) {
+            break;
+        }
+        buffered.append(buffer, bytesRead);
+
+        size_t start = 0, end;
+        while ((end = buffered.find('\n', start)) != std::string::npos) {
+            std::string line = buffered.substr(start, end - start);
+            start = end + 1;
+
+            // lines of a counted reply are checked first, a key may well be called NOTIFICATION
+            if (linesLeft > 0) {
+                collected.append("\n").append(line);
+                if (--linesLeft == 0) {
+                    collecting(collected);
+                    collecting = nullptr;
+                }
+                continue;
+            }
+
+            if (line.compare(0, NOTIFICATION_PREFIX.size(), NOTIFICATION_PREFIX) == 0) {
+                std::lock_guard<std::mutex> lock(handlerMutex);
+                if (notificationHandler) {
+                    notificationHandler(line.substr(NOTIFICATION_PREFIX.size()));
+                }
+                continue;
+            }
+
+            Pending next;
+            {
+                std::lock_guard<std::mutex> lock(pendingMutex);
+                if (pending.empty()) {
+                    continue;               // unsolicited reply, nothing is waiting for it
+                }
+                next = std::move(pending.front());
+                pending.pop_front();
+            }
+            if (next.counted && line.compare(0, 3, "OK ") == 0) {
+                linesLeft = std::strtoull(line.c_str() + 3, nullptr, 10);
+                if (linesLeft > 0) {
+                    collecting = std::move(next.callback);
+                    collected = line;
+                    continue;
+                }
+            }
+            next.callback(line);
+        }
+        buffered.erase(0, start);
+    }
+
+    if (collecting) {
+        collecting(CONNECTION_CLOSED);
+    }
+    failPending();
+}
+
+Client::Client(const std::string& host, int port, int poolSize) {
+    if (poolSize < 1) {
+        poolSize = 1;
+    }
+    for (int i = 0; i < poolSize; i++) {
+        pool.push_back(std::make_unique<Connection>(host, port));
+    }
+}
+
+bool Client::isConnected() const {
+    for (const auto& conn : pool) {
+        if (!conn->isConnected()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Connection& Client::pick() {
+    return *pool[nextConnection++ % pool.size()];
+}
+
+// notifications arrive on the socket that registered the watch, keep them all on one connection
+Connection& Client::watchConnection() {
+    return *pool[0];
+}
+
+std::future<std::string> Client::command(const std::string& command) {
+    return pick().send(command);
+}
+
+void Client::command(const std::string& command, ReplyCallback callback) {
+    pick().send(command, std::move(callback));
+}
+
+std::future<bool> Client::okCommand(Connection& conn, const std::string& command) {
+    auto promise = std::make_shared<std::promise<bool>>();
+    std::future<bool> future = promise->get_future();
+    conn.send(command, [promise](const std::string& reply) { promise->set_value(isOk(reply)); });
+    return future;
+}
+
+std::future<std::optional<std::string>> Client::get(const std::string& key) {
+    auto promise = std::make_shared<std::promise<std::optional<std::string>>>();
+    std::future<std::optional<std::string>> future = promise->get_future();
+    pick().send("GET " + key, [promise](const std::string& reply) { promise->set_value(okValue(reply)); });
+    return future;
+}
+
+std::future<std::optional<std::string>> Client::vget(int version, const std::string& key) {
+    auto promise = std::make_shared<std::promise<std::optional<std::string>>>();
+    std::future<std::optional<std::string>> future = promise->get_future();
+    pick().send("VGET " + std::to_string(version) + " " + key,
+                [promise](const std::string& reply) { promise->set_value(okValue(reply)); });
+    return future;
+}
+
+std::future<bool> Client::set(const std::string& key, const std::string& value) {
+    return okCommand(pick(), "SET " + key + " " + value);
+}
+
+std::future<bool> Client::edit(const std::string& key, const std::string& value) {
+    return okCommand(pick(), "EDIT " + key + " " + value);
+}
+
+std::future<bool> Client::del(const std::string& key) {
+    return okCommand(pick(), "DEL " + key);
+}
+
+std::future<std::vector<std::optional<std::string>>> Client::mget(const std::vector<std::string>& keys) {
+    struct State {
+        std::vector<std::optional<std::string>> results;
+        std::atomic<size_t> remaining;
+        std::promise<std::vector<std::optional<std::string>>> promise;
+    };
+    auto state = std::make_shared<State>();
+    state->results.resize(keys.size());
+    state->remaining = keys.size();
+    auto future = state->promise.get_future();
+    if (keys.empty()) {
+        state->promise.set_value({});
+        return future;
+    }
+
+    std::string command = "MGET";
+    std::vector<ReplyCallback> callbacks;
+    for (size_t i = 0; i < keys.size(); i++) {
+        command += " " + keys[i];
+        callbacks.push_back([state, i](const std::string& reply) {
+            state->results[i] = okValue(reply);
+            if (--state->remaining == 0) {
+                state->promise.set_value(std::move(state->results));
+            }
+        });
+    }
+    pick().sendMultiReply(command, std::move(callbacks));
+    return future;
+}
+
+std::future<std::vector<bool>> Client::mset(const std::vector<std::pair<std::string, std::string>>& items) {
+    struct State {
+        std::vector<bool> results;
+        std::atomic<size_t> remaining;
+        std::promise<std::vector<bool>> promise;
+    };
+    auto state = std::make_shared<State>();
+    state->results.resize(items.size());
+    state->remaining = items.size();
+    auto future = state->promise.get_future();
+    if (items.empty()) {
+        state->promise.set_value({});
+        return future;
+    }
+
+    std::vector<std::string> commands;
+    std::vector<ReplyCallback> callbacks;
+    for (size_t i = 0; i < items.size(); i++) {
+        commands.push_back("SET " + items[i].first + " " + items[i].second);
+        callbacks.push_back([state, i](const std::string& reply) {
+            state->results[i] = isOk(reply);
+            if (--state->remaining == 0) {
+                state->promise.set_value(std::move(state->results));
+            }
+        });
+    }
+    pick().sendBatch(commands, std::move(callbacks));
+    return future;
+}
+
+std::future<std::optional<std::vector<std::pair<std::string, std::string>>>> Client::scanAt(const std::string& time,
+                                                                                           const std::string& prefix) {
+    using Entries = std::vector<std::pair<std::string, std::string>>;
+    auto promise = std::make_shared<std::promise<std::optional<Entries>>>();
+    auto future = promise->get_future();
+    std::string command = "SCANAT " + time;
+    if (!prefix.empty()) {
+        command += " " + prefix;
+    }
+    pick().send(command, [promise](const std::string& reply) {
+        if (reply.compare(0, 3, "OK ") != 0) {
+            promise->set_value(std::nullopt);
+            return;
+        }
+        // "OK <n>" then one "<key> <value>" line per entry
+        Entries entries;
+        size_t start = reply.find('\n');
+        while (start != std::string::npos) {
+            size_t end = reply.find('\n', start + 1);
+            std::string line = reply.substr(start + 1, end == std::string::npos ? std::string::npos : end - start - 1);
+            size_t space = line.find(' ');
+            entries.emplace_back(line.substr(0, space), space == std::string::npos ? "" : line.substr(space + 1));
+            start = end;
+        }
+        promise->set_value(std::move(entries));
+    });
+    return future;
+}
+
+std::future<bool> Client::watch(const std::string& key, const std::string& operation) {
+    return okCommand(watchConnection(), "WATCH " + key + " " + operation);
+}
+
+std::future<bool> Client::watchFrom(const std::string& key, uint64_t sequence, const std::string& operation) {
+    return okCommand(watchConnection(), "WATCH " + key + " " + operation + " FROM " + std::to_string(sequence));
+}
+
+std::future<bool> Client::unwatch(const std::string& key, const std::string& operation) {
+    return okCommand(watchConnection(), "UNWATCH " + key + " " + operation);
+}
+
+void Client::onNotification(NotificationHandler handler) {
+    for (auto& conn : pool) {
+        conn->setNotificationHandler(handler);
+    }
+}
+
+}
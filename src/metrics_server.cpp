@@ -0,0 +1,105 @@
+#include "../include/metrics_server.hpp"
+#include <iostream>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <poll.h>
+
+namespace kvdb {
+
+MetricsServer::MetricsServer(const std::string& host, int port, std::function<std::string()> render)
+    : host(host), port(port), render(std::move(render)), listenSocket(-1), running(false) {}
+
+MetricsServer::~MetricsServer() {
+    stop();
+}
+
+bool MetricsServer::start() {
+    if (running) return true;
+
+    listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenSocket < 0) {
+        std::cerr << "Error creating metrics socket" << std::endl;
+        return false;
+    }
+    int opt = 1;
+    setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr(host.c_str());
+    addr.sin_port = htons(port);
+    if (bind(listenSocket, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenSocket, 16) < 0) {
+        std::cerr << "Error binding metrics listener to " << host << ":" << port << std::endl;
+        close(listenSocket);
+        listenSocket = -1;
+        return false;
+    }
+
+    running = true;
+    listenerThread = std::thread(&MetricsServer::listenLoop, this);
+    std::cout << "Metrics available on http://" << host << ":" << port << "/metrics" << std::endl;
+    return true;
+}
+
+void MetricsServer::stop() {
+    if (running.exchange(false)) {
+        if (listenerThread.joinable()) {
+            listenerThread.join();
+        }
+        close(listenSocket);
+        listenSocket = -1;
+    }
+}
+
+void MetricsServer::listenLoop() {
+    while (running) {
+        // wake up regularly to notice stop()
+        struct pollfd pfd {listenSocket, POLLIN, 0};
+        if (poll(&pfd, 1, 500) <= 0) {
+            continue;
+        }
+        int clientSocket = accept(listenSocket, nullptr, nullptr);
+        if (clientSocket < 0) {
+            continue;
+        }
+        handleRequest(clientSocket);
+        close(clientSocket);
+    }
+}
+
+void MetricsServer::handleRequest(int clientSocket) {
+    // read the request head, only the request line matters
+    std::string request;
+    char buffer[2048];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 16384) {
+        struct pollfd pfd {clientSocket, POLLIN, 0};
+        if (poll(&pfd, 1, 1000) <= 0) return;
+        ssize_t n = recv(clientSocket, buffer, sizeof(buffer), 0);
+        if (n <= 0) return;
+        request.append(buffer, n);
+    }
+
+    std::string status = "200 OK";
+    std::string body;
+    if (request.compare(0, 12, "GET /metrics") == 0 || request.compare(0, 6, "GET / ") == 0) {
+        body = render();
+    } else {
+        status = "404 Not Found";
+        body = "not found, try /metrics\n";
+    }
+
+    std::string response = "HTTP/1.1 " + status + "\r\n"
+                           "Content-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                           "Connection: close\r\n\r\n" + body;
+    size_t offset = 0;
+    while (offset < response.size()) {
+        ssize_t sent = send(clientSocket, response.data() + offset, response.size() - offset, MSG_NOSIGNAL);
+        if (sent <= 0) return;
+        offset += sent;
+    }
+}
+
+}
@@ -0,0 +1,237 @@
+#include "../include/server.hpp"
+#include "../include/snapshot_image.hpp"
+#include <iostream>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <charconv>
+
+/* Follower side of replication. The follower connects to the leader and sends SYNC, the leader answers
+
+     IMAGE <bytes> <seq>\n<binary image (snapshot_image.hpp)>\n
+
+ followed by the change feed from <seq> on (CHANGES frames, see change_feed.hpp). Every change is applied
+ through the same code as a client command, so watches and change feed subscribers of the follower see
+ them too. CHANGE (rollback) is replayed, RELOAD (the leader's store was replaced) triggers a new SYNC.
+ A lost connection is retried every second, reads keep being served from the last state meanwhile.*/
+
+namespace kvdb {
+
+void Server::replicaOf(const std::string& host, int port) {
+    leaderHost = host;
+    leaderPort = port;
+}
+
+// The connect is non-blocking: an unreachable leader must not hold up the clients of the loop for the TCP
+// connect timeout. The socket is watched for EPOLLOUT until the connect finishes; one that is still pending
+// when the next attempt is due is given up and started over.
+void Server::connectToLeader(int epollFd) {
+    if (leaderConnecting) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, leaderSocket, nullptr);
+        close(leaderSocket);
+        leaderSocket = -1;
+        leaderConnecting = false;
+    }
+    nextLeaderAttempt = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    struct sockaddr_in leaderAddr {};
+    leaderAddr.sin_family = AF_INET;
+    leaderAddr.sin_addr.s_addr = inet_addr(leaderHost.c_str());
+    leaderAddr.sin_port = htons(leaderPort);
+    if (connect(fd, (struct sockaddr*)&leaderAddr, sizeof(leaderAddr)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return;
+    }
+
+    struct epoll_event leaderEvent;
+    leaderEvent.events = EPOLLOUT | EPOLLET;
+    leaderEvent.data.fd = fd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &leaderEvent);
+    leaderSocket = fd;
+    leaderConnecting = true;
+}
+
+// the leader socket became writable (or failed): the connect is done one way or the other
+void Server::finishLeaderConnect(int epollFd) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(leaderSocket, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, leaderSocket, nullptr);
+        close(leaderSocket);
+        leaderSocket = -1;
+        leaderConnecting = false;
+        return;                     // retried when nextLeaderAttempt is due
+    }
+    leaderConnecting = false;
+    int noDelay = 1;
+    setsockopt(leaderSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    struct epoll_event leaderEvent;
+    leaderEvent.events = EPOLLIN | EPOLLET;
+    leaderEvent.data.fd = leaderSocket;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, leaderSocket, &leaderEvent);
+
+    leaderBuffer.clear();
+    std::cerr << "Connected to leader " << leaderHost << ":" << leaderPort << std::endl;
+    requestSync();
+}
+
+void Server::disconnectFromLeader(int epollFd) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, leaderSocket, nullptr);
+    close(leaderSocket);
+    leaderSocket = -1;
+    awaitingImage = false;
+    imageBytes = 0;
+    std::cerr << "Lost connection to leader, serving the last replicated state" << std::endl;
+}
+
+void Server::requestSync() {
+    static const char command[] = "SYNC\n";
+    awaitingImage = true;
+    imageBytes = 0;
+    // tiny write on a fresh socket, it only fails when the connection is gone (noticed by the next read)
+    send(leaderSocket, command, sizeof(command) - 1, MSG_NOSIGNAL);
+}
+
+void Server::readFromLeader(int epollFd) {
+    char buffer[65536];
+    bool closed = false;
+    while (true) {
+        ssize_t bytesRead = recv(leaderSocket, buffer, sizeof(buffer), 0);
+        if (bytesRead < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                closed = true;
+            }
+            break;
+        } else if (bytesRead == 0) {
+            closed = true;
+            break;
+        }
+        leaderBuffer.append(buffer, bytesRead);
+    }
+
+    size_t start = 0;
+    while (start < leaderBuffer.size()) {
+        if (imageBytes > 0) {
+            // image body plus its trailing newline
+            if (leaderBuffer.size() - start < imageBytes + 1) {
+                break;
+            }
+            const char* body = leaderBuffer.data() + start;
+            size_t bytes = imageBytes;
+            start += imageBytes + 1;
+            imageBytes = 0;
+            try {
+                store = Treap<std::string, std::string>(load_image<std::string, std::string>(body, bytes));
+                awaitingImage = false;
+                recordChange(ChangeType::RELOAD, "SYNC", "");
+                std::cerr << "Replica loaded image at leader sequence " << leaderSequence << std::endl;
+            } catch (const std::exception& e) {
+                // load_image leaves the arenas as they were, reads keep being served from the last good state
+                std::cerr << "Bad image from leader (" << e.what() << "), syncing again" << std::endl;
+                requestSync();
+            }
+            continue;
+        }
+
+        size_t end = leaderBuffer.find('\n', start);
+        if (end == std::string::npos) {
+            break;
+        }
+        std::string line = leaderBuffer.substr(start, end - start);
+        start = end + 1;
+
+        if (line.compare(0, 6, "IMAGE ") == 0) {
+            std::istringstream header(line.substr(6));
+            header >> imageBytes >> leaderSequence;
+            if (imageBytes == 0) {
+                requestSync();
+            }
+        } else if (line.compare(0, 5, "ERROR") == 0) {
+            // overrun: the leader dropped changes we never got, start over
+            std::cerr << "Leader: " << line << ", syncing again" << std::endl;
+            requestSync();
+        } else if (!awaitingImage && !line.empty() && isdigit((unsigned char)line[0])) {
+            if (!applyFromLeader(line)) {
+                // whatever the leader meant, our copy can't follow it any more
+                std::cerr << "Malformed change from leader (" << line.substr(0, 64) << "), syncing again" << std::endl;
+                requestSync();
+            }
+        }
+        // CHANGES frame headers carry nothing the change lines don't
+    }
+    leaderBuffer.erase(0, start);
+    commitRoot();
+    publishStoreStats();
+    changeFeed.flushAll();
+
+    if (closed) {
+        disconnectFromLeader(epollFd);
+    }
+}
+
+// "<seq> <TYPE> <key> [value]", the value is the rest of the line. Numbers are parsed with from_chars, a line
+// that is cut or out of range must not throw out of the server loop.
+bool Server::applyFromLeader(const std::string& line) {
+    size_t typeStart = line.find(' ');
+    if (typeStart == std::string::npos) {
+        return false;
+    }
+    uint64_t sequence;
+    auto parsed = std::from_chars(line.data(), line.data() + typeStart, sequence);
+    if (parsed.ec != std::errc() || parsed.ptr != line.data() + typeStart) {
+        return false;
+    }
+    size_t keyStart = line.find(' ', typeStart + 1);
+    std::string type = line.substr(typeStart + 1, keyStart == std::string::npos ? std::string::npos : keyStart - typeStart - 1);
+    std::string key, value;
+    if (keyStart != std::string::npos) {
+        size_t valueStart = line.find(' ', keyStart + 1);
+        key = line.substr(keyStart + 1, valueStart == std::string::npos ? std::string::npos : valueStart - keyStart - 1);
+        if (valueStart != std::string::npos) {
+            value = line.substr(valueStart + 1);
+        }
+    }
+
+    if (type == "SET" || type == "EDIT") {
+        if (store.contains(key)) {
+            store.edit(key, value);
+        } else {
+            store.insert(key, value);
+        }
+        recordChange(type == "SET" ? ChangeType::SET : ChangeType::EDIT, key, value);
+    } else if (type == "DEL") {
+        if (store.contains(key)) {
+            store.remove(key);
+        }
+        recordChange(ChangeType::DEL, key, "");
+    } else if (type == "SNAPSHOT") {
+        snapshot<std::string, std::string>(store);
+        recordChange(ChangeType::SNAPSHOT, std::to_string(versions<std::string, std::string>.size() - 1), "");
+    } else if (type == "CHANGE") {
+        size_t version;
+        parsed = std::from_chars(key.data(), key.data() + key.size(), version);
+        if (parsed.ec != std::errc() || parsed.ptr != key.data() + key.size() ||
+            version >= versions<std::string, std::string>.size()) {
+            return false;
+        }
+        store = rollback<std::string, std::string>((int)version);
+        recordChange(ChangeType::CHANGE, key, "");
+    } else if (type == "RELOAD") {
+        requestSync();
+    }
+    leaderSequence = sequence;
+    return true;
+}
+
+}
@@ -5,16 +5,24 @@
  highly scalable server that can manage multiple clients. Since only one operation runs
  at a time in the single thread, there are also no concurrency issues with read/write operations.*/
 #include "../include/server.hpp"
+#include "../include/snapshot_image.hpp"
 #include <iostream>
 #include <sstream>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <cstring>
+#include <chrono>
+#include <filesystem>
+#include <algorithm>
+#include <ctime>
 
 namespace kvdb {
 
@@ -32,6 +40,10 @@ Server::~Server() {
 void Server::start() {
     if (running) return;
     running = true;
+    if (metricsPort > 0) {
+        metricsServer = std::make_unique<MetricsServer>(host, metricsPort, [this] { return metricsText(); });
+        metricsServer->start();
+    }
     serverThread = std::thread(&Server::serverLoop, this);
 }
 
@@ -41,6 +53,120 @@ void Server::stop() {
     if (serverThread.joinable()) {
         serverThread.join();
     }
+    if (metricsServer) {
+        metricsServer->stop();
+    }
+}
+
+void Server::enableMetrics(int port) {
+    metricsPort = port;
+}
+
+// Runs on the metrics thread: only atomics from stats and the watch manager's own locks, never the store.
+std::string Server::metricsText() {
+    std::ostringstream os;
+    os << stats.prometheusText();
+    os << "# HELP kvdb_watches Active (client, key, operation) watch subscriptions.\n"
+       << "# TYPE kvdb_watches gauge\n"
+       << "kvdb_watches " << watchManager.watchCount() << "\n";
+    os << "# HELP kvdb_notification_queue_length Notifications waiting for delivery.\n"
+       << "# TYPE kvdb_notification_queue_length gauge\n"
+       << "kvdb_notification_queue_length " << watchManager.queueDepth() << "\n";
+    os << "# HELP kvdb_notifications_sent_total Notifications written to watching clients.\n"
+       << "# TYPE kvdb_notifications_sent_total counter\n"
+       << "kvdb_notifications_sent_total " << watchManager.notificationsSent() << "\n";
+    os << "# HELP kvdb_notifications_failed_total Notifications that could not be written (client gone).\n"
+       << "# TYPE kvdb_notifications_failed_total counter\n"
+       << "kvdb_notifications_failed_total " << watchManager.notificationsFailed() << "\n";
+    os << "# HELP kvdb_notifications_dropped_total Notifications dropped because the client's queue was full.\n"
+       << "# TYPE kvdb_notifications_dropped_total counter\n"
+       << "kvdb_notifications_dropped_total " << watchManager.notificationsDropped() << "\n";
+    os << "# HELP kvdb_notifications_coalesced_total Notifications replaced by a newer event of the same key.\n"
+       << "# TYPE kvdb_notifications_coalesced_total counter\n"
+       << "kvdb_notifications_coalesced_total " << watchManager.notificationsCoalesced() << "\n";
+    os << "# HELP kvdb_change_subscribers Connections subscribed to the change feed.\n"
+       << "# TYPE kvdb_change_subscribers gauge\n"
+       << "kvdb_change_subscribers " << changeFeed.subscriberCount() << "\n";
+    os << "# HELP kvdb_change_frames_total Change feed frames written.\n"
+       << "# TYPE kvdb_change_frames_total counter\n"
+       << "kvdb_change_frames_total " << changeFeed.framesSent() << "\n";
+    os << "# HELP kvdb_change_overruns_total Subscribers cut off for falling behind the change log.\n"
+       << "# TYPE kvdb_change_overruns_total counter\n"
+       << "kvdb_change_overruns_total " << changeFeed.overruns() << "\n";
+    return os.str();
+}
+
+static int64_t wallClockMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// After a LOAD/RESTORE/replica image the logged roots point into the old arena, the log starts over.
+void Server::commitRoot() {
+    if (nodes<std::string, std::string>.generation() != rootLogGeneration) {
+        rootLogGeneration = nodes<std::string, std::string>.generation();
+        rootLog.reset(wallClockMs(), store.root);
+    } else {
+        rootLog.record(wallClockMs(), store.root);
+    }
+}
+
+void Server::publishStoreStats() {
+    stats.publishStore(nodes<std::string, std::string>.size() - 1,
+                       values<std::string>.size(),
+                       versions<std::string, std::string>.size(),
+                       nodes<std::string, std::string>.byteSize(),
+                       values<std::string>.byteSize());
+    stats.publishDedup(values<std::string>.deduplicated(), values<std::string>.bytesSaved());
+    stats.publishSpill(values<std::string>.spilledByteSize(), values<std::string>.spillCacheHits(),
+                       values<std::string>.spillCacheMisses());
+    stats.publishVersionFilters(versionFilters<std::string, std::string>.negativeCount());
+    if (readCache) {
+        stats.publishReadCache(readCache->size(), readCache->hitCount(), readCache->missCount());
+    }
+}
+
+void Server::enableVersionFilters() {
+    versionFiltersEnabled = true;
+}
+
+void Server::enableReadCache(size_t entries) {
+    readCache = std::make_unique<ReadCache>(entries);
+}
+
+void Server::enableValueSpill(size_t thresholdBytes, size_t cacheBytes) {
+    std::filesystem::create_directories("../save");
+    values<std::string>.enableSpill("../save/values-" + std::to_string(port) + ".log", thresholdBytes, cacheBytes);
+}
+
+void Server::enableValueDedup() {
+    values<std::string>.enableDedup(true);
+}
+
+void Server::enableCheckpoints(int intervalSeconds) {
+    checkpointInterval = intervalSeconds;
+    nextCheckpoint = std::chrono::steady_clock::now() + std::chrono::seconds(intervalSeconds);
+}
+
+Checkpointer<std::string, std::string>& Server::checkpointerFor(const std::string& name) {
+    if (!checkpointer || checkpointName != name) {
+        // the old directory may still be merging, its destructor would join that on the loop
+        if (checkpointer && checkpointer->mergeRunning()) {
+            std::thread([old = std::move(checkpointer)]() mutable { old.reset(); }).detach();
+        }
+        checkpointer = std::make_unique<Checkpointer<std::string, std::string>>("../save/" + name);
+        checkpointName = name;
+    }
+    return *checkpointer;
+}
+
+// Only the slots appended since the previous checkpoint of the same directory are written (the first one
+// of a directory, and the first one after the store was replaced, is a full image).
+std::string Server::runCheckpoint(const std::string& name) {
+    auto result = checkpointerFor(name).checkpoint(store.root);
+    return std::string(result.base ? "base" : "delta") + " nodes=" + std::to_string(result.nodes) +
+           " values=" + std::to_string(result.values) + " versions=" + std::to_string(result.versions) +
+           " bytes=" + std::to_string(result.bytes);
 }
 
 bool Server::isRunning() const {
@@ -49,6 +175,8 @@ bool Server::isRunning() const {
 
 void Server::serverLoop() {
     versions<std::string, std::string>.clear();
+    rootLogGeneration = nodes<std::string, std::string>.generation();
+    rootLog.reset(wallClockMs(), store.root);
     int serverSocket = socket(AF_INET, SOCK_STREAM, 0);
     if (serverSocket < 0) {
         std::cerr << "Error creating socket" << std::endl;
@@ -97,6 +225,45 @@ void Server::serverLoop() {
     epoll_ctl(epollFd, EPOLL_CTL_ADD, serverSocket, &event);
 
     std::unordered_map<int, std::string> partialBuffer;
+    std::unordered_set<int> stalled;        // complete commands held back until the client reads its replies
+
+    /* Commands are newline terminated. A recv can end in the middle of a command (large values)
+     or hold several of them (pipelining clients), so bytes are collected per client and every
+     complete line is executed in order. Whatever is left waits in partialBuffer for the next read.
+     While a client has more than MAX_OUTBOX of replies unsent its further commands wait as well.*/
+    auto executePending = [&](int clientFd) {
+        std::string& pending = partialBuffer[clientFd];
+        size_t start = 0, end;
+        while (!outboxFull(clientFd) && (end = pending.find('\n', start)) != std::string::npos) {
+            size_t len = end - start;
+            if (len > 0 && pending[end - 1] == '\r') {
+                len--;
+            }
+            if (len > 0) {
+                Response response = processCommand(pending.substr(start, len), clientFd);
+                sendResponse(clientFd, std::move(response));
+                values<std::string>.releaseReads();     // spilled values the reply borrowed
+            }
+            start = end + 1;
+        }
+        if (start > 0) {
+            commitRoot();
+            publishStoreStats();
+            changeFeed.flushAll();
+        }
+        pending.erase(0, start);
+        if (pending.find('\n') != std::string::npos) {
+            stalled.insert(clientFd);
+        } else {
+            stalled.erase(clientFd);
+        }
+    };
+
+    // change feed subscribers that can't keep up wait for EPOLLOUT instead of blocking the loop
+    loopEpollFd = epollFd;
+    changeFeed.setWriteInterest([this](int clientSocket, bool wantWrite) {
+        watchWritable(clientSocket, wantWrite);
+    });
 
     std::cout << "Server listening on " << host << ":" << port << std::endl;
 
@@ -106,6 +273,17 @@ void Server::serverLoop() {
 
     // Start event loop
     while (running) {
+        if (isReplica() && (leaderSocket < 0 || leaderConnecting) && std::chrono::steady_clock::now() >= nextLeaderAttempt) {
+            connectToLeader(epollFd);
+        }
+        if (checkpointInterval > 0 && std::chrono::steady_clock::now() >= nextCheckpoint) {
+            nextCheckpoint = std::chrono::steady_clock::now() + std::chrono::seconds(checkpointInterval);
+            try {
+                std::cerr << "Checkpoint " << runCheckpoint(checkpointName.empty() ? "checkpoint" : checkpointName) << std::endl;
+            } catch (const std::exception& e) {
+                std::cerr << "Checkpoint failed: " << e.what() << std::endl;
+            }
+        }
         int n = epoll_wait(epollFd, events, MAX_EVENTS, 1000);
 
         for (int i = 0; i < n; i++) {
@@ -117,7 +295,11 @@ void Server::serverLoop() {
                 socklen_t clientLen = sizeof(clientAddr);
                 int clientSocket = accept(serverSocket, (struct sockaddr*)&clientAddr, &clientLen);
                 if (clientSocket >= 0) {
+                    stats.connectionOpened();
                     makeNonBlocking(clientSocket);
+                    // replies are small writes, without this Nagle + delayed ACK stall pipelined clients for ~40ms
+                    int noDelay = 1;
+                    setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
                     struct epoll_event clientEvent;
                     clientEvent.events = EPOLLIN | EPOLLET;
                     clientEvent.data.fd = clientSocket;
@@ -127,30 +309,69 @@ void Server::serverLoop() {
                               << std::this_thread::get_id() << std::endl;
                 }
 
+            } else if (fd == leaderSocket) {
+                if (leaderConnecting) {
+                    finishLeaderConnect(epollFd);
+                } else {
+                    readFromLeader(epollFd);
+                }
+
             // Existing client is sending new data
             } else {
-                char buffer[1024];
+                auto closeClient = [&](int clientFd) {
+                    epoll_ctl(epollFd, EPOLL_CTL_DEL, clientFd, nullptr);
+                    watchManager.removeAllWatches(clientFd);
+                    changeFeed.disconnect(clientFd);
+                    close(clientFd);
+                    stats.connectionClosed();
+                    partialBuffer.erase(clientFd);
+                    stalled.erase(clientFd);
+                    outboxes.erase(clientFd);
+                    checkedOut.erase(clientFd);
+                    transactions.erase(clientFd);
+                };
+
+                if (events[i].events & EPOLLOUT) {
+                    flushOutbox(fd);
+                    changeFeed.flush(fd);
+                }
+
+                char buffer[16384];
+                bool closed = false;
+                std::string& pending = partialBuffer[fd];
                 while (true) {
-                    int bytesRead = recv(fd, buffer, sizeof(buffer) - 1, 0);
+                    int bytesRead = recv(fd, buffer, sizeof(buffer), 0);
                     if (bytesRead < 0) {
                         if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                            epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
-                            close(fd);
-                            partialBuffer.erase(fd);
+                            closed = true;
                         }
                         break;
                     } else if (bytesRead == 0) {
-                        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
-                        close(fd);
-                        partialBuffer.erase(fd);
+                        closed = true;
                         break;
-                    } else {
-                        buffer[bytesRead] = '\0';
-                        std::string command(buffer); 
-                        std::string response = processCommand(command, fd);
-                        send(fd, response.c_str(), response.length(), 0);
                     }
+                    pending.append(buffer, bytesRead);
                 }
+
+                executePending(fd);
+
+                if (closed) {
+                    closeClient(fd);
+                }
+            }
+        }
+
+        // the change feed writes on every batch, a held back client's replies may have drained without an
+        // event of its own
+        if (!stalled.empty()) {
+            std::vector<int> ready;
+            for (int clientFd : stalled) {
+                if (!outboxFull(clientFd)) {
+                    ready.push_back(clientFd);
+                }
+            }
+            for (int clientFd : ready) {
+                executePending(clientFd);
             }
         }
     }
@@ -159,100 +380,761 @@ void Server::serverLoop() {
     close(epollFd);
 }
 
-// Read command and call appropriate functions.
-std::string Server::processCommand(const std::string& command, int clientSocket) {
-    Command cmd = parseCommand(command);
-    cmd.clientSocket = clientSocket;
-    
-    if (cmd.operation == "WATCH") {
-        WatchOperation op;
-        if (cmd.value == "SET") {
-            op = WatchOperation::SET;
-        } else if (cmd.value == "DEL") {
-            op = WatchOperation::DEL;
-        } else if (cmd.value == "EDIT") {
-            op = WatchOperation::EDIT;
-        } else if (cmd.value == "ALL") {
-            op = WatchOperation::ALL;
+// Send the reply header and the borrowed value (if any) with a single sendmsg, no intermediate copy of the value.
+// Whatever the socket doesn't take is copied to the connection's outbox and written on EPOLLOUT.
+void Server::sendResponse(int clientSocket, Response&& response) {
+    auto queued = outboxes.find(clientSocket);
+    if (changeFeed.isSubscribed(clientSocket)) {
+        // may be in the middle of a change frame, the reply is queued behind it
+        std::string text;
+        if (queued != outboxes.end()) {
+            // replies from before SUBSCRIBE that are still unsent go first
+            text = queued->second.pending.substr(queued->second.written);
+            outboxes.erase(queued);
+            watchWritable(clientSocket, false);
+        }
+        if (text.empty() && !response.value) {
+            text = std::move(response.head);        // the SYNC image is moved, not copied
+        } else {
+            text.append(response.head);
+            if (response.value) {
+                text.append(*response.value).append("\n");
+            }
+        }
+        changeFeed.reply(clientSocket, std::move(text));
+        return;
+    }
+    if (queued != outboxes.end()) {
+        // earlier replies are still waiting, this one goes behind them
+        queued->second.pending.append(response.head);
+        if (response.value) {
+            queued->second.pending.append(*response.value).append("\n");
+        }
+        return;
+    }
+    static const char newline = '\n';
+    struct iovec iov[3];
+    int iovcnt = 0;
+    iov[iovcnt++] = {const_cast<char*>(response.head.data()), response.head.size()};
+    if (response.value) {
+        iov[iovcnt++] = {const_cast<char*>(response.value->data()), response.value->size()};
+        iov[iovcnt++] = {const_cast<char*>(&newline), 1};
+    }
+
+    struct msghdr msg {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    while (msg.msg_iovlen > 0) {
+        ssize_t sent = sendmsg(clientSocket, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // socket buffer is full (large value), keep the rest until the client drains it
+                Outbox& outbox = outboxes[clientSocket];
+                for (size_t k = 0; k < msg.msg_iovlen; k++) {
+                    outbox.pending.append(static_cast<const char*>(msg.msg_iov[k].iov_base), msg.msg_iov[k].iov_len);
+                }
+                watchWritable(clientSocket, true);
+            }
+            return;
+        }
+        // skip over whatever was written, a large value may go out in several pieces
+        while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len) {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = static_cast<char*>(msg.msg_iov->iov_base) + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+}
+
+void Server::flushOutbox(int clientSocket) {
+    auto it = outboxes.find(clientSocket);
+    if (it == outboxes.end()) {
+        return;
+    }
+    Outbox& outbox = it->second;
+    while (outbox.written < outbox.pending.size()) {
+        ssize_t sent = ::send(clientSocket, outbox.pending.data() + outbox.written,
+                              outbox.pending.size() - outbox.written, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            // socket full again: wait for the next EPOLLOUT; broken: the read below notices and closes it
+            return;
+        }
+        outbox.written += sent;
+    }
+    outboxes.erase(it);
+    watchWritable(clientSocket, false);
+}
+
+// a subscribed connection's replies wait in the change feed's outbox instead, it counts the same
+bool Server::outboxFull(int clientSocket) const {
+    auto it = outboxes.find(clientSocket);
+    if (it != outboxes.end() && it->second.pending.size() - it->second.written > MAX_OUTBOX) {
+        return true;
+    }
+    return changeFeed.unsentBytes(clientSocket) > MAX_OUTBOX;
+}
+
+// A connection has either an outbox or a change feed subscription waiting on the socket (SUBSCRIBE moves the
+// outbox into the feed), so whichever asks decides.
+void Server::watchWritable(int clientSocket, bool wantWrite) {
+    struct epoll_event clientEvent;
+    clientEvent.events = EPOLLIN | EPOLLET;
+    if (wantWrite || outboxes.count(clientSocket)) {
+        clientEvent.events |= EPOLLOUT;
+    }
+    clientEvent.data.fd = clientSocket;
+    epoll_ctl(loopEpollFd, EPOLL_CTL_MOD, clientSocket, &clientEvent);
+}
+
+// Arguments of WATCH/UNWATCH: "<key> <op>", "PREFIX <prefix> <op>" or "PATTERN <glob> <op>".
+// A key literally named PREFIX/PATTERN can still be watched with "WATCH PREFIX <op>".
+// WATCH takes optional delivery options after the operation:
+//   COALESCE <ms>  at most one notification per key every <ms>, the latest value wins
+//   RATE <n>       at most n notifications per key and second (same as COALESCE 1000/n)
+//   FROM <seq>     resume: replay the logged changes after <seq> first, notifications carry sequence numbers
+//                  (FROM NOW only switches to sequenced notifications)
+struct WatchRequest {
+    std::string target;
+    WatchKind kind = WatchKind::KEY;
+    std::string operationName;
+    WatchOperation operation = WatchOperation::ALL;
+    WatchOptions options;
+    bool resume = false;
+    bool fromNow = false;
+    uint64_t from = 0;
+};
+
+static bool parseWatchOperation(const std::string& name, WatchOperation& op) {
+    if (name == "SET") {
+        op = WatchOperation::SET;
+    } else if (name == "DEL") {
+        op = WatchOperation::DEL;
+    } else if (name == "EDIT") {
+        op = WatchOperation::EDIT;
+    } else if (name == "ALL") {
+        op = WatchOperation::ALL;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool parseWatchOptions(const std::vector<std::string>& tokens, size_t from, WatchRequest& request) {
+    WatchOptions& options = request.options;
+    for (size_t i = from; i < tokens.size(); i += 2) {
+        if (i + 1 >= tokens.size()) {
+            return false;
+        }
+        if (tokens[i] == "FROM") {
+            request.resume = true;
+            options.sequenced = true;
+            if (tokens[i + 1] == "NOW") {
+                request.fromNow = true;
+            } else {
+                request.from = std::stoull(tokens[i + 1]);
+            }
+            continue;
+        }
+        long amount = std::stol(tokens[i + 1]);
+        if (amount <= 0) {
+            return false;
+        }
+        if (tokens[i] == "COALESCE") {
+            options.coalesceMs = (uint32_t)amount;
+        } else if (tokens[i] == "RATE") {
+            options.coalesceMs = (uint32_t)std::max<long>(1, 1000 / amount);
         } else {
-            return "ERROR Invalid watch operation. Use SET, DEL, EDIT, or ALL\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool parseWatchRequest(const std::string& key, const std::string& rest, WatchRequest& request) {
+    std::vector<std::string> tokens;
+    std::istringstream in(rest);
+    std::string token;
+    while (in >> token) {
+        tokens.push_back(token);
+    }
+    WatchOperation op;
+    size_t optionsFrom;
+    if ((key == "PREFIX" || key == "PATTERN") && tokens.size() >= 2 && parseWatchOperation(tokens[1], op)) {
+        request.kind = key == "PREFIX" ? WatchKind::PREFIX : WatchKind::PATTERN;
+        request.target = tokens[0];
+        request.operationName = tokens[1];
+        optionsFrom = 2;
+    } else if (!tokens.empty()) {
+        request.target = key;
+        request.operationName = tokens[0];
+        optionsFrom = 1;
+    } else {
+        return false;
+    }
+    return parseWatchOperation(request.operationName, request.operation) &&
+           parseWatchOptions(tokens, optionsFrom, request);
+}
+
+// the watchable part of a change (everything but SNAPSHOT)
+static bool watchOperation(ChangeType type, WatchOperation& operation) {
+    switch (type) {
+        case ChangeType::SET: operation = WatchOperation::SET; return true;
+        case ChangeType::DEL: operation = WatchOperation::DEL; return true;
+        case ChangeType::EDIT: operation = WatchOperation::EDIT; return true;
+        default: return false;
+    }
+}
+
+static bool allDigits(const std::string& text) {
+    return !text.empty() && std::all_of(text.begin(), text.end(), [](char c) { return isdigit((unsigned char)c); });
+}
+
+// "<ms since the epoch>", "YYYY-MM-DDTHH:MM:SS[.mmm]" or "HH:MM:SS[.mmm]" (today), in the server's local time
+static bool parseTimestamp(const std::string& text, int64_t& timeMs) {
+    if (allDigits(text)) {
+        timeMs = std::stoll(text);
+        return true;
+    }
+    time_t now = time(nullptr);
+    std::tm today{}, tm;
+    localtime_r(&now, &today);
+    tm = today;
+    const char* end = strptime(text.c_str(), "%Y-%m-%dT%H:%M:%S", &tm);
+    if (!end) {
+        tm = today;
+        end = strptime(text.c_str(), "%H:%M:%S", &tm);
+    }
+    if (!end) {
+        return false;
+    }
+    int millis = 0;
+    if (*end == '.') {
+        int digits = 0;
+        for (end++; isdigit((unsigned char)*end) && digits < 3; end++, digits++) {
+            millis = millis * 10 + (*end - '0');
+        }
+        for (; digits < 3; digits++) {
+            millis *= 10;
+        }
+    }
+    if (*end) {
+        return false;
+    }
+    tm.tm_isdst = -1;
+    timeMs = (int64_t)mktime(&tm) * 1000 + millis;
+    return true;
+}
+
+// MGET <key> [key ...]: one reply line per key in order, each the line GET would send
+static std::string multiGet(Treap<std::string, std::string>& store, const std::string& first, const std::string& rest) {
+    std::vector<std::string> keys{first};
+    std::istringstream in(rest);
+    std::string key;
+    while (in >> key) {
+        keys.push_back(key);
+    }
+    std::vector<int> slots = store.find_slots(keys);
+    std::string reply;
+    for (int slot : slots) {
+        if (slot >= 0) {
+            reply += "OK " + values<std::string>[slot] + "\n";
+        } else {
+            reply += "ERROR Key not found\n";
+        }
+    }
+    return reply;
+}
+
+// COMPACT: relayout() copies the whole tree before the root can switch, so it holds up the loop for time
+// linear in the number of keys. The reply and the server log say how long it took.
+static std::string compact(int& root, const char* what) {
+    auto started = std::chrono::steady_clock::now();
+    int before = nodes<std::string, std::string>.size();
+    root = relayout<std::string, std::string>(root);
+    int copied = nodes<std::string, std::string>.size() - before;
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count();
+    std::cerr << "Compacted " << what << ": " << copied << " nodes in " << ms << " ms" << std::endl;
+    return "OK Compacted " + std::to_string(copied) + " nodes in " + std::to_string(ms) + " ms\n";
+}
+
+// the commands a checked out branch takes instead of the main store
+static bool branchCommand(const std::string& operation) {
+    return operation == "GET" || operation == "MGET" || operation == "SET" || operation == "DEL" ||
+           operation == "EDIT" || operation == "CAS" || operation == "SNAPSHOT" || operation == "VGET" ||
+           operation == "CHANGE" || operation == "COMPACT";
+}
+
+// the value of CAS <key> <expected> <new value>: the expected value is one word, the new one the rest
+static bool splitCas(const std::string& value, std::string& expected, std::string& replacement) {
+    size_t space = value.find(' ');
+    if (space == std::string::npos || space == 0) {
+        return false;
+    }
+    expected = value.substr(0, space);
+    replacement = value.substr(space + 1);
+    return true;
+}
+
+static std::string describeWatch(const WatchRequest& request) {
+    switch (request.kind) {
+        case WatchKind::PREFIX: return "prefix " + request.target;
+        case WatchKind::PATTERN: return "pattern " + request.target;
+        default: return request.target;
+    }
+}
+
+// Every mutation goes into the change log (for resumed watches and the change feed) and out to the current
+// watchers. Change feed subscribers are flushed once per batch of commands, not per change.
+void Server::recordChange(ChangeType type, const std::string& key, const std::string& value) {
+    uint64_t sequence = changeLog.append(type, key, value);
+    // after a RESTORE the checkpointer's chain is exactly what is in the arenas, deltas can continue it
+    if (type == ChangeType::RELOAD && checkpointer && key != "RESTORE") {
+        checkpointer->invalidate();
+    }
+    if (readCache) {
+        if (type == ChangeType::SET || type == ChangeType::DEL || type == ChangeType::EDIT) {
+            readCache->forget(key);
+        } else if (type == ChangeType::CHANGE || type == ChangeType::RELOAD) {
+            readCache->invalidateAll();
+        }
+    }
+    if (type == ChangeType::RELOAD) {
+        // their roots point into the node arena that is being replaced
+        branches.clear();
+    }
+    WatchOperation operation;
+    if (watchOperation(type, operation)) {
+        watchManager.notifyEvent(key, operation, value, sequence);
+    }
+}
+
+// Parse and execute one command, its latency and outcome go into the STATS counters.
+Server::Response Server::processCommand(const std::string& command, int clientSocket) {
+    auto startTime = std::chrono::steady_clock::now();
+    ServerStats::CommandType type = ServerStats::commandType(command.substr(0, command.find(' ')));
+    Response response("ERROR Invalid command\n");
+    try {
+        Command cmd = parseCommand(command);
+        cmd.clientSocket = clientSocket;
+        response = executeCommand(cmd);
+    } catch (const std::exception&) {
+        // malformed arguments, e.g. a non numeric version for VGET/CHANGE
+    }
+    uint64_t latencyNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - startTime).count();
+    stats.recordCommand(type, latencyNs, response.head.compare(0, 5, "ERROR") == 0);
+    return response;
+}
+
+// One line of space separated key=value pairs. With live=true also walks every retained version to count
+// the nodes/values still reachable, that is O(live nodes) so it is left out of the plain STATS.
+std::string Server::statsReport(bool live) {
+    std::ostringstream os;
+    os << "connections=" << stats.connectionsCurrent()
+       << " connections_total=" << stats.connectionsTotal()
+       << " nodes=" << nodes<std::string, std::string>.size() - 1
+       << " values=" << values<std::string>.size()
+       << " versions=" << versions<std::string, std::string>.size()
+       << " key_bytes=" << nodes<std::string, std::string>.byteSize()
+       << " value_bytes=" << values<std::string>.byteSize()
+       << " values_deduplicated=" << values<std::string>.deduplicated()
+       << " value_bytes_saved=" << values<std::string>.bytesSaved()
+       << " values_spilled=" << values<std::string>.spilledCount()
+       << " value_bytes_spilled=" << values<std::string>.spilledByteSize()
+       << " value_cache_hits=" << values<std::string>.spillCacheHits()
+       << " value_cache_misses=" << values<std::string>.spillCacheMisses()
+       << " read_cache_entries=" << (readCache ? readCache->size() : 0)
+       << " read_cache_hits=" << (readCache ? readCache->hitCount() : 0)
+       << " read_cache_misses=" << (readCache ? readCache->missCount() : 0)
+       << " version_filters=" << versionFilters<std::string, std::string>.builtCount()
+       << " version_filter_negatives=" << versionFilters<std::string, std::string>.negativeCount()
+       << " version_log=" << rootLog.size()
+       << " branches=" << branches.size()
+       << " watches=" << watchManager.watchCount()
+       << " notification_queue=" << watchManager.queueDepth()
+       << " notifications_dropped=" << watchManager.notificationsDropped()
+       << " notifications_coalesced=" << watchManager.notificationsCoalesced()
+       << " sequence=" << changeLog.lastSequence()
+       << " change_log=" << changeLog.size()
+       << " change_subscribers=" << changeFeed.subscriberCount()
+       << " change_overruns=" << changeFeed.overruns();
+    if (isReplica()) {
+        os << " role=replica leader=" << leaderHost << ":" << leaderPort
+           << " leader_connected=" << (leaderSocket >= 0 && !leaderConnecting && !awaitingImage ? 1 : 0)
+           << " leader_sequence=" << leaderSequence;
+    } else {
+        os << " role=leader";
+    }
+    if (live) {
+        std::vector<int> roots{store.root};
+        for (auto& version : versions<std::string, std::string>) {
+            roots.push_back(version.root);
+        }
+        for (auto& branch : branches) {
+            roots.push_back(branch.second.store.root);
+            roots.insert(roots.end(), branch.second.snapshots.begin(), branch.second.snapshots.end());
+        }
+        auto reachable = count_reachable<std::string, std::string>(roots);
+        os << " live_nodes=" << reachable.first << " live_values=" << reachable.second;
+    }
+    std::string commands = stats.commandReport();
+    if (!commands.empty()) {
+        os << " " << commands;
+    }
+    return os.str();
+}
+
+// Read command and call appropriate functions.
+Server::Response Server::executeCommand(const Command& cmd) {
+    int clientSocket = cmd.clientSocket;
+
+    auto transaction = transactions.find(clientSocket);
+    if (transaction != transactions.end() && cmd.operation != "EXEC" && cmd.operation != "DISCARD") {
+        if (cmd.operation == "SET" || cmd.operation == "DEL" || cmd.operation == "EDIT" || cmd.operation == "CAS") {
+            transaction->second.queued.push_back(cmd);
+            return "QUEUED\n";
         }
-        
-        watchManager.addWatch(clientSocket, cmd.key, op);
-        return "OK Watching " + cmd.key + " for " + cmd.value + " operations\n";
+        return "ERROR Only SET, DEL, EDIT and CAS can be queued in MULTI, EXEC or DISCARD ends it\n";
+    }
+
+    auto checkout = checkedOut.find(clientSocket);
+    if (checkout != checkedOut.end() && branchCommand(cmd.operation)) {
+        auto branch = branches.find(checkout->second);
+        if (branch == branches.end()) {
+            return "ERROR Branch " + checkout->second + " no longer exists, CHECKOUT another one\n";
+        }
+        return executeOnBranch(cmd, branch->second);
+    }
+
+    if (isReplica() && (cmd.operation == "SET" || cmd.operation == "DEL" || cmd.operation == "EDIT" || cmd.operation == "CAS" ||
+                        cmd.operation == "SNAPSHOT" || cmd.operation == "CHANGE" ||
+                        cmd.operation == "LOAD" || cmd.operation == "VLOAD" || cmd.operation == "RESTORE")) {
+        return "ERROR Read-only replica of " + leaderHost + ":" + std::to_string(leaderPort) + "\n";
+    }
+
+    if (cmd.operation == "STATS" || cmd.operation == "INFO") {
+        if (!cmd.key.empty() && cmd.key != "LIVE") {
+            return "ERROR Usage: STATS [LIVE]\n";
+        }
+        return "OK " + statsReport(cmd.key == "LIVE") + "\n";
+    }
+    else if (cmd.operation == "SYNC") {
+        // replica bootstrap: the image of the current state, then the change feed from this point on.
+        // Both go out through the feed's outbox, a large image doesn't block the loop. The reply owns the
+        // image and is moved into the outbox, which frees it once it is written.
+        std::string body;
+        {
+            std::ostringstream image;
+            save_image<std::string, std::string>(image, store.root);
+            body = image.str();
+        }
+        uint64_t sequence = changeLog.lastSequence();
+        changeFeed.subscribe(clientSocket, sequence);
+        std::string reply = "IMAGE " + std::to_string(body.size()) + " " + std::to_string(sequence) + "\n";
+        reply.reserve(reply.size() + body.size() + 1);
+        reply.append(body).append("\n");
+        return Response(std::move(reply));
+    }
+    else if (cmd.operation == "SUBSCRIBE" || cmd.operation == "UNSUBSCRIBE") {
+        // SUBSCRIBE CHANGES [FROM <seq>], without FROM the feed starts with the next change
+        if (cmd.key != "CHANGES") {
+            return "ERROR Usage: SUBSCRIBE CHANGES [FROM <seq>] / UNSUBSCRIBE CHANGES\n";
+        }
+        if (cmd.operation == "UNSUBSCRIBE") {
+            if (!changeFeed.unsubscribe(clientSocket)) {
+                return "ERROR Not subscribed\n";
+            }
+            return "OK Unsubscribed\n";
+        }
+        uint64_t from = changeLog.lastSequence();
+        if (!cmd.value.empty()) {
+            if (cmd.value.compare(0, 5, "FROM ") != 0) {
+                return "ERROR Usage: SUBSCRIBE CHANGES [FROM <seq>] / UNSUBSCRIBE CHANGES\n";
+            }
+            from = std::stoull(cmd.value.substr(5));
+        }
+        if (changeFeed.isSubscribed(clientSocket)) {
+            return "ERROR Already subscribed\n";
+        }
+        if (!changeFeed.subscribe(clientSocket, from)) {
+            return "ERROR Sequence " + std::to_string(from) + " is not in the change log (retained " +
+                   std::to_string(changeLog.firstSequence() - 1) + ".." + std::to_string(changeLog.lastSequence()) + ")\n";
+        }
+        // the backlog goes out with the next flush, after this reply
+        return "OK Subscribed to changes from " + std::to_string(from) + "\n";
+    }
+    else if (cmd.operation == "WATCH") {
+        WatchRequest request;
+        if (!parseWatchRequest(cmd.key, cmd.value, request)) {
+            return "ERROR Invalid watch operation. Use SET, DEL, EDIT, or ALL [COALESCE <ms>] [RATE <n>] [FROM <seq>]\n";
+        }
+        if (!request.resume) {
+            watchManager.addWatch(clientSocket, request.target, request.operation, request.kind, request.options);
+            return "OK Watching " + describeWatch(request) + " for " + request.operationName + " operations\n";
+        }
+
+        uint64_t from = request.fromNow ? changeLog.lastSequence() : request.from;
+        if (!changeLog.covers(from)) {
+            return "ERROR Sequence " + std::to_string(from) + " is not in the change log (retained " +
+                   std::to_string(changeLog.firstSequence() - 1) + ".." + std::to_string(changeLog.lastSequence()) + ")\n";
+        }
+        // The server loop is the only writer, nothing can be logged between the replay and the registration,
+        // and both go through the client's delivery worker, so the replay is queued before any live change.
+        WatchKey watch{request.target, request.operation, request.kind};
+        std::vector<std::string> missed;
+        changeLog.forEachSince(from, [&](const ChangeEntry& change) {
+            WatchOperation operation;
+            if (watchOperation(change.type, operation) && watchMatches(watch, change.key, operation)) {
+                missed.push_back(notificationText(change.sequence, operation, change.key, change.value));
+            }
+        });
+        watchManager.addWatch(clientSocket, request.target, request.operation, request.kind, request.options);
+        watchManager.replay(clientSocket, missed);
+        return "OK Watching " + describeWatch(request) + " for " + request.operationName + " operations from " +
+               std::to_string(from) + ", replayed " + std::to_string(missed.size()) + "\n";
     } 
     else if (cmd.operation == "UNWATCH") {
         if (cmd.key.empty()) {
             watchManager.removeAllWatches(clientSocket);
             return "OK Removed all watches\n";
         } else {
-            WatchOperation op;
-            if (cmd.value == "SET") {
-                op = WatchOperation::SET;
-            } else if (cmd.value == "DEL") {
-                op = WatchOperation::DEL;
-            } else if (cmd.value == "EDIT") {
-                op = WatchOperation::EDIT;
-            } else if (cmd.value == "ALL") {
-                op = WatchOperation::ALL;
-            } else {
+            WatchRequest request;
+            if (!parseWatchRequest(cmd.key, cmd.value, request)) {
                 return "ERROR Invalid watch operation\n";
             }
             
-            watchManager.removeWatch(clientSocket, cmd.key, op);
-            return "OK Removed watch for " + cmd.key + "\n";
+            watchManager.removeWatch(clientSocket, request.target, request.operation, request.kind);
+            return "OK Removed watch for " + describeWatch(request) + "\n";
+        }
+    }
+    else if (cmd.operation == "GET" && readCache) {
+        int slot = readCache->lookup(cmd.key);
+        if (slot < 0) {
+            slot = store.find_slot(cmd.key);
+            if (slot >= 0) {
+                readCache->insert(cmd.key, slot);
+            }
+        }
+        if (slot >= 0) {
+            return Response("OK ", &values<std::string>[slot]);
+        } else {
+            return "ERROR Key not found\n";
         }
     }
     else if (cmd.operation == "GET") {
-        auto value = store.find(cmd.key);
-        if (value.has_value()) {
-            return "OK " + *value + "\n";
+        const std::string* value = store.find_ptr(cmd.key);
+        if (value) {
+            return Response("OK ", value);
         } else {
             return "ERROR Key not found\n";
         }
     } 
+    else if (cmd.operation == "MGET") {
+        if (cmd.key.empty()) {
+            return "ERROR Usage: MGET <key> [key ...]\n";
+        }
+        return multiGet(store, cmd.key, cmd.value);
+    }
+    else if (cmd.operation == "BRANCH") {
+        // BRANCH <name> [FROM <version>|FROM <branch>], without FROM a fork of what the connection is on
+        std::istringstream from(cmd.value);
+        std::string word, source;
+        from >> word >> source;
+        if (cmd.key.empty() || cmd.key == "main" || allDigits(cmd.key) ||
+            (!cmd.value.empty() && (word != "FROM" || source.empty()))) {
+            return "ERROR Usage: BRANCH <name> [FROM <version>|FROM <branch>]\n";
+        }
+        if (branches.count(cmd.key)) {
+            return "ERROR Branch " + cmd.key + " already exists\n";
+        }
+        if (source.empty()) {
+            source = checkout != checkedOut.end() ? checkout->second : "main";
+        }
+        int root;
+        if (allDigits(source)) {
+            size_t version = std::stoul(source);
+            if (version >= versions<std::string, std::string>.size()) {
+                return "ERROR Invalid version\n";
+            }
+            root = versions<std::string, std::string>[version].root;
+        } else if (source == "main") {
+            root = store.root;
+        } else if (branches.count(source)) {
+            root = branches[source].store.root;
+        } else {
+            return "ERROR No branch " + source + "\n";
+        }
+        branches[cmd.key].store = Treap<std::string, std::string>(root);
+        return "OK Branch " + cmd.key + " from " + source + "\n";
+    }
+    else if (cmd.operation == "CHECKOUT") {
+        // CHECKOUT <branch>, CHECKOUT main (or no name) goes back to the main store
+        if (cmd.key.empty() || cmd.key == "main") {
+            checkedOut.erase(clientSocket);
+            return "OK Checked out main\n";
+        }
+        if (!branches.count(cmd.key)) {
+            return "ERROR No branch " + cmd.key + "\n";
+        }
+        checkedOut[clientSocket] = cmd.key;
+        return "OK Checked out " + cmd.key + "\n";
+    }
+    else if (cmd.operation == "BRANCHES") {
+        std::string reply = "OK main";
+        for (auto& branch : branches) {
+            reply += " " + branch.first;
+        }
+        return reply + "\n";
+    }
+    else if (cmd.operation == "DELBRANCH") {
+        if (!branches.erase(cmd.key)) {
+            return "ERROR No branch " + cmd.key + "\n";
+        }
+        return "OK Deleted branch " + cmd.key + "\n";
+    }
+    else if (cmd.operation == "GETAT" || cmd.operation == "SCANAT") {
+        // GETAT <time> <key> / SCANAT <time> [prefix]: read the root of the last batch committed at or
+        // before <time>. SCANAT answers "OK <n>" and then n lines "<key> <value>", sorted by key.
+        int64_t timeMs;
+        if ((cmd.operation == "GETAT" && cmd.value.empty()) || !parseTimestamp(cmd.key, timeMs)) {
+            return "ERROR Usage: " + cmd.operation + " <ms since epoch|YYYY-MM-DDTHH:MM:SS|HH:MM:SS> " +
+                   (cmd.operation == "GETAT" ? "<key>" : "[prefix]") + "\n";
+        }
+        int root;
+        if (!rootLog.rootAt(timeMs, root)) {
+            return "ERROR No version at " + cmd.key + ", the version log starts at " +
+                   std::to_string(rootLog.firstTime()) + "\n";
+        }
+        Treap<std::string, std::string> asOf(root);
+        if (cmd.operation == "GETAT") {
+            const std::string* value = asOf.find_ptr(cmd.value);
+            if (value) {
+                return Response("OK ", value);
+            }
+            return "ERROR Key not found at " + cmd.key + "\n";
+        }
+        // The tree is ordered by key hash, keys with a common prefix are spread all over it and there is no
+        // range to seek to: every node is visited, but only the matches are copied, and sorting compares
+        // keys in place (the node arena doesn't change during the walk; a spilled value may be evicted from
+        // its cache by the next read, so values are copied).
+        std::vector<std::pair<const std::string*, std::string>> entries;
+        size_t bytes = 0;
+        asOf.for_each(root, [&](const std::string& key, const std::string& value) {
+            if (key.compare(0, cmd.value.size(), cmd.value) == 0) {
+                entries.emplace_back(&key, value);
+                bytes += key.size() + value.size() + 2;
+            }
+        });
+        std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) { return *a.first < *b.first; });
+        std::string reply = "OK " + std::to_string(entries.size()) + "\n";
+        reply.reserve(reply.size() + bytes);
+        for (auto& entry : entries) {
+            reply.append(*entry.first).append(" ").append(entry.second).append("\n");
+        }
+        return reply;
+    }
     else if (cmd.operation == "SET") {
-        auto existingValue = store.find(cmd.key);
-        if (existingValue.has_value()) {
+        if (store.contains(cmd.key)) {
             return "ERROR Key already exists\n";  
         }
         store.insert(cmd.key, cmd.value);
-        watchManager.notifyEvent(cmd.key, WatchOperation::SET, cmd.value);
+        recordChange(ChangeType::SET, cmd.key, cmd.value);
         return "OK\n";
     }
     
     else if (cmd.operation == "DEL") {
-        auto existingValue = store.find(cmd.key);
-        if (existingValue.has_value()) {
+        if (store.contains(cmd.key)) {
             store.remove(cmd.key);
-            watchManager.notifyEvent(cmd.key, WatchOperation::DEL, "");
+            recordChange(ChangeType::DEL, cmd.key, "");
             return "OK\n";
         } else {
             return "ERROR Key not found\n";  
         }
     }
     else if (cmd.operation == "EDIT") {
-        auto existingValue = store.find(cmd.key);
-        if (existingValue.has_value()) {
+        if (store.contains(cmd.key)) {
             store.edit(cmd.key, cmd.value);
-            watchManager.notifyEvent(cmd.key, WatchOperation::EDIT, cmd.value);
+            recordChange(ChangeType::EDIT, cmd.key, cmd.value);
             return "OK\n";
         } else {
             return "ERROR Key not found\n";  
         }
     }
     
+    else if (cmd.operation == "CAS") {
+        // CAS <key> <expected> <new value>: EDIT only if the value is still <expected>
+        std::string error = applyWrite(store, cmd);
+        if (!error.empty()) {
+            return error;
+        }
+        std::string expected, replacement;
+        splitCas(cmd.value, expected, replacement);
+        recordChange(ChangeType::EDIT, cmd.key, replacement);
+        return "OK\n";
+    }
+    else if (cmd.operation == "MULTI") {
+        // MULTI [<sequence>]: queue writes until EXEC. Keys written by others after <sequence> (default: now)
+        // make the EXEC fail, so a client can read, note SEQ and commit what it computed from the reads.
+        Transaction started;
+        started.sequence = changeLog.lastSequence();
+        if (!cmd.key.empty()) {
+            if (!allDigits(cmd.key) || std::stoull(cmd.key) > started.sequence) {
+                return "ERROR Usage: MULTI [<sequence>], the latest sequence is " + std::to_string(started.sequence) + "\n";
+            }
+            started.sequence = std::stoull(cmd.key);
+        }
+        if (checkout != checkedOut.end()) {
+            auto branch = branches.find(checkout->second);
+            if (branch == branches.end()) {
+                return "ERROR Branch " + checkout->second + " no longer exists, CHECKOUT another one\n";
+            }
+            started.branch = branch->first;
+            started.branchRoot = branch->second.store.root;
+        }
+        uint64_t sequence = started.sequence;
+        transactions[clientSocket] = std::move(started);
+        return "OK Transaction from sequence " + std::to_string(sequence) + "\n";
+    }
+    else if (cmd.operation == "EXEC") {
+        if (transaction == transactions.end()) {
+            return "ERROR EXEC without MULTI\n";
+        }
+        return executeTransaction(clientSocket);
+    }
+    else if (cmd.operation == "DISCARD") {
+        if (!transactions.erase(clientSocket)) {
+            return "ERROR DISCARD without MULTI\n";
+        }
+        return "OK Discarded\n";
+    }
+    else if (cmd.operation == "SEQ") {
+        return "OK " + std::to_string(changeLog.lastSequence()) + "\n";
+    }
     else if (cmd.operation == "SNAPSHOT") {
         snapshot<std::string, std::string>(store);
-        return "OK Snapshot created, version " + 
-               std::to_string(versions<std::string, std::string>.size() - 1) + "\n";
+        std::string version = std::to_string(versions<std::string, std::string>.size() - 1);
+        recordChange(ChangeType::SNAPSHOT, version, "");
+        return "OK Snapshot created, version " + version + "\n";
+    }
+    else if (cmd.operation == "COMPACT") {
+        // same contents, new slots: nothing to log or invalidate, the next checkpoint delta carries the copy
+        return compact(store.root, "store");
     }
     else if (cmd.operation == "VGET") {
         if (cmd.version >= 0 && cmd.version < versions<std::string, std::string>.size()) {
+            if (versionFiltersEnabled && !versionFilters<std::string, std::string>.mayContain(cmd.version, hasher(cmd.key))) {
+                return "ERROR Key not found in version " + std::to_string(cmd.version) + "\n";
+            }
             auto rolledBackTreap = rollback<std::string, std::string>(cmd.version);
-            auto value = rolledBackTreap.find(cmd.key);
-            if (value.has_value()) {
-                return "OK " + *value + "\n";
+            const std::string* value = rolledBackTreap.find_ptr(cmd.key);
+            if (value) {
+                return Response("OK ", value);
             } else {
                 return "ERROR Key not found in version " + std::to_string(cmd.version) + "\n";
             }
@@ -262,8 +1144,8 @@ std::string Server::processCommand(const std::string& command, int clientSocket)
     }
     else if(cmd.operation == "STORE")
     {
-        ofstream os("../save/"+cmd.value);
-        save<string, string>(os, store.root);
+        ofstream os("../save/"+cmd.value, ios::binary);
+        save_image<string, string>(os, store.root);
         os.close();
         return "DATABASE and SNAPSHOTS saved to " + cmd.value + "\n";
     }
@@ -275,28 +1157,95 @@ std::string Server::processCommand(const std::string& command, int clientSocket)
     }
     else if (cmd.operation == "LOAD")
     {
-        ifstream is("../save/"+cmd.value);
+        ifstream is("../save/"+cmd.value, ios::binary);
         if(!is.is_open()){
             return "ERROR in opening " + cmd.value + "\n";
         }
-        int root = load<string, string>(is);
-        store = Treap<string, string>(root);
-        is.close();
+        char magic[sizeof(image::MAGIC)] = {};
+        is.read(magic, sizeof(magic));
+        if(std::memcmp(magic, image::MAGIC, sizeof(magic)) == 0){
+            // binary image (STORE), checked and decoded in parallel. A bad image throws before anything is
+            // replaced, the store stays as it is and nothing is logged.
+            is.close();
+            int root;
+            try{
+                root = load_image_file<string, string>("../save/"+cmd.value);
+            }catch(const std::exception& e){
+                return string("ERROR Load failed: ") + e.what() + "\n";
+            }
+            store = Treap<string, string>(root);
+        }else if(std::memcmp(magic, image::MAGIC, sizeof(magic) - 1) == 0){
+            return "ERROR Load failed: unsupported image version " + string(1, magic[sizeof(magic) - 1]) + "\n";
+        }else{
+            // text dump of earlier versions
+            is.clear();
+            is.seekg(0);
+            int root = load<string, string>(is);
+            store = Treap<string, string>(root);
+            is.close();
+        }
+        recordChange(ChangeType::RELOAD, cmd.operation, "");
         return "DATABASE and SNAPSHOTS Loaded\n";
     }
     else if (cmd.operation == "VLOAD")
     {
         ifstream is("../save/"+cmd.value);
         if(!is.is_open()){
-            return "ERROR in opening " + cmd.value;
+            return "ERROR in opening " + cmd.value + "\n";
         }
         store.load(is);
         is.close();
+        recordChange(ChangeType::RELOAD, cmd.operation, "");
         return "DATABASE Loaded\n";
     }
+    else if (cmd.operation == "PEEK")
+    {
+        // PEEK <file> <key> [version]: read a key from a STOREd image without loading it, through the image's
+        // block index only the blocks on the key's path are checked and decompressed. The file is opened for
+        // every PEEK, a later STORE to the same name may have rewritten it.
+        std::istringstream args(cmd.value);
+        std::string key, version;
+        args >> key >> version;
+        if (cmd.key.empty() || key.empty() || (!version.empty() && !allDigits(version))) {
+            return "ERROR Usage: PEEK <file> <key> [version]\n";
+        }
+        try {
+            image::ImageReader<string, string> reader("../save/" + cmd.key);
+            uint32_t root = version.empty() ? reader.root() : reader.versionRoot(std::stoul(version));
+            std::optional<string> value = reader.find(root, key);
+            if (!value) {
+                return "ERROR Key not found\n";
+            }
+            return "OK " + *value + "\n";
+        } catch (const std::exception& e) {
+            return string("ERROR Peek failed: ") + e.what() + "\n";
+        }
+    }
+    else if (cmd.operation == "CHECKPOINT") {
+        std::string name = cmd.key.empty() ? "checkpoint" : cmd.key;
+        try {
+            return "OK Checkpoint " + runCheckpoint(name) + "\n";
+        } catch (const std::exception& e) {
+            return std::string("ERROR Checkpoint failed: ") + e.what() + "\n";
+        }
+    }
+    else if (cmd.operation == "RESTORE") {
+        std::string name = cmd.key.empty() ? "checkpoint" : cmd.key;
+        // the whole chain is decoded before the arenas are replaced, a failed restore changes nothing
+        int root;
+        try {
+            root = checkpointerFor(name).restore();
+        } catch (const std::exception& e) {
+            return std::string("ERROR Restore failed: ") + e.what() + "\n";
+        }
+        store = Treap<string, string>(root);
+        recordChange(ChangeType::RELOAD, cmd.operation, "");
+        return "OK Restored " + name + ", " + std::to_string(versions<string, string>.size()) + " versions\n";
+    }
     else if(cmd.operation == "CHANGE")
     {
         store = rollback<string, string>(cmd.version);
+        recordChange(ChangeType::CHANGE, to_string(cmd.version), "");
         return "CHANGE to version " + to_string(cmd.version) + "\n";
     }
     else {
@@ -304,6 +1253,156 @@ std::string Server::processCommand(const std::string& command, int clientSocket)
     }
 }
 
+// Data commands on a branch. The replies are those of the main store, but nothing is recorded (no change log,
+// watches, replication or read cache) and SNAPSHOT/VGET/CHANGE number the branch's own snapshots.
+Server::Response Server::executeOnBranch(const Command& cmd, Branch& branch) {
+    Treap<std::string, std::string>& target = branch.store;
+    if (cmd.operation == "GET") {
+        const std::string* value = target.find_ptr(cmd.key);
+        if (value) {
+            return Response("OK ", value);
+        }
+        return "ERROR Key not found\n";
+    }
+    else if (cmd.operation == "MGET") {
+        if (cmd.key.empty()) {
+            return "ERROR Usage: MGET <key> [key ...]\n";
+        }
+        return multiGet(target, cmd.key, cmd.value);
+    }
+    else if (cmd.operation == "SET" || cmd.operation == "DEL" || cmd.operation == "EDIT" || cmd.operation == "CAS") {
+        std::string error = applyWrite(target, cmd);
+        return error.empty() ? "OK\n" : error;
+    }
+    else if (cmd.operation == "SNAPSHOT") {
+        branch.snapshots.push_back(target.root);
+        return "OK Snapshot created, version " + std::to_string(branch.snapshots.size() - 1) + "\n";
+    }
+    else if (cmd.operation == "COMPACT") {
+        return compact(target.root, "branch");
+    }
+    if (cmd.version < 0 || cmd.version >= (int)branch.snapshots.size()) {
+        return "ERROR Invalid version\n";
+    }
+    if (cmd.operation == "VGET") {
+        const std::string* value = Treap<std::string, std::string>(branch.snapshots[cmd.version]).find_ptr(cmd.key);
+        if (value) {
+            return Response("OK ", value);
+        }
+        return "ERROR Key not found in version " + std::to_string(cmd.version) + "\n";
+    }
+    target.root = branch.snapshots[cmd.version];
+    return "CHANGE to version " + std::to_string(cmd.version) + "\n";
+}
+
+// SET/DEL/EDIT/CAS on target. "" when applied, else the reply the command gets on its own.
+std::string Server::applyWrite(Treap<std::string, std::string>& target, const Command& cmd) {
+    if (cmd.operation == "SET") {
+        if (target.contains(cmd.key)) {
+            return "ERROR Key already exists\n";
+        }
+        target.insert(cmd.key, cmd.value);
+    } else if (cmd.operation == "CAS") {
+        std::string expected, replacement;
+        if (!splitCas(cmd.value, expected, replacement)) {
+            return "ERROR Usage: CAS <key> <expected value> <new value>\n";
+        }
+        const std::string* current = target.find_ptr(cmd.key);
+        if (!current) {
+            return "ERROR Key not found\n";
+        }
+        if (*current != expected) {
+            return "ERROR Value mismatch\n";
+        }
+        target.edit(cmd.key, replacement);
+    } else {
+        if (!target.contains(cmd.key)) {
+            return "ERROR Key not found\n";
+        }
+        if (cmd.operation == "DEL") {
+            target.remove(cmd.key);
+        } else {
+            target.edit(cmd.key, cmd.value);
+        }
+    }
+    return "";
+}
+
+// EXEC. The queued writes go to a private copy of the root, which replaces the root only when there was no
+// conflicting change and every write succeeded; otherwise nothing changes (the copy's nodes just stay
+// unreferenced in the arena). On the main store the writes are then logged one by one like single commands,
+// all within this batch, so watchers and replicas get them in one flush.
+Server::Response Server::executeTransaction(int clientSocket) {
+    Transaction transaction = std::move(transactions[clientSocket]);
+    transactions.erase(clientSocket);
+
+    Treap<std::string, std::string>* target = &store;
+    if (!transaction.branch.empty()) {
+        auto branch = branches.find(transaction.branch);
+        if (branch == branches.end()) {
+            return "ERROR Branch " + transaction.branch + " no longer exists, transaction discarded\n";
+        }
+        if (branch->second.store.root != transaction.branchRoot) {
+            return "ERROR Conflict: branch " + transaction.branch + " was written since MULTI\n";
+        }
+        target = &branch->second.store;
+    } else {
+        if (isReplica()) {
+            return "ERROR Read-only replica of " + leaderHost + ":" + std::to_string(leaderPort) + "\n";
+        }
+        if (!changeLog.covers(transaction.sequence)) {
+            return "ERROR Conflict: sequence " + std::to_string(transaction.sequence) + " is no longer in the change log\n";
+        }
+        std::unordered_set<std::string> keys;
+        for (const Command& write : transaction.queued) {
+            keys.insert(write.key);
+        }
+        std::string conflict;
+        changeLog.forEachSince(transaction.sequence, [&](const ChangeEntry& change) {
+            if (!conflict.empty()) {
+                return;
+            }
+            if (change.type == ChangeType::CHANGE || change.type == ChangeType::RELOAD) {
+                conflict = "the store was replaced";
+            } else if (change.type != ChangeType::SNAPSHOT && keys.count(change.key)) {
+                conflict = change.key + " was written";
+            }
+        });
+        if (!conflict.empty()) {
+            return "ERROR Conflict: " + conflict + " after sequence " + std::to_string(transaction.sequence) + "\n";
+        }
+    }
+
+    Treap<std::string, std::string> draft(target->root);
+    for (size_t i = 0; i < transaction.queued.size(); i++) {
+        const Command& write = transaction.queued[i];
+        std::string error = applyWrite(draft, write);
+        if (!error.empty()) {
+            return "ERROR Transaction aborted at command " + std::to_string(i + 1) + " (" + write.operation + " " +
+                   write.key + "): " + error.substr(6);
+        }
+    }
+    target->root = draft.root;
+    std::string executed = "OK Executed " + std::to_string(transaction.queued.size()) + " commands";
+    if (target != &store) {
+        return executed + "\n";
+    }
+    for (const Command& write : transaction.queued) {
+        if (write.operation == "SET") {
+            recordChange(ChangeType::SET, write.key, write.value);
+        } else if (write.operation == "DEL") {
+            recordChange(ChangeType::DEL, write.key, "");
+        } else if (write.operation == "EDIT") {
+            recordChange(ChangeType::EDIT, write.key, write.value);
+        } else {
+            std::string expected, replacement;
+            splitCas(write.value, expected, replacement);
+            recordChange(ChangeType::EDIT, write.key, replacement);
+        }
+    }
+    return executed + ", sequence " + std::to_string(changeLog.lastSequence()) + "\n";
+}
+
 // Fill command struct according to command entered.
 Server::Command Server::parseCommand(const std::string& commandStr) {
     Command cmd;
@@ -0,0 +1,175 @@
+#include "../include/stats.hpp"
+#include <sstream>
+#include <cctype>
+
+namespace kvdb {
+
+static const char* COMMAND_NAMES[ServerStats::COMMAND_TYPES] = {
+    "GET", "SET", "DEL", "EDIT", "SNAPSHOT", "VGET", "CHANGE",
+    "WATCH", "UNWATCH", "STORE", "VSTORE", "LOAD", "VLOAD", "STATS", "MGET",
+    "CAS", "EXEC", "CHECKPOINT", "RESTORE", "COMPACT", "GETAT", "SCANAT", "OTHER"
+};
+
+ServerStats::CommandType ServerStats::commandType(const std::string& operation) {
+    if (operation == "INFO") return STATS;
+    for (int i = 0; i < OTHER; i++) {
+        if (operation == COMMAND_NAMES[i]) return static_cast<CommandType>(i);
+    }
+    return OTHER;
+}
+
+const char* ServerStats::commandName(CommandType type) {
+    return COMMAND_NAMES[type];
+}
+
+void ServerStats::recordCommand(CommandType type, uint64_t latencyNs, bool error) {
+    CommandStats& stats = commands[type];
+    stats.count.fetch_add(1, std::memory_order_relaxed);
+    if (error) {
+        stats.errors.fetch_add(1, std::memory_order_relaxed);
+    }
+    stats.latency.record(latencyNs);
+}
+
+void ServerStats::connectionOpened() {
+    currentConnections.fetch_add(1, std::memory_order_relaxed);
+    totalConnections.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ServerStats::connectionClosed() {
+    currentConnections.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void ServerStats::publishStore(uint64_t nodes, uint64_t values, uint64_t versions, uint64_t keyBytes, uint64_t valueBytes) {
+    storeNodes.store(nodes, std::memory_order_relaxed);
+    storeValues.store(values, std::memory_order_relaxed);
+    storeVersions.store(versions, std::memory_order_relaxed);
+    storeKeyBytes.store(keyBytes, std::memory_order_relaxed);
+    storeValueBytes.store(valueBytes, std::memory_order_relaxed);
+}
+
+void ServerStats::publishDedup(uint64_t deduplicated, uint64_t bytesSaved) {
+    valuesDeduplicated.store(deduplicated, std::memory_order_relaxed);
+    valueBytesSaved.store(bytesSaved, std::memory_order_relaxed);
+}
+
+void ServerStats::publishSpill(uint64_t spilledBytes, uint64_t cacheHits, uint64_t cacheMisses) {
+    valueBytesSpilled.store(spilledBytes, std::memory_order_relaxed);
+    spillCacheHits.store(cacheHits, std::memory_order_relaxed);
+    spillCacheMisses.store(cacheMisses, std::memory_order_relaxed);
+}
+
+void ServerStats::publishVersionFilters(uint64_t negatives) {
+    versionFilterNegatives.store(negatives, std::memory_order_relaxed);
+}
+
+void ServerStats::publishReadCache(uint64_t entries, uint64_t hits, uint64_t misses) {
+    readCacheEntries.store(entries, std::memory_order_relaxed);
+    readCacheHits.store(hits, std::memory_order_relaxed);
+    readCacheMisses.store(misses, std::memory_order_relaxed);
+}
+
+std::string ServerStats::commandReport() const {
+    std::ostringstream os;
+    os.setf(std::ios::fixed);
+    os.precision(1);
+    bool first = true;
+    for (int i = 0; i < COMMAND_TYPES; i++) {
+        const CommandStats& stats = commands[i];
+        uint64_t count = stats.count.load(std::memory_order_relaxed);
+        if (count == 0) continue;
+
+        std::string name = COMMAND_NAMES[i];
+        for (char& c : name) c = std::tolower(c);
+        if (!first) os << ' ';
+        first = false;
+        os << name << ".count=" << count
+           << ' ' << name << ".errors=" << stats.errors.load(std::memory_order_relaxed)
+           << ' ' << name << ".p50_us=" << stats.latency.percentile(50) / 1000.0
+           << ' ' << name << ".p99_us=" << stats.latency.percentile(99) / 1000.0
+           << ' ' << name << ".p999_us=" << stats.latency.percentile(99.9) / 1000.0;
+    }
+    return os.str();
+}
+
+// latency bucket bounds in seconds, cumulative like Prometheus expects
+static const double LATENCY_BUCKETS[] = {
+    0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.05, 0.1, 0.5, 1.0
+};
+
+static void gauge(std::ostringstream& os, const char* name, const char* help, const char* type, uint64_t value) {
+    os << "# HELP " << name << ' ' << help << '\n'
+       << "# TYPE " << name << ' ' << type << '\n'
+       << name << ' ' << value << '\n';
+}
+
+std::string ServerStats::prometheusText() const {
+    std::ostringstream os;
+
+    os << "# HELP kvdb_commands_total Commands executed, by command.\n"
+       << "# TYPE kvdb_commands_total counter\n";
+    for (int i = 0; i < COMMAND_TYPES; i++) {
+        os << "kvdb_commands_total{command=\"" << COMMAND_NAMES[i] << "\"} "
+           << commands[i].count.load(std::memory_order_relaxed) << '\n';
+    }
+
+    os << "# HELP kvdb_command_errors_total Commands answered with ERROR, by command.\n"
+       << "# TYPE kvdb_command_errors_total counter\n";
+    for (int i = 0; i < COMMAND_TYPES; i++) {
+        os << "kvdb_command_errors_total{command=\"" << COMMAND_NAMES[i] << "\"} "
+           << commands[i].errors.load(std::memory_order_relaxed) << '\n';
+    }
+
+    os << "# HELP kvdb_command_duration_seconds Time to parse and execute a command.\n"
+       << "# TYPE kvdb_command_duration_seconds histogram\n";
+    for (int i = 0; i < COMMAND_TYPES; i++) {
+        const LatencyHistogram& latency = commands[i].latency;
+        if (latency.count() == 0) continue;
+        for (double bound : LATENCY_BUCKETS) {
+            os << "kvdb_command_duration_seconds_bucket{command=\"" << COMMAND_NAMES[i] << "\",le=\"" << bound << "\"} "
+               << latency.countAtOrBelow((uint64_t)(bound * 1e9)) << '\n';
+        }
+        os << "kvdb_command_duration_seconds_bucket{command=\"" << COMMAND_NAMES[i] << "\",le=\"+Inf\"} "
+           << latency.count() << '\n';
+        os << "kvdb_command_duration_seconds_sum{command=\"" << COMMAND_NAMES[i] << "\"} "
+           << latency.totalSum() / 1e9 << '\n';
+        os << "kvdb_command_duration_seconds_count{command=\"" << COMMAND_NAMES[i] << "\"} "
+           << latency.count() << '\n';
+    }
+
+    gauge(os, "kvdb_connections", "Currently connected clients.", "gauge",
+          currentConnections.load(std::memory_order_relaxed));
+    gauge(os, "kvdb_connections_total", "Accepted client connections.", "counter",
+          totalConnections.load(std::memory_order_relaxed));
+    gauge(os, "kvdb_nodes", "Slots in the node arena (all versions and path copies).", "gauge",
+          storeNodes.load(std::memory_order_relaxed));
+    gauge(os, "kvdb_values", "Slots in the value arena.", "gauge",
+          storeValues.load(std::memory_order_relaxed));
+    gauge(os, "kvdb_versions", "Retained snapshots.", "gauge",
+          storeVersions.load(std::memory_order_relaxed));
+    gauge(os, "kvdb_key_bytes", "Bytes of keys held by the node arena.", "gauge",
+          storeKeyBytes.load(std::memory_order_relaxed));
+    gauge(os, "kvdb_value_bytes", "Bytes of values held by the value arena.", "gauge",
+          storeValueBytes.load(std::memory_order_relaxed));
+    gauge(os, "kvdb_values_deduplicated_total", "Value writes that reused an identical stored value.", "counter",
+          valuesDeduplicated.load(std::memory_order_relaxed));
+    gauge(os, "kvdb_value_bytes_saved_total", "Bytes not stored thanks to value deduplication.", "counter",
+          valueBytesSaved.load(std::memory_order_relaxed));
+    gauge(os, "kvdb_value_bytes_spilled", "Bytes of values kept in the on-disk value log instead of memory.", "gauge",
+          valueBytesSpilled.load(std::memory_order_relaxed));
+    gauge(os, "kvdb_value_cache_hits_total", "Reads of spilled values served from the value cache.", "counter",
+          spillCacheHits.load(std::memory_order_relaxed));
+    gauge(os, "kvdb_value_cache_misses_total", "Reads of spilled values that went to the value log.", "counter",
+          spillCacheMisses.load(std::memory_order_relaxed));
+    gauge(os, "kvdb_read_cache_entries", "Keys held by the GET read cache.", "gauge",
+          readCacheEntries.load(std::memory_order_relaxed));
+    gauge(os, "kvdb_read_cache_hits_total", "GETs answered from the read cache.", "counter",
+          readCacheHits.load(std::memory_order_relaxed));
+    gauge(os, "kvdb_read_cache_misses_total", "GETs that walked the treap.", "counter",
+          readCacheMisses.load(std::memory_order_relaxed));
+    gauge(os, "kvdb_version_filter_negatives_total", "VGETs answered by a snapshot's Bloom filter.", "counter",
+          versionFilterNegatives.load(std::memory_order_relaxed));
+    return os.str();
+}
+
+}
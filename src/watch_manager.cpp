@@ -1,12 +1,22 @@
 #include "../include/watch_manager.hpp"
 #include <algorithm>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <climits>
 #include <iostream>
 
 namespace kvdb {
 
-WatchManager::WatchManager() : running(false) {}
+WatchManager::WatchManager(size_t shardCount, size_t workerCount, size_t maxQueuedPerClient)
+    : maxQueuedPerClient(std::max<size_t>(1, maxQueuedPerClient)), running(false) {
+    for (size_t i = 0; i < std::max<size_t>(1, shardCount); i++) {
+        shards.push_back(std::make_unique<Shard>());
+    }
+    for (size_t i = 0; i < std::max<size_t>(1, workerCount); i++) {
+        workers.push_back(std::make_unique<Worker>());
+    }
+}
 
 WatchManager::~WatchManager() {
     stop();
@@ -14,159 +24,516 @@ WatchManager::~WatchManager() {
 
 void WatchManager::start() {
     if (!running.exchange(true)) {
-        notificationThread = std::thread(&WatchManager::notificationLoop, this);
+        for (auto& worker : workers) {
+            worker->thread = std::thread(&WatchManager::notificationLoop, this, std::ref(*worker));
+        }
     }
 }
 
 void WatchManager::stop() {
     if (running.exchange(false)) {
-        queueCV.notify_one();
-        if (notificationThread.joinable()) {
-            notificationThread.join();
+        for (auto& worker : workers) {
+            {
+                // taking the lock makes sure the worker is either waiting or will see running == false
+                std::lock_guard<std::mutex> lock(worker->mutex);
+            }
+            worker->cv.notify_one();
+            if (worker->thread.joinable()) {
+                worker->thread.join();
+            }
         }
     }
 }
 
+WatchManager::Shard& WatchManager::shardFor(const std::string& key) {
+    return *shards[std::hash<std::string>()(key) % shards.size()];
+}
+
+WatchManager::Worker& WatchManager::workerFor(int clientSocket) {
+    return *workers[static_cast<size_t>(clientSocket) % workers.size()];
+}
+
 // O(1) operation - add watch with hash-based indexing
-void WatchManager::addWatch(int clientSocket, const std::string& key, WatchOperation operation) {
-    std::lock_guard<std::mutex> lock(watchMutex);
-    
+void WatchManager::addWatch(int clientSocket, const std::string& key, WatchOperation operation, WatchKind kind,
+                            WatchOptions options) {
     // Create the watch key
-    WatchKey watchKey{key, operation};
-    
-    // Add to watch index (key+operation -> clients)
-    watchIndex[watchKey].insert(clientSocket);
+    WatchKey watchKey{key, operation, kind};
+    options.since = eventCount.load(std::memory_order_relaxed);
     
     // Add to client index (client -> keys+operations)
-    clientIndex[clientSocket].insert(watchKey);
+    bool existing;
+    {
+        std::lock_guard<std::mutex> lock(clientMutex);
+        existing = !clientIndex[clientSocket].insert(watchKey).second;
+    }
+    
+    // a repeated WATCH replaces the options of the existing watch
+    if (existing) {
+        unindex(clientSocket, watchKey);
+    }
+    index(clientSocket, watchKey, options);
 }
 
-// O(1) operation - remove specific watch
-void WatchManager::removeWatch(int clientSocket, const std::string& key, WatchOperation operation) {
-    std::lock_guard<std::mutex> lock(watchMutex);
-    
-    WatchKey watchKey{key, operation};
-    
-    // Remove from watch index
-    auto watchIt = watchIndex.find(watchKey);
-    if (watchIt != watchIndex.end()) {
-        watchIt->second.erase(clientSocket);
-        if (watchIt->second.empty()) {
-            watchIndex.erase(watchIt);
+// Add one watch to the key shards or the pattern trie
+void WatchManager::index(int clientSocket, const WatchKey& watchKey, WatchOptions options) {
+    if (watchKey.kind == WatchKind::KEY) {
+        // Add to watch index (key+operation -> clients)
+        Shard& shard = shardFor(watchKey.key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.watchIndex[watchKey].insert_or_assign(clientSocket, options).second) {
+            keyWatchCount++;
         }
+    } else {
+        std::lock_guard<std::mutex> lock(patternMutex);
+        std::string prefix = watchKey.kind == WatchKind::PREFIX ? watchKey.key : globPrefix(watchKey.key);
+        patternIndex.insert(prefix, PatternWatch{clientSocket, watchKey.operation, watchKey.kind, watchKey.key, options});
+        patternCount = patternIndex.size();
     }
+}
+
+// Remove one watch from the key shards or the pattern trie (not from the client index)
+void WatchManager::unindex(int clientSocket, const WatchKey& watchKey) {
+    if (watchKey.kind == WatchKind::KEY) {
+        Shard& shard = shardFor(watchKey.key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto watchIt = shard.watchIndex.find(watchKey);
+        if (watchIt != shard.watchIndex.end()) {
+            if (watchIt->second.erase(clientSocket)) {
+                keyWatchCount--;
+            }
+            if (watchIt->second.empty()) {
+                shard.watchIndex.erase(watchIt);
+            }
+        }
+    } else {
+        std::lock_guard<std::mutex> lock(patternMutex);
+        std::string prefix = watchKey.kind == WatchKind::PREFIX ? watchKey.key : globPrefix(watchKey.key);
+        patternIndex.remove(prefix, [&](const PatternWatch& watch) {
+            return watch.clientSocket == clientSocket && watch.operation == watchKey.operation &&
+                   watch.kind == watchKey.kind && watch.pattern == watchKey.key;
+        });
+        patternCount = patternIndex.size();
+    }
+}
+
+// O(1) operation - remove specific watch
+void WatchManager::removeWatch(int clientSocket, const std::string& key, WatchOperation operation, WatchKind kind) {
+    WatchKey watchKey{key, operation, kind};
     
     // Remove from client index
-    auto clientIt = clientIndex.find(clientSocket);
-    if (clientIt != clientIndex.end()) {
-        clientIt->second.erase(watchKey);
+    {
+        std::lock_guard<std::mutex> lock(clientMutex);
+        auto clientIt = clientIndex.find(clientSocket);
+        if (clientIt == clientIndex.end() || !clientIt->second.erase(watchKey)) {
+            return;
+        }
         if (clientIt->second.empty()) {
             clientIndex.erase(clientIt);
         }
     }
+    
+    // Remove from watch index
+    unindex(clientSocket, watchKey);
 }
 
 // O(n) operation where n is the number of watches for this client
 void WatchManager::removeAllWatches(int clientSocket) {
-    std::lock_guard<std::mutex> lock(watchMutex);
-    
-    auto clientIt = clientIndex.find(clientSocket);
-    if (clientIt != clientIndex.end()) {
-        // For each key+operation this client is watching
-        for (const auto& watchKey : clientIt->second) {
-            // Remove client from the watch index
-            auto watchIt = watchIndex.find(watchKey);
-            if (watchIt != watchIndex.end()) {
-                watchIt->second.erase(clientSocket);
-                if (watchIt->second.empty()) {
-                    watchIndex.erase(watchIt);
-                }
-            }
+    std::unordered_set<WatchKey, WatchKeyHash> watched;
+    {
+        std::lock_guard<std::mutex> lock(clientMutex);
+        auto clientIt = clientIndex.find(clientSocket);
+        if (clientIt == clientIndex.end()) {
+            return;
         }
-        // Remove all client watches
+        watched.swap(clientIt->second);
         clientIndex.erase(clientIt);
     }
+
+    // For each key+operation this client is watching, remove the client from its shard (or the trie)
+    for (const auto& watchKey : watched) {
+        unindex(clientSocket, watchKey);
+    }
+
+    // Forget open coalescing windows and a cut message, the socket number may be reused by the next client
+    Worker& worker = workerFor(clientSocket);
+    std::lock_guard<std::mutex> lock(worker.mutex);
+    worker.disconnected.push_back(clientSocket);
+    for (auto it = worker.windows.begin(); it != worker.windows.end();) {
+        if (it->first.clientSocket == clientSocket) {
+            it = worker.windows.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+size_t WatchManager::watchCount() {
+    std::lock_guard<std::mutex> lock(clientMutex);
+    size_t count = 0;
+    for (const auto& entry : clientIndex) {
+        count += entry.second.size();
+    }
+    return count;
+}
+
+size_t WatchManager::queueDepth() {
+    size_t depth = 0;
+    for (auto& worker : workers) {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        depth += worker->events.size() + worker->queue.size();
+    }
+    return depth;
 }
 
-// Asynchronous notification - O(1) lookup, O(n) queue where n is number of clients to notify
-void WatchManager::notifyEvent(const std::string& key, WatchOperation operation, const std::string& value) {
-    // Format the notification message
-    std::string opStr;
+std::string notificationText(uint64_t sequence, WatchOperation operation, const std::string& key,
+                             const std::string& value) {
+    const char* opStr;
     switch (operation) {
         case WatchOperation::SET: opStr = "SET"; break;
         case WatchOperation::DEL: opStr = "DEL"; break;
         case WatchOperation::EDIT: opStr = "EDIT"; break;
         default: opStr = "UNKNOWN"; break;
     }
-    
-    std::string notificationMsg = "NOTIFICATION " + opStr + " " + key;
+    std::string notificationMsg;
+    notificationMsg.reserve(40 + key.size() + value.size());
+    notificationMsg.append("NOTIFICATION ");
+    if (sequence > 0) {
+        notificationMsg.append(std::to_string(sequence)).append(" ");
+    }
+    notificationMsg.append(opStr).append(" ").append(key);
     if (operation != WatchOperation::DEL) {
-        notificationMsg += " " + value;
+        notificationMsg.append(" ").append(value);
     }
-    notificationMsg += "\n";
-    
-    // Get clients to notify with O(1) lookup
-    std::unordered_set<int> clientsToNotify;
+    notificationMsg += '\n';
+    return notificationMsg;
+}
+
+// Asynchronous notification - the server loop only copies the event and hands it to the workers, finding the
+// watchers (shard lookup, trie walk) and formatting the message happens on the delivery threads
+void WatchManager::notifyEvent(const std::string& key, WatchOperation operation, const std::string& value,
+                               uint64_t sequence) {
+    if (keyWatchCount.load(std::memory_order_relaxed) == 0 && patternCount.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+    auto event = std::make_shared<const Event>(Event{key, operation, value, sequence, ++eventCount});
+    for (auto& worker : workers) {
+        {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            worker->events.push_back(event);
+        }
+        worker->cv.notify_one();
+    }
+}
+
+// The watchers of one event that this worker delivers to - O(1) lookup in the key's shard, O(key length)
+// in the pattern trie. Each client appears once.
+void WatchManager::match(const Worker& worker, const Event& event, std::vector<std::pair<int, WatchOptions>>& clients) {
+    clients.clear();
+    auto wanted = [&](int clientSocket, const WatchOptions& options) {
+        return options.since < event.number && &workerFor(clientSocket) == &worker;
+    };
     {
-        std::lock_guard<std::mutex> lock(watchMutex);
+        Shard& shard = shardFor(event.key);
+        std::lock_guard<std::mutex> lock(shard.mutex);
         
         // Check specific operation watchers
-        WatchKey specificKey{key, operation};
-        auto specificIt = watchIndex.find(specificKey);
-        if (specificIt != watchIndex.end()) {
-            clientsToNotify.insert(specificIt->second.begin(), specificIt->second.end());
+        auto specificIt = shard.watchIndex.find(WatchKey{event.key, event.operation});
+        const std::unordered_map<int, WatchOptions>* specific = nullptr;
+        if (specificIt != shard.watchIndex.end()) {
+            specific = &specificIt->second;
+            for (const auto& watcher : *specific) {
+                if (wanted(watcher.first, watcher.second)) {
+                    clients.push_back(watcher);
+                }
+            }
         }
         
-        // Check ALL operation watchers
-        WatchKey allKey{key, WatchOperation::ALL};
-        auto allIt = watchIndex.find(allKey);
-        if (allIt != watchIndex.end()) {
-            clientsToNotify.insert(allIt->second.begin(), allIt->second.end());
+        // Check ALL operation watchers, skipping the ones already notified for the specific operation
+        auto allIt = shard.watchIndex.find(WatchKey{event.key, WatchOperation::ALL});
+        if (allIt != shard.watchIndex.end()) {
+            for (const auto& watcher : allIt->second) {
+                if (wanted(watcher.first, watcher.second) && (!specific || !specific->count(watcher.first))) {
+                    clients.push_back(watcher);
+                }
+            }
         }
     }
     
-    // Queue notifications asynchronously
+    // PREFIX / PATTERN watches: one walk down the trie along the key
+    if (patternCount.load(std::memory_order_relaxed) > 0) {
+        size_t exactMatches = clients.size();
+        {
+            std::lock_guard<std::mutex> lock(patternMutex);
+            patternIndex.match(event.key, [&](const PatternWatch& watch) {
+                if (watch.operation != event.operation && watch.operation != WatchOperation::ALL) return;
+                if (watch.kind == WatchKind::PATTERN && !globMatch(watch.pattern, event.key)) return;
+                if (!wanted(watch.clientSocket, watch.options)) return;
+                clients.push_back({watch.clientSocket, watch.options});
+            });
+        }
+        // a client matching through several watches still gets the event once (with the shortest window,
+        // and with the sequence number if any of the watches asked for it)
+        if (clients.size() > exactMatches) {
+            std::sort(clients.begin(), clients.end(), [](const auto& a, const auto& b) {
+                return a.first != b.first ? a.first < b.first : a.second.coalesceMs < b.second.coalesceMs;
+            });
+            size_t kept = 0;
+            for (size_t i = 0; i < clients.size(); i++) {
+                if (kept > 0 && clients[kept - 1].first == clients[i].first) {
+                    clients[kept - 1].second.sequenced |= clients[i].second.sequenced;
+                } else {
+                    clients[kept++] = clients[i];
+                }
+            }
+            clients.resize(kept);
+        }
+    }
+}
+
+void WatchManager::replay(int clientSocket, const std::vector<std::string>& messages) {
+    if (messages.empty()) {
+        return;
+    }
+    Worker& worker = workerFor(clientSocket);
     {
-        std::lock_guard<std::mutex> lock(queueMutex);
-        for (int clientSocket : clientsToNotify) {
-            notificationQueue.push({clientSocket, notificationMsg});
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        for (const auto& message : messages) {
+            worker.queue.push({clientSocket, std::make_shared<const std::string>(message)});
+        }
+        worker.queuedPerClient[clientSocket] += messages.size();
+    }
+    worker.cv.notify_one();
+}
+
+// Bounded per client: a client that does not read its socket can't grow the queue without limit,
+// once maxQueuedPerClient notifications are waiting for it new ones are dropped (and counted).
+void WatchManager::enqueueLocked(Worker& worker, int clientSocket, const std::shared_ptr<const std::string>& message) {
+    size_t& queued = worker.queuedPerClient[clientSocket];
+    if (queued >= maxQueuedPerClient) {
+        droppedCount.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    queued++;
+    worker.queue.push({clientSocket, message});
+}
+
+// The first event of a key opens a window and is delivered right away. Events inside the window only
+// replace the pending message, when the window closes the latest one is delivered and a new window opens.
+// A hot key therefore costs at most one queued notification per window and client.
+void WatchManager::coalesceLocked(Worker& worker, int clientSocket, const std::string& key,
+                                  const std::shared_ptr<const std::string>& message, uint32_t windowMs) {
+    CoalesceKey coalesceKey{clientSocket, key};
+    auto it = worker.windows.find(coalesceKey);
+    if (it != worker.windows.end()) {
+        if (it->second.latest) {
+            coalescedCount.fetch_add(1, std::memory_order_relaxed);
+        }
+        it->second.latest = message;
+        return;
+    }
+    enqueueLocked(worker, clientSocket, message);
+    Clock::time_point windowEnd = Clock::now() + std::chrono::milliseconds(windowMs);
+    worker.windows.emplace(coalesceKey, CoalesceSlot{nullptr, windowEnd, windowMs});
+    worker.timers.push(WindowTimer{windowEnd, coalesceKey});
+}
+
+void WatchManager::fireTimersLocked(Worker& worker) {
+    Clock::time_point now = Clock::now();
+    while (!worker.timers.empty() && worker.timers.top().due <= now) {
+        WindowTimer timer = worker.timers.top();
+        worker.timers.pop();
+        auto it = worker.windows.find(timer.key);
+        if (it == worker.windows.end() || it->second.windowEnd != timer.due) {
+            continue;               // window was dropped (client gone) or belongs to an older timer
+        }
+        if (!it->second.latest) {
+            worker.windows.erase(it);   // quiet window, the next event is delivered immediately again
+            continue;
+        }
+        enqueueLocked(worker, timer.key.clientSocket, it->second.latest);
+        it->second.latest = nullptr;
+        it->second.windowEnd = now + std::chrono::milliseconds(it->second.windowMs);
+        worker.timers.push(WindowTimer{it->second.windowEnd, timer.key});
+    }
+}
+
+// Write several notifications for one client with a single sendmsg, the iovecs point straight at the
+// shared payloads. The worker never waits for a client: when its socket is full the rest of a message cut in
+// the middle is kept and finished on a later pass, the notifications after it are dropped (and counted).
+void WatchManager::deliver(Worker& worker, int clientSocket, const Notification* first, size_t count) {
+    if (!flushUnsent(worker, clientSocket)) {
+        droppedCount.fetch_add(count, std::memory_order_relaxed);
+        return;
+    }
+    std::vector<struct iovec> iov(count);
+    for (size_t i = 0; i < count; i++) {
+        iov[i].iov_base = const_cast<char*>(first[i].message->data());
+        iov[i].iov_len = first[i].message->size();
+    }
+
+    size_t done = 0;            // iovecs completely written
+    while (done < count) {
+        struct msghdr msg {};
+        msg.msg_iov = iov.data() + done;
+        msg.msg_iovlen = std::min<size_t>(count - done, IOV_MAX);
+        ssize_t sent = sendmsg(clientSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (iov[done].iov_base != first[done].message->data()) {
+                    // half a message on the wire, the client's stream only stays parseable if it is finished
+                    worker.unsent[clientSocket].assign(static_cast<const char*>(iov[done].iov_base), iov[done].iov_len);
+                    done++;
+                    sentCount.fetch_add(1, std::memory_order_relaxed);
+                }
+                droppedCount.fetch_add(count - done, std::memory_order_relaxed);
+            } else {
+                failedCount.fetch_add(count - done, std::memory_order_relaxed);
+            }
+            return;
+        }
+        while (done < count && (size_t)sent >= iov[done].iov_len) {
+            sent -= iov[done].iov_len;
+            done++;
+            sentCount.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (done < count) {
+            iov[done].iov_base = static_cast<char*>(iov[done].iov_base) + sent;
+            iov[done].iov_len -= sent;
         }
     }
-    
-    // Signal notification thread
-    queueCV.notify_one();
 }
 
-// Asynchronous notification delivery thread
-void WatchManager::notificationLoop() {
+// Try to finish the message a full socket cut in the middle, true when nothing is left over for the client
+bool WatchManager::flushUnsent(Worker& worker, int clientSocket) {
+    auto it = worker.unsent.find(clientSocket);
+    if (it == worker.unsent.end()) {
+        return true;
+    }
+    std::string& rest = it->second;
+    while (!rest.empty()) {
+        ssize_t sent = send(clientSocket, rest.data(), rest.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
+            break;                  // client went away, the next write reports it
+        }
+        rest.erase(0, sent);
+    }
+    worker.unsent.erase(it);
+    return true;
+}
+
+// Asynchronous notification thread, one per worker: matches the new events, then delivers
+void WatchManager::notificationLoop(Worker& worker) {
+    // how often a client with a cut message is retried, the worker has no other way to learn it became writable
+    constexpr auto unsentRetry = std::chrono::milliseconds(10);
+    std::vector<std::shared_ptr<const Event>> events;
+    std::vector<int> disconnected;
+    std::vector<std::pair<int, WatchOptions>> clients;
+    struct Target {
+        int clientSocket;
+        uint32_t coalesceMs;
+        const std::string* key;
+        std::shared_ptr<const std::string> message;
+    };
+    std::vector<Target> targets;
+    std::vector<Notification> batch;
+    std::vector<int> retry;
     while (running) {
-        std::vector<Notification> batch;
+        events.clear();
+        disconnected.clear();
+        targets.clear();
+        batch.clear();
         
-        // Wait for notifications and batch them
+        // Wait for events or notifications
         {
-            std::unique_lock<std::mutex> lock(queueMutex);
-            queueCV.wait(lock, [this] { 
-                return !notificationQueue.empty() || !running; 
-            });
-            
-            if (!running && notificationQueue.empty()) {
+            std::unique_lock<std::mutex> lock(worker.mutex);
+            auto ready = [this, &worker] { 
+                return !worker.events.empty() || !worker.queue.empty() || !running; 
+            };
+            if (worker.timers.empty() && worker.unsent.empty()) {
+                worker.cv.wait(lock, ready);
+            } else {
+                // wake up for the next closing coalescing window or to retry a cut message as well
+                Clock::time_point due = Clock::time_point::max();
+                if (!worker.timers.empty()) due = worker.timers.top().due;
+                if (!worker.unsent.empty()) due = std::min(due, Clock::now() + unsentRetry);
+                worker.cv.wait_until(lock, due, ready);
+            }
+            if (!running && worker.events.empty() && worker.queue.empty()) {
                 break;
             }
+            events.swap(worker.events);
+            disconnected.swap(worker.disconnected);
+        }
+        for (int clientSocket : disconnected) {
+            worker.unsent.erase(clientSocket);
+        }
+        
+        // Match and format outside of the worker lock, notifyEvent keeps pushing meanwhile. The message is
+        // only built once somebody is watching, and shared by this worker's clients (two variants when
+        // some of them want sequence numbers).
+        for (const auto& event : events) {
+            match(worker, *event, clients);
+            std::shared_ptr<const std::string> payload, sequencedPayload;
+            for (const auto& target : clients) {
+                bool sequenced = target.second.sequenced && event->sequence > 0;
+                auto& message = sequenced ? sequencedPayload : payload;
+                if (!message) {
+                    message = std::make_shared<const std::string>(
+                        notificationText(sequenced ? event->sequence : 0, event->operation, event->key, event->value));
+                }
+                targets.push_back({target.first, target.second.coalesceMs, &event->key, message});
+            }
+        }
+        
+        {
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            fireTimersLocked(worker);
+            for (const auto& target : targets) {
+                if (target.coalesceMs > 0) {
+                    coalesceLocked(worker, target.clientSocket, *target.key, target.message, target.coalesceMs);
+                } else {
+                    enqueueLocked(worker, target.clientSocket, target.message);
+                }
+            }
             
             // Process notifications in batches for efficiency
-            while (!notificationQueue.empty() && batch.size() < 100) { // Batch size limit
-                batch.push_back(notificationQueue.front());
-                notificationQueue.pop();
+            while (!worker.queue.empty() && batch.size() < 256) { // Batch size limit
+                Notification& next = worker.queue.front();
+                auto queued = worker.queuedPerClient.find(next.clientSocket);
+                if (queued != worker.queuedPerClient.end() && --queued->second == 0) {
+                    worker.queuedPerClient.erase(queued);
+                }
+                batch.push_back(std::move(next));
+                worker.queue.pop();
             }
         }
         
-        // Send notifications (outside of lock)
-        for (const auto& notification : batch) {
-            if (notification.clientSocket > 0) {
-                // Try to send, ignore errors (client might have disconnected)
-                send(notification.clientSocket, notification.message.c_str(), 
-                     notification.message.length(), MSG_NOSIGNAL);
+        // Send notifications (outside of lock). Grouping by client (stable, so each client's
+        // notifications keep their order) lets one vectored write carry all of a client's messages.
+        std::stable_sort(batch.begin(), batch.end(), [](const Notification& a, const Notification& b) {
+            return a.clientSocket < b.clientSocket;
+        });
+        for (size_t i = 0; i < batch.size();) {
+            size_t j = i;
+            while (j < batch.size() && batch[j].clientSocket == batch[i].clientSocket) {
+                j++;
+            }
+            if (batch[i].clientSocket > 0) {
+                deliver(worker, batch[i].clientSocket, &batch[i], j - i);
             }
+            i = j;
+        }
+        
+        // clients that had nothing new in this batch but still owe the rest of a message
+        retry.clear();
+        for (const auto& entry : worker.unsent) {
+            retry.push_back(entry.first);
+        }
+        for (int clientSocket : retry) {
+            flushUnsent(worker, clientSocket);
         }
     }
 }
@@ -0,0 +1,108 @@
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string>
+#include <vector>
+#include "../include/change_feed.hpp"
+
+/* ChangeFeed tests. The subscriber is one end of a non-blocking socketpair (like the
+server's client sockets), the test reads the frames from the other end.*/
+
+class ChangeFeedTest : public ::testing::Test {
+protected:
+    kvdb::ChangeLog log{8};
+    kvdb::ChangeFeed feed{log, 4};
+    int serverEnd, clientEnd;
+    std::vector<bool> interest;         // every writeInterest call
+
+    void SetUp() override {
+        int fds[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        serverEnd = fds[0];
+        clientEnd = fds[1];
+        fcntl(serverEnd, F_SETFL, fcntl(serverEnd, F_GETFL, 0) | O_NONBLOCK);
+        feed.setWriteInterest([this](int, bool wantWrite) { interest.push_back(wantWrite); });
+    }
+
+    void TearDown() override {
+        close(serverEnd);
+        close(clientEnd);
+    }
+
+    std::string readAll(int timeoutMs = 50) {
+        std::string out;
+        char buffer[65536];
+        struct pollfd pfd {clientEnd, POLLIN, 0};
+        while (poll(&pfd, 1, timeoutMs) > 0) {
+            ssize_t n = recv(clientEnd, buffer, sizeof(buffer), 0);
+            if (n <= 0) break;
+            out.append(buffer, n);
+        }
+        return out;
+    }
+};
+
+TEST_F(ChangeFeedTest, StreamsBatchedFrames) {
+    log.append(kvdb::ChangeType::SET, "a", "1");
+    ASSERT_TRUE(feed.subscribe(serverEnd, 0));
+    log.append(kvdb::ChangeType::DEL, "a", "");
+    log.append(kvdb::ChangeType::SNAPSHOT, "0", "");
+    feed.flushAll();
+    EXPECT_EQ(readAll(), "CHANGES 3 3\n1 SET a 1\n2 DEL a\n3 SNAPSHOT 0\n");
+
+    // at most maxBatch changes per frame
+    for (int i = 0; i < 5; i++) {
+        log.append(kvdb::ChangeType::EDIT, "k", std::to_string(i));
+    }
+    feed.flushAll();
+    EXPECT_EQ(readAll(), "CHANGES 4 7\n4 EDIT k 0\n5 EDIT k 1\n6 EDIT k 2\n7 EDIT k 3\n"
+                         "CHANGES 1 8\n8 EDIT k 4\n");
+    EXPECT_EQ(feed.framesSent(), 3u);
+}
+
+TEST_F(ChangeFeedTest, SubscribeOutsideLogFails) {
+    for (int i = 0; i < 10; i++) {
+        log.append(kvdb::ChangeType::SET, "k" + std::to_string(i), "v");
+    }
+    EXPECT_FALSE(feed.subscribe(serverEnd, 0));      // 1 and 2 are gone
+    EXPECT_FALSE(feed.subscribe(serverEnd, 11));
+    EXPECT_TRUE(feed.subscribe(serverEnd, 10));
+    feed.flushAll();
+    EXPECT_EQ(readAll(), "");
+}
+
+TEST_F(ChangeFeedTest, SlowSubscriberWaitsForWritableThenOverruns) {
+    int small = 4096;
+    setsockopt(serverEnd, SOL_SOCKET, SO_SNDBUF, &small, sizeof(small));
+    ASSERT_TRUE(feed.subscribe(serverEnd, 0));
+    log.append(kvdb::ChangeType::SET, "big", std::string(1 << 20, 'x'));
+    feed.flushAll();
+    ASSERT_EQ(interest, std::vector<bool>{true});      // socket full, asked for EPOLLOUT
+
+    // the log moves on past the subscriber's cursor while it isn't reading
+    for (int i = 0; i < 10; i++) {
+        log.append(kvdb::ChangeType::SET, "k" + std::to_string(i), "v");
+    }
+    std::string received;
+    while (feed.subscriberCount() > 0) {
+        received += readAll(10);
+        feed.flush(serverEnd);
+    }
+    received += readAll();
+    EXPECT_EQ(received.compare(0, 21, "CHANGES 1 1\n1 SET big"), 0);
+    EXPECT_NE(received.find("ERROR Change feed overrun, sequence 1 is no longer retained\n"), std::string::npos);
+    EXPECT_EQ(feed.overruns(), 1u);
+    EXPECT_FALSE(interest.back());
+}
+
+TEST_F(ChangeFeedTest, RepliesGoBetweenFrames) {
+    ASSERT_TRUE(feed.subscribe(serverEnd, 0));
+    log.append(kvdb::ChangeType::SET, "a", "1");
+    feed.flushAll();
+    feed.reply(serverEnd, "OK\n");
+    EXPECT_TRUE(feed.unsubscribe(serverEnd));
+    EXPECT_EQ(readAll(), "CHANGES 1 1\n1 SET a 1\nOK\n");
+    EXPECT_FALSE(feed.isSubscribed(serverEnd));
+}
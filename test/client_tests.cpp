@@ -0,0 +1,122 @@
+#include <gtest/gtest.h>
+#include <chrono>
+#include <condition_variable>
+#include "../include/kvdb_client.hpp"
+
+/* Tests for the client library. Like server_tests these need a server
+instance running on 127.0.0.1:8080 (started separately), they only use
+keys prefixed with "client_" so they don't clash with server_tests.*/
+
+class ClientTest : public ::testing::Test {
+protected:
+    kvdb::Client client{"127.0.0.1", 8080, 2};
+};
+
+TEST_F(ClientTest, Connected) {
+    EXPECT_TRUE(client.isConnected());
+}
+
+TEST_F(ClientTest, SetGetPipelined) {
+    auto set1 = client.set("client_a", "alpha");
+    auto set2 = client.set("client_b", "beta");
+    EXPECT_TRUE(set1.get());
+    EXPECT_TRUE(set2.get());
+
+    auto get1 = client.get("client_a");
+    auto get2 = client.get("client_b");
+    auto missing = client.get("client_missing");
+    EXPECT_EQ(get1.get(), std::optional<std::string>("alpha"));
+    EXPECT_EQ(get2.get(), std::optional<std::string>("beta"));
+    EXPECT_EQ(missing.get(), std::nullopt);
+}
+
+TEST_F(ClientTest, Callback) {
+    std::promise<std::string> reply;
+    client.command("GET client_a", [&reply](const std::string& line) { reply.set_value(line); });
+    EXPECT_EQ(reply.get_future().get(), "OK alpha");
+}
+
+TEST_F(ClientTest, Batch) {
+    std::vector<std::pair<std::string, std::string>> items;
+    std::vector<std::string> keys;
+    for (int i = 0; i < 200; i++) {
+        items.push_back({"client_batch" + std::to_string(i), "v" + std::to_string(i)});
+        keys.push_back("client_batch" + std::to_string(i));
+    }
+    keys.push_back("client_batch_missing");
+
+    std::vector<bool> written = client.mset(items).get();
+    ASSERT_EQ(written.size(), items.size());
+    for (bool ok : written) {
+        EXPECT_TRUE(ok);
+    }
+
+    auto values = client.mget(keys).get();
+    ASSERT_EQ(values.size(), keys.size());
+    for (int i = 0; i < 200; i++) {
+        EXPECT_EQ(values[i], std::optional<std::string>("v" + std::to_string(i)));
+    }
+    EXPECT_EQ(values.back(), std::nullopt);
+}
+
+TEST_F(ClientTest, NotificationsAreSeparatedFromReplies) {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::string> received;
+    client.onNotification([&](const std::string& message) {
+        std::lock_guard<std::mutex> lock(mutex);
+        received.push_back(message);
+        cv.notify_all();
+    });
+
+    ASSERT_TRUE(client.watch("client_watched").get());
+    EXPECT_TRUE(client.set("client_watched", "one").get());
+    EXPECT_EQ(client.get("client_watched").get(), std::optional<std::string>("one"));
+
+    std::unique_lock<std::mutex> lock(mutex);
+    ASSERT_TRUE(cv.wait_for(lock, std::chrono::seconds(2), [&] { return !received.empty(); }));
+    EXPECT_EQ(received[0], "SET client_watched one");
+}
+
+TEST(ClientScan, ScanAtKeepsTheConnectionAligned) {
+    kvdb::Client single{"127.0.0.1", 8080, 1};      // one connection, SCANAT and GET share it
+    ASSERT_TRUE(single.set("client_scan_a", "one").get());
+    ASSERT_TRUE(single.set("client_scan_b", "two words").get());
+    ASSERT_TRUE(single.set("client_other", "x").get());
+
+    auto later = std::chrono::system_clock::now() + std::chrono::minutes(1);
+    std::string time = std::to_string(
+        std::chrono::duration_cast<std::chrono::milliseconds>(later.time_since_epoch()).count());
+    auto scan = single.scanAt(time, "client_scan_");
+    auto get = single.get("client_other");
+    auto entries = scan.get();
+    ASSERT_TRUE(entries.has_value());
+    ASSERT_EQ(entries->size(), 2u);
+    EXPECT_EQ((*entries)[0], (std::pair<std::string, std::string>("client_scan_a", "one")));
+    EXPECT_EQ((*entries)[1], (std::pair<std::string, std::string>("client_scan_b", "two words")));
+    EXPECT_EQ(get.get(), std::optional<std::string>("x"));
+
+    // the raw command gets the whole reply as well
+    auto raw = single.command("SCANAT " + time + " client_scan_a");
+    EXPECT_EQ(raw.get(), "OK 1\nclient_scan_a one");
+    EXPECT_EQ(single.get("client_scan_b").get(), std::optional<std::string>("two words"));
+}
+
+TEST(ClientConnection, EveryCommandCompletesWhenTheConnectionCloses) {
+    // commands sent while the connection goes away get a reply or "ERROR Connection closed", none hangs
+    kvdb::Connection conn("127.0.0.1", 8080);
+    ASSERT_TRUE(conn.isConnected());
+    std::vector<std::future<std::string>> replies;
+    std::thread sender([&] {
+        for (int i = 0; i < 5000; i++) {
+            replies.push_back(conn.send("GET client_a"));
+        }
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    conn.close();
+    sender.join();
+    for (auto& reply : replies) {
+        ASSERT_EQ(reply.wait_for(std::chrono::seconds(2)), std::future_status::ready);
+    }
+    EXPECT_EQ(conn.send("GET client_a").get(), "ERROR Connection closed");
+}
@@ -0,0 +1,99 @@
+#include <gtest/gtest.h>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../include/kvdb_client.hpp"
+
+/* Replication end to end: starts a leader and a follower (--replica-of) as two kvdb processes from the build
+directory, on their own ports so they don't clash with the server the other tests use.*/
+
+static const int LEADER_PORT = 18121;
+static const int REPLICA_PORT = 18122;
+
+static pid_t spawnServer(int port, const std::string& leader = "") {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        std::string portText = std::to_string(port);
+        if (leader.empty()) {
+            execl(KVDB_SERVER_PATH, KVDB_SERVER_PATH, "127.0.0.1", portText.c_str(), (char*)nullptr);
+        } else {
+            execl(KVDB_SERVER_PATH, KVDB_SERVER_PATH, "127.0.0.1", portText.c_str(), "--replica-of", leader.c_str(),
+                  (char*)nullptr);
+        }
+        _exit(127);
+    }
+    return pid;
+}
+
+static std::unique_ptr<kvdb::Client> connectTo(int port) {
+    for (int i = 0; i < 100; i++) {
+        auto client = std::make_unique<kvdb::Client>("127.0.0.1", port, 1);
+        if (client->isConnected()) {
+            return client;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    return nullptr;
+}
+
+// the follower applies changes asynchronously, poll until the key has the expected value (or time runs out)
+static std::optional<std::string> waitForValue(kvdb::Client& client, const std::string& key,
+                                               const std::optional<std::string>& expected) {
+    std::optional<std::string> value;
+    for (int i = 0; i < 100; i++) {
+        value = client.get(key).get();
+        if (value == expected) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    return value;
+}
+
+class ReplicationTest : public ::testing::Test {
+protected:
+    pid_t leaderPid = -1, replicaPid = -1;
+
+    void SetUp() override {
+        leaderPid = spawnServer(LEADER_PORT);
+        replicaPid = spawnServer(REPLICA_PORT, "127.0.0.1:" + std::to_string(LEADER_PORT));
+    }
+
+    void TearDown() override {
+        for (pid_t pid : {replicaPid, leaderPid}) {
+            if (pid > 0) {
+                kill(pid, SIGTERM);
+                waitpid(pid, nullptr, 0);
+            }
+        }
+    }
+};
+
+TEST_F(ReplicationTest, FollowerServesTheLeadersWritesAndRejectsItsOwn) {
+    auto leader = connectTo(LEADER_PORT);
+    auto replica = connectTo(REPLICA_PORT);
+    ASSERT_TRUE(leader && replica);
+
+    // written before and after the follower synced: the image and the change feed both arrive
+    ASSERT_TRUE(leader->set("repl_a", "one").get());
+    EXPECT_EQ(waitForValue(*replica, "repl_a", std::string("one")), std::optional<std::string>("one"));
+    ASSERT_TRUE(leader->set("repl_b", "two").get());
+    ASSERT_TRUE(leader->edit("repl_a", "changed").get());
+    EXPECT_EQ(waitForValue(*replica, "repl_a", std::string("changed")), std::optional<std::string>("changed"));
+    EXPECT_EQ(replica->get("repl_b").get(), std::optional<std::string>("two"));
+    ASSERT_TRUE(leader->del("repl_b").get());
+    EXPECT_EQ(waitForValue(*replica, "repl_b", std::nullopt), std::nullopt);
+
+    EXPECT_FALSE(replica->set("repl_c", "local").get());
+    EXPECT_EQ(replica->command("DEL repl_a").get(),
+              "ERROR Read-only replica of 127.0.0.1:" + std::to_string(LEADER_PORT));
+    EXPECT_EQ(replica->get("repl_a").get(), std::optional<std::string>("changed"));
+    EXPECT_EQ(leader->get("repl_c").get(), std::nullopt);
+}
@@ -1,6 +1,9 @@
 #include <iostream>
 #include <string>
 #include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <thread>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -44,16 +47,23 @@ protected:
     }
 
     void sendCommand (const std::string& command) {
-        ssize_t bytesSent = send(clientSocket, command.c_str(), command.length(), 0);
+        std::string line = command + "\n";   // the server reads one command per line
+        ssize_t bytesSent = send(clientSocket, line.c_str(), line.length(), 0);
         
     }
 
+    // reads until the data ends with a complete line (a long reply, e.g. STATS, takes several recv calls)
     std::string receiveResponse() {
+        std::string received;
         char buffer[1024];
-        ssize_t bytesRead = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
-        // std::cout << "Received response: [" << buffer << "]" << std::endl;
-        buffer[bytesRead] = '\0';
-        return std::string(buffer);
+        do {
+            ssize_t bytesRead = recv(clientSocket, buffer, sizeof(buffer), 0);
+            if (bytesRead <= 0) {
+                break;
+            }
+            received.append(buffer, bytesRead);
+        } while (received.back() != '\n');
+        return received;
     }
 };
 
@@ -130,4 +140,163 @@ TEST_F(ServerTest, TestDeleteAndCheckRollbackValues){
     EXPECT_EQ(response13, "ERROR Key not found\n");
 }
 
+TEST_F(ServerTest, TestMget){
+    sendCommand("SET mget1 one");
+    EXPECT_EQ(receiveResponse(), "OK\n");
+    sendCommand("SET mget2 two");
+    EXPECT_EQ(receiveResponse(), "OK\n");
+    sendCommand("MGET mget2 none mget1");
+    std::string received;
+    for (int i = 0; i < 10 && std::count(received.begin(), received.end(), '\n') < 3; i++) {
+        received += receiveResponse();
+    }
+    EXPECT_EQ(received, "OK two\nERROR Key not found\nOK one\n");
+}
+
+TEST_F(ServerTest, TestGetAtTimestamp){
+    sendCommand("SET asof1 before");
+    EXPECT_EQ(receiveResponse(), "OK\n");
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    long long then = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    sendCommand("EDIT asof1 after");
+    EXPECT_EQ(receiveResponse(), "OK\n");
+    sendCommand("SET asof2 later");
+    EXPECT_EQ(receiveResponse(), "OK\n");
+
+    sendCommand("GETAT " + std::to_string(then) + " asof1");
+    EXPECT_EQ(receiveResponse(), "OK before\n");
+    sendCommand("GETAT " + std::to_string(then) + " asof2");
+    EXPECT_EQ(receiveResponse(), "ERROR Key not found at " + std::to_string(then) + "\n");
+    sendCommand("SCANAT " + std::to_string(then) + " asof");
+    std::string received;
+    for (int i = 0; i < 10 && std::count(received.begin(), received.end(), '\n') < 2; i++) {
+        received += receiveResponse();
+    }
+    EXPECT_EQ(received, "OK 1\nasof1 before\n");
+    sendCommand("GETAT 1 asof1");
+    EXPECT_EQ(receiveResponse().rfind("ERROR No version at 1", 0), 0u);
+}
+
+TEST_F(ServerTest, TestBranches){
+    sendCommand("SET branch1 base");
+    EXPECT_EQ(receiveResponse(), "OK\n");
+    sendCommand("BRANCH experiment");
+    EXPECT_EQ(receiveResponse(), "OK Branch experiment from main\n");
+    sendCommand("CHECKOUT experiment");
+    EXPECT_EQ(receiveResponse(), "OK Checked out experiment\n");
+    sendCommand("EDIT branch1 forked");
+    EXPECT_EQ(receiveResponse(), "OK\n");
+    sendCommand("SNAPSHOT");
+    EXPECT_EQ(receiveResponse(), "OK Snapshot created, version 0\n");
+    sendCommand("DEL branch1");
+    EXPECT_EQ(receiveResponse(), "OK\n");
+    sendCommand("VGET 0 branch1");
+    EXPECT_EQ(receiveResponse(), "OK forked\n");
+
+    // the main store and other connections don't see the branch's writes
+    sendCommand("CHECKOUT main");
+    EXPECT_EQ(receiveResponse(), "OK Checked out main\n");
+    sendCommand("GET branch1");
+    EXPECT_EQ(receiveResponse(), "OK base\n");
+    sendCommand("CHECKOUT nonexistent");
+    EXPECT_EQ(receiveResponse(), "ERROR No branch nonexistent\n");
+    sendCommand("DELBRANCH experiment");
+    EXPECT_EQ(receiveResponse(), "OK Deleted branch experiment\n");
+}
+
+TEST_F(ServerTest, TestMultiExec){
+    sendCommand("SET txn1 1");
+    EXPECT_EQ(receiveResponse(), "OK\n");
+    sendCommand("SEQ");
+    std::string sequence = receiveResponse().substr(3);
+    sequence.pop_back();
+
+    sendCommand("MULTI");
+    EXPECT_EQ(receiveResponse().rfind("OK Transaction from sequence ", 0), 0u);
+    sendCommand("CAS txn1 1 2");
+    EXPECT_EQ(receiveResponse(), "QUEUED\n");
+    sendCommand("SET txn2 new");
+    EXPECT_EQ(receiveResponse(), "QUEUED\n");
+    sendCommand("EXEC");
+    EXPECT_EQ(receiveResponse().rfind("OK Executed 2 commands, sequence ", 0), 0u);
+
+    // one failing write and nothing is applied
+    sendCommand("MULTI");
+    receiveResponse();
+    sendCommand("DEL txn2");
+    EXPECT_EQ(receiveResponse(), "QUEUED\n");
+    sendCommand("EDIT txn_missing x");
+    EXPECT_EQ(receiveResponse(), "QUEUED\n");
+    sendCommand("EXEC");
+    EXPECT_EQ(receiveResponse(), "ERROR Transaction aborted at command 2 (EDIT txn_missing): Key not found\n");
+    sendCommand("GET txn2");
+    EXPECT_EQ(receiveResponse(), "OK new\n");
 
+    // txn1 was written after the sequence read before the transaction
+    sendCommand("MULTI " + sequence);
+    receiveResponse();
+    sendCommand("EDIT txn1 3");
+    EXPECT_EQ(receiveResponse(), "QUEUED\n");
+    sendCommand("EXEC");
+    EXPECT_EQ(receiveResponse(), "ERROR Conflict: txn1 was written after sequence " + sequence + "\n");
+    sendCommand("GET txn1");
+    EXPECT_EQ(receiveResponse(), "OK 2\n");
+    sendCommand("CAS txn1 1 4");
+    EXPECT_EQ(receiveResponse(), "ERROR Value mismatch\n");
+
+    // transactions are counted on their own, not under OTHER
+    sendCommand("STATS");
+    std::string stats = receiveResponse();
+    EXPECT_NE(stats.find(" exec.count="), std::string::npos);
+    EXPECT_NE(stats.find(" cas.errors="), std::string::npos);
+}
+
+TEST_F(ServerTest, TestStats){
+    // other tests share the server and take snapshots too, only the change made here is checked
+    auto versionsIn = [](const std::string& stats) {
+        size_t at = stats.find(" versions=");
+        return at == std::string::npos ? -1L : std::stol(stats.substr(at + 10));
+    };
+    sendCommand("STATS");
+    std::string response = receiveResponse();
+    EXPECT_EQ(response.rfind("OK connections=", 0), 0u);
+    long before = versionsIn(response);
+    ASSERT_GE(before, 0);
+    sendCommand("SNAPSHOT");
+    receiveResponse();
+    sendCommand("STATS");
+    response = receiveResponse();
+    EXPECT_EQ(versionsIn(response), before + 1);
+    EXPECT_NE(response.find(" get.count="), std::string::npos);
+    EXPECT_NE(response.find(" get.p99_us="), std::string::npos);
+    sendCommand("STATS LIVE");
+    response = receiveResponse();
+    EXPECT_NE(response.find(" live_nodes="), std::string::npos);
+}
+
+TEST_F(ServerTest, TestWatchResumeFromSequence){
+    sendCommand("SET resume1 a");
+    EXPECT_EQ(receiveResponse(), "OK\n");
+    sendCommand("EDIT resume1 b");
+    EXPECT_EQ(receiveResponse(), "OK\n");
+
+    // replayed notifications come from the delivery thread, they may arrive before or after the reply
+    sendCommand("WATCH resume1 ALL FROM 0");
+    std::string received;
+    for (int i = 0; i < 10 && (received.find(" EDIT resume1 b\n") == std::string::npos ||
+                               received.find("OK Watching") == std::string::npos); i++) {
+        received += receiveResponse();
+    }
+    EXPECT_NE(received.find("OK Watching resume1 for ALL operations from 0, replayed 2\n"), std::string::npos);
+    EXPECT_NE(received.find(" SET resume1 a\n"), std::string::npos);
+    EXPECT_LT(received.find(" SET resume1 a\n"), received.find(" EDIT resume1 b\n"));
+
+    sendCommand("WATCH resume1 ALL FROM 99999999");
+    received = "";
+    for (int i = 0; i < 10 && received.find("ERROR") == std::string::npos; i++) {
+        received += receiveResponse();
+    }
+    EXPECT_NE(received.find("ERROR Sequence 99999999 is not in the change log"), std::string::npos);
+}
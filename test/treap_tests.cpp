@@ -1,5 +1,12 @@
 #include <gtest/gtest.h>
 #include "../include/PersistentTreap.hpp"
+#include "../include/snapshot_image.hpp"
+#include "../include/checkpoint.hpp"
+#include "../include/block_codec.hpp"
+#include "../include/read_cache.hpp"
+#include "../include/root_log.hpp"
+#include <sstream>
+#include <fstream>
 
 class TreapTest : public :: testing::Test {
 protected: 
@@ -74,7 +81,359 @@ TEST_F(TreapTest, RollbackTwiceAndEdit){
     EXPECT_EQ(treap.find(69), 69000);
 }
 
+TEST_F(TreapTest, FindPtrBorrowsValue){
+    const int* value = treap.find_ptr(69);
+    ASSERT_NE(value, nullptr);
+    EXPECT_EQ(*value, 690);
+    EXPECT_EQ(value, treap.find_ptr(69));
+    EXPECT_EQ(treap.find_ptr(100), nullptr);
+    EXPECT_TRUE(treap.contains(69));
+    EXPECT_FALSE(treap.contains(100));
+}
+
+TEST_F(TreapTest, RelayoutCopiesTheTreeInBreadthFirstOrder){
+    for(int i = 0; i < 200; i++)  treap.insert(i * 7, i);
+    snapshot(treap);
+    for(int i = 0; i < 200; i += 3)  treap.edit(i * 7, -i);
+    int before = nodes<int, int>.size();
+    int old = treap.root;
+    treap.root = relayout<int, int>(treap.root);
+
+    EXPECT_EQ(treap.root, before);
+    EXPECT_EQ((nodes<int, int>.size()), before + 201);
+    // every child comes after its parent, and the children of one level after the whole level before
+    int lastChild = treap.root;
+    for(int T = treap.root; T < nodes<int, int>.size(); T++){
+        for(int child : {nodes<int, int>[T].p.first, nodes<int, int>[T].p.second}){
+            if(!child)  continue;
+            EXPECT_GT(child, lastChild);
+            lastChild = child;
+        }
+    }
+    for(int i = 0; i < 200; i++){
+        EXPECT_EQ(treap.find(i * 7), i % 3 ? i : -i);
+        // the value slots are shared with the old tree
+        EXPECT_EQ(treap.find_slot(i * 7), (Treap<int, int>(old).find_slot(i * 7)));
+    }
+    EXPECT_EQ((rollback<int, int>(0).find(21)), 3);
+    EXPECT_EQ((relayout<int, int>(0)), 0);
+}
+
+TEST(SnapshotImage, RoundTripKeepsVersions){
+    versions<string, string>.clear();
+    Treap<string, string> store;
+    store.insert("a", "value with spaces");
+    store.insert("b", "2");
+    snapshot(store);
+    store.edit("a", "changed");
+    store.remove("b");
+
+    std::ostringstream os;
+    save_image<string, string>(os, store.root);
+    Treap<string, string> loaded(0);
+    std::istringstream is(os.str());
+    loaded.root = load_image<string, string>(is);
+
+    EXPECT_EQ(loaded.find("a"), "changed");
+    EXPECT_EQ(loaded.find("b"), nullopt);
+    ASSERT_EQ((versions<string, string>.size()), 1u);
+    Treap<string, string> version0 = rollback<string, string>(0);
+    EXPECT_EQ(version0.find("a"), "value with spaces");
+    EXPECT_EQ(version0.find("b"), "2");
+
+    // a broken image throws and leaves the loaded store as it was instead of a half loaded one
+    int nodeCount = nodes<string, string>.size();
+    std::istringstream truncated(os.str().substr(0, os.str().size() / 2));
+    EXPECT_THROW((load_image<string, string>(truncated)), std::runtime_error);
+    EXPECT_EQ((nodes<string, string>.size()), nodeCount);
+    EXPECT_EQ(loaded.find("a"), "changed");
+    EXPECT_EQ((rollback<string, string>(0).find("b")), "2");
+}
+
+TEST(SnapshotImage, ParallelLoadRejectsDamagedBlocks){
+    versions<string, string>.clear();
+    Treap<string, string> store;
+    for(int i = 0; i < 20000; i++){
+        store.insert("key" + std::to_string(i), "value" + std::to_string(i));
+    }
+    snapshot(store);
+    std::ostringstream os;
+    save_image<string, string>(os, store.root);
+    std::string bytes = os.str();
+
+    // many blocks per section, decoded on several threads
+    Treap<string, string> loaded(load_image<string, string>(bytes.data(), bytes.size()));
+    EXPECT_EQ(loaded.find("key12345"), "value12345");
+    EXPECT_EQ((rollback<string, string>(0).find("key19999")), "value19999");
+
+    std::string damaged = bytes;
+    damaged[damaged.size() / 2] ^= 0x5A;
+    try{
+        load_image<string, string>(damaged.data(), damaged.size());
+        FAIL() << "damaged image was accepted";
+    }catch(const std::runtime_error &e){
+        EXPECT_NE(std::string(e.what()).find("checksum mismatch in image"), std::string::npos) << e.what();
+    }
+    EXPECT_EQ(loaded.find("key12345"), "value12345");
+    EXPECT_THROW((load_image<string, string>(bytes.data(), bytes.size() - 3)), std::runtime_error);
+    EXPECT_THROW((load_image<string, string>("KVDBIMG1", 8)), std::runtime_error);
+}
+
+TEST(BlockCodec, RoundTripAndRejectsGarbage){
+    std::string text;
+    for(int i = 0; i < 2000; i++)  text += "{\"status\":\"active\",\"id\":" + std::to_string(i % 37) + "}";
+    std::string packed, unpacked;
+    codec::compress(text.data(), text.size(), packed);
+    EXPECT_LT(packed.size() * 4, text.size());
+    ASSERT_TRUE(codec::decompress(packed.data(), packed.size(), unpacked, text.size()));
+    EXPECT_EQ(unpacked, text);
+
+    std::string tiny = "abc";
+    packed.clear();
+    codec::compress(tiny.data(), tiny.size(), packed);
+    ASSERT_TRUE(codec::decompress(packed.data(), packed.size(), unpacked, tiny.size()));
+    EXPECT_EQ(unpacked, tiny);
+    EXPECT_FALSE(codec::decompress("\x0F\x01\x00", 3, unpacked, 40));
+}
+
+TEST(SnapshotImage, ReaderDecompressesOnlyThePath){
+    std::string file = (std::filesystem::temp_directory_path() / "kvdb_image_reader_test.img").string();
+    versions<string, string>.clear();
+    Treap<string, string> store;
+    for(int i = 0; i < 50000; i++){
+        store.insert("key" + std::to_string(i), "value" + std::to_string(i));
+    }
+    snapshot(store);
+    store.edit("key42", "changed");
+    {
+        std::ofstream os(file, std::ios::binary);
+        save_image<string, string>(os, store.root);
+    }
+
+    image::ImageReader<string, string> reader(file);
+    EXPECT_EQ(reader.find(reader.root(), "key42"), "changed");
+    EXPECT_EQ(reader.find(reader.versionRoot(0), "key42"), "value42");
+    EXPECT_EQ(reader.find(reader.root(), "missing"), nullopt);
+    EXPECT_LT(reader.blocksDecoded(), 30u);     // of ~30 node + value blocks
+    EXPECT_THROW(reader.versionRoot(1), std::runtime_error);
+    std::filesystem::remove(file);
+}
+
+TEST(Values, DedupSharesSlotsButLoadersKeepFileSlots){
+    versions<string, string>.clear();
+    nodes<string, string>.clear();
+    nodes<string, string>.add(Node<string, string>());
+    values<string>.clear();
+    values<string>.enableDedup(true);
+    Treap<string, string> store;
+    for(int i = 0; i < 100; i++){
+        store.insert("key" + std::to_string(i), i % 2 ? "active" : "inactive");
+    }
+    EXPECT_EQ(values<string>.size(), 2);
+    EXPECT_EQ(values<string>.deduplicated(), 98u);
+    EXPECT_EQ(values<string>.references(store.find_ptr("key1") - &values<string>[0]), 50u);
+    store.edit("key1", "inactive");
+    EXPECT_EQ(store.find("key1"), "inactive");
+    EXPECT_EQ(values<string>.size(), 2);
+
+    // loaders append: slot numbers are those of the file even when it holds duplicates
+    values<string>.clear();
+    EXPECT_EQ(values<string>.append("x"), 0);
+    EXPECT_EQ(values<string>.append("x"), 1);
+    EXPECT_EQ(values<string>.add("x"), 0);
+    values<string>.enableDedup(false);
+}
+
+TEST(Values, LargeValuesSpillToTheValueLog){
+    std::string log = (std::filesystem::temp_directory_path() / "kvdb_value_log_test.log").string();
+    Values<string> spilling;
+    spilling.enableSpill(log, 100, 250);
+    std::string large(150, 'x'), other(150, 'y');
+    int small = spilling.add("small");
+    int first = spilling.add(large);
+    int second = spilling.add(other);
+    EXPECT_EQ(spilling.spilledCount(), 2u);
+    EXPECT_EQ(spilling.spilledByteSize(), 300u);
+    EXPECT_EQ(spilling.byteSize(), 305u);
+
+    EXPECT_EQ(spilling[small], "small");
+    EXPECT_EQ(spilling[first], large);
+    EXPECT_EQ(spilling[first], large);
+    EXPECT_EQ(spilling[second], other);     // evicts the first one, the cache holds 250 bytes
+    EXPECT_EQ(spilling[first], large);
+    EXPECT_EQ(spilling.spillCacheHits(), 1u);
+    EXPECT_EQ(spilling.spillCacheMisses(), 3u);
+    spilling.visit(second, [&](const string &value){ EXPECT_EQ(value, other); });
+
+    // a reference stays valid while later reads evict its entry, until releaseReads()
+    const string &held = spilling[second];
+    EXPECT_EQ(spilling[first], large);
+    EXPECT_EQ(held, other);
+    spilling.releaseReads();
 
+    // dedup of spilled values compares against the log
+    spilling.enableDedup(true);
+    EXPECT_EQ(spilling.add(other), second);
+    EXPECT_NE(spilling.add(string(150, 'z')), second);
 
+    // a loaded arena is spilled again
+    spilling.assign({"a", large});
+    EXPECT_EQ(spilling.spilledCount(), 1u);
+    EXPECT_EQ(spilling[1], large);
+    std::filesystem::remove(log);
+}
 
+TEST(VersionFilters, NoFalseNegativesAndSavedWithTheImage){
+    versions<string, string>.clear();
+    Treap<string, string> store;
+    for(int i = 0; i < 2000; i++){
+        store.insert("key" + std::to_string(i), "v");
+    }
+    snapshot(store);
+    auto &filters = versionFilters<string, string>;
+    for(int i = 0; i < 2000; i++){
+        ASSERT_TRUE(filters.mayContain(0, hasher("key" + std::to_string(i))));
+    }
+    int rejected = 0;
+    for(int i = 0; i < 2000; i++){
+        rejected += !filters.mayContain(0, hasher("other" + std::to_string(i)));
+    }
+    EXPECT_GT(rejected, 1900);
+    EXPECT_EQ(filters.builtCount(), 1u);
 
+    std::ostringstream os;
+    save_image<string, string>(os, store.root);
+    std::istringstream is(os.str());
+    load_image<string, string>(is);
+    EXPECT_EQ(filters.builtCount(), 1u);    // came back with the image, no rebuild
+    EXPECT_FALSE(filters.mayContain(0, hasher("other1")) && filters.mayContain(0, hasher("other2")) &&
+                 filters.mayContain(0, hasher("other3")));
+
+    // a new arena generation makes old filters stale
+    nodes<string, string>.clear();
+    nodes<string, string>.add(Node<string, string>());
+    EXPECT_EQ(filters.builtCount(), 0u);
+}
+
+TEST(Checkpoint, DeltasOnlyHoldNewSlotsAndRestore){
+    std::string dir = (std::filesystem::temp_directory_path() / "kvdb_checkpoint_test").string();
+    std::filesystem::remove_all(dir);
+    versions<string, string>.clear();
+    versionFilters<string, string>.clear();
+    Treap<string, string> store;
+    for(int i = 0; i < 200; i++){
+        store.insert("key" + std::to_string(i), "value" + std::to_string(i));
+    }
+    int rootAtBase;
+    {
+        Checkpointer<string, string> checkpointer(dir, 3);
+        auto base = checkpointer.checkpoint(store.root);
+        EXPECT_TRUE(base.base);
+        rootAtBase = store.root;
+
+        snapshot(store);
+        store.edit("key7", "changed");
+        auto delta = checkpointer.checkpoint(store.root);
+        EXPECT_FALSE(delta.base);
+        EXPECT_EQ(delta.values, 1);
+        EXPECT_EQ(delta.versions, 1);
+        EXPECT_LT(delta.bytes * 5, base.bytes);
+
+        // a filter built after its version was checkpointed goes into the next delta
+        versionFilters<string, string>.mayContain(0, 1);
+        store.remove("key8");
+        checkpointer.checkpoint(store.root);
+        EXPECT_EQ(checkpointer.deltaCount(), 2u);
+    }
+
+    // a fresh process: nothing in memory, base + deltas from the manifest
+    Checkpointer<string, string> restored(dir, 3);
+    Treap<string, string> loaded(restored.restore());
+    EXPECT_EQ(loaded.find("key7"), "changed");
+    EXPECT_EQ(loaded.find("key8"), nullopt);
+    EXPECT_EQ(loaded.find("key9"), "value9");
+    ASSERT_EQ((versions<string, string>.size()), 1u);
+    EXPECT_EQ((versions<string, string>[0].root), rootAtBase);
+    EXPECT_EQ((rollback<string, string>(0).find("key7")), "value7");
+    EXPECT_EQ((versionFilters<string, string>.builtCount()), 1u);
+
+    // the third delta triggers the background merge into a new base
+    loaded.insert("new", "1");
+    restored.checkpoint(loaded.root);
+    restored.waitForMerge();
+    EXPECT_EQ(restored.deltaCount(), 0u);
+    Checkpointer<string, string> merged(dir);
+    Treap<string, string> again(merged.restore());
+    EXPECT_EQ(again.find("new"), "1");
+    EXPECT_EQ(again.find("key7"), "changed");
+    EXPECT_EQ((rollback<string, string>(0).find("key7")), "value7");
+    EXPECT_EQ((versionFilters<string, string>.builtCount()), 1u);
+
+    // a chain that fails part way through leaves the arenas alone
+    {
+        std::ofstream manifest(std::filesystem::path(dir) / "MANIFEST", std::ios::app);
+        manifest << "delta delta-999999.img\n";
+    }
+    Checkpointer<string, string> broken(dir);
+    EXPECT_THROW(broken.restore(), std::runtime_error);
+    Checkpointer<string, string> missing(dir + "_missing");
+    EXPECT_THROW(missing.restore(), std::runtime_error);
+    EXPECT_EQ(again.find("new"), "1");
+    EXPECT_EQ((rollback<string, string>(0).find("key7")), "value7");
+    std::filesystem::remove_all(dir);
+}
+
+TEST(ReadCache, WritesAndReloadsInvalidate) {
+    kvdb::ReadCache cache(32);
+    EXPECT_EQ(cache.lookup("a"), -1);
+    cache.insert("a", 7);
+    cache.insert("b", 8);
+    EXPECT_EQ(cache.lookup("a"), 7);
+    cache.forget("a");
+    EXPECT_EQ(cache.lookup("a"), -1);
+    EXPECT_EQ(cache.lookup("b"), 8);
+    cache.invalidateAll();
+    EXPECT_EQ(cache.lookup("b"), -1);
+    cache.insert("b", 9);
+    EXPECT_EQ(cache.lookup("b"), 9);
+    EXPECT_EQ(cache.hitCount(), 3u);
+    EXPECT_EQ(cache.missCount(), 3u);
+
+    for (int i = 0; i < 1000; i++) {
+        cache.insert("k" + std::to_string(i), i);
+    }
+    EXPECT_EQ(cache.size(), 32u);
+
+    // a key read in between survives the following inserts, the least recently used one goes
+    for (int i = 0; i < 40; i++) {
+        EXPECT_EQ(cache.lookup("k999"), 999);
+        cache.insert("n" + std::to_string(i), i);
+    }
+    EXPECT_EQ(cache.lookup("k999"), 999);
+    EXPECT_EQ(cache.lookup("k998"), -1);
+    EXPECT_EQ(cache.lookup("n39"), 39);
+}
+
+TEST(RootLog, FindsTheRootInEffectAtATime) {
+    kvdb::RootLog log(3);
+    log.reset(100, 0);
+    log.record(150, 0);         // same root, not logged
+    log.record(200, 5);
+    log.record(190, 9);         // clock stepped back, kept in order
+    int root = -1;
+    EXPECT_FALSE(log.rootAt(99, root));
+    ASSERT_TRUE(log.rootAt(100, root));
+    EXPECT_EQ(root, 0);
+    ASSERT_TRUE(log.rootAt(199, root));
+    EXPECT_EQ(root, 0);
+    ASSERT_TRUE(log.rootAt(200, root));
+    EXPECT_EQ(root, 9);
+    EXPECT_EQ(log.size(), 3u);
+
+    log.record(300, 12);        // over capacity, the oldest entry goes
+    EXPECT_EQ(log.size(), 3u);
+    EXPECT_EQ(log.firstTime(), 200);
+    EXPECT_FALSE(log.rootAt(150, root));
+    ASSERT_TRUE(log.rootAt(1000, root));
+    EXPECT_EQ(root, 12);
+}
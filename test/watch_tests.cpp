@@ -0,0 +1,261 @@
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <poll.h>
+#include <string>
+#include <cstdint>
+#include "../include/watch_manager.hpp"
+#include "../include/change_log.hpp"
+
+/* WatchManager tests. Each fake client is one end of a socketpair, the test
+reads what the delivery workers wrote on the other end.*/
+
+class WatchTest : public ::testing::Test {
+protected:
+    kvdb::WatchManager manager{4, 2};
+    std::vector<std::pair<int, int>> pairs;
+
+    void SetUp() override {
+        manager.start();
+    }
+
+    void TearDown() override {
+        manager.stop();
+        for (auto& p : pairs) {
+            close(p.first);
+            close(p.second);
+        }
+    }
+
+    // returns the server side fd, the test reads from clientEnd(fd)
+    int newClient() {
+        int fds[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+        pairs.push_back({fds[0], fds[1]});
+        return fds[0];
+    }
+
+    int clientEnd(int serverFd) {
+        for (auto& p : pairs) {
+            if (p.first == serverFd) return p.second;
+        }
+        return -1;
+    }
+
+    // everything delivered to the client within the timeout (or until `expect` bytes arrived)
+    std::string readAll(int serverFd, int timeoutMs = 200, size_t expect = SIZE_MAX) {
+        int fd = clientEnd(serverFd);
+        std::string out;
+        char buffer[4096];
+        struct pollfd pfd {fd, POLLIN, 0};
+        while (out.size() < expect && poll(&pfd, 1, timeoutMs) > 0) {
+            ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n <= 0) break;
+            out.append(buffer, n);
+        }
+        return out;
+    }
+};
+
+TEST_F(WatchTest, NotifiesMatchingOperationOnly) {
+    int setWatcher = newClient();
+    int delWatcher = newClient();
+    manager.addWatch(setWatcher, "k", kvdb::WatchOperation::SET);
+    manager.addWatch(delWatcher, "k", kvdb::WatchOperation::DEL);
+
+    manager.notifyEvent("k", kvdb::WatchOperation::SET, "v");
+    EXPECT_EQ(readAll(setWatcher), "NOTIFICATION SET k v\n");
+    EXPECT_EQ(readAll(delWatcher, 50), "");
+}
+
+TEST_F(WatchTest, AllWatcherNotifiedOnce) {
+    int client = newClient();
+    manager.addWatch(client, "k", kvdb::WatchOperation::ALL);
+    manager.addWatch(client, "k", kvdb::WatchOperation::EDIT);
+
+    manager.notifyEvent("k", kvdb::WatchOperation::EDIT, "v2");
+    manager.notifyEvent("k", kvdb::WatchOperation::DEL, "");
+    EXPECT_EQ(readAll(client), "NOTIFICATION EDIT k v2\nNOTIFICATION DEL k\n");
+}
+
+TEST_F(WatchTest, RemoveWatches) {
+    int client = newClient();
+    manager.addWatch(client, "a", kvdb::WatchOperation::ALL);
+    manager.addWatch(client, "b", kvdb::WatchOperation::ALL);
+    EXPECT_EQ(manager.watchCount(), 2u);
+
+    manager.removeWatch(client, "a", kvdb::WatchOperation::ALL);
+    manager.notifyEvent("a", kvdb::WatchOperation::SET, "x");
+    manager.notifyEvent("b", kvdb::WatchOperation::SET, "y");
+    EXPECT_EQ(readAll(client), "NOTIFICATION SET b y\n");
+
+    manager.removeAllWatches(client);
+    EXPECT_EQ(manager.watchCount(), 0u);
+    manager.notifyEvent("b", kvdb::WatchOperation::SET, "z");
+    EXPECT_EQ(readAll(client, 50), "");
+}
+
+TEST_F(WatchTest, ManyKeysKeepPerClientOrder) {
+    int client = newClient();
+    std::string expected;
+    for (int i = 0; i < 200; i++) {
+        std::string key = "key" + std::to_string(i);
+        manager.addWatch(client, key, kvdb::WatchOperation::SET);
+    }
+    for (int i = 0; i < 200; i++) {
+        std::string key = "key" + std::to_string(i);
+        manager.notifyEvent(key, kvdb::WatchOperation::SET, std::to_string(i));
+        expected += "NOTIFICATION SET " + key + " " + std::to_string(i) + "\n";
+    }
+    EXPECT_EQ(readAll(client), expected);
+    EXPECT_EQ(manager.notificationsSent(), 200u);
+}
+
+TEST_F(WatchTest, BroadcastLargeValue) {
+    std::vector<int> clients;
+    for (int i = 0; i < 50; i++) {
+        clients.push_back(newClient());
+        manager.addWatch(clients.back(), "hot", i % 2 ? kvdb::WatchOperation::ALL : kvdb::WatchOperation::EDIT);
+    }
+    std::string value(4096, 'x');
+    manager.notifyEvent("hot", kvdb::WatchOperation::EDIT, value);
+    std::string expected = "NOTIFICATION EDIT hot " + value + "\n";
+    for (int client : clients) {
+        EXPECT_EQ(readAll(client, 200, expected.size()), expected);
+    }
+    EXPECT_EQ(manager.notificationsSent(), 50u);
+}
+
+TEST_F(WatchTest, PrefixWatch) {
+    int client = newClient();
+    manager.addWatch(client, "user:", kvdb::WatchOperation::ALL, kvdb::WatchKind::PREFIX);
+    manager.addWatch(client, "user:1", kvdb::WatchOperation::ALL);     // also matches, delivered once
+
+    manager.notifyEvent("user:1", kvdb::WatchOperation::SET, "a");
+    manager.notifyEvent("user:2", kvdb::WatchOperation::EDIT, "b");
+    manager.notifyEvent("users", kvdb::WatchOperation::SET, "c");
+    manager.notifyEvent("admin:1", kvdb::WatchOperation::SET, "d");
+    EXPECT_EQ(readAll(client), "NOTIFICATION SET user:1 a\nNOTIFICATION EDIT user:2 b\n");
+
+    manager.removeWatch(client, "user:", kvdb::WatchOperation::ALL, kvdb::WatchKind::PREFIX);
+    manager.notifyEvent("user:2", kvdb::WatchOperation::DEL, "");
+    EXPECT_EQ(readAll(client, 50), "");
+}
+
+TEST_F(WatchTest, PatternWatch) {
+    int client = newClient();
+    manager.addWatch(client, "order:*:status", kvdb::WatchOperation::EDIT, kvdb::WatchKind::PATTERN);
+    manager.addWatch(client, "sku?", kvdb::WatchOperation::ALL, kvdb::WatchKind::PATTERN);
+
+    manager.notifyEvent("order:17:status", kvdb::WatchOperation::EDIT, "shipped");
+    manager.notifyEvent("order:17:total", kvdb::WatchOperation::EDIT, "10");
+    manager.notifyEvent("order:17:status", kvdb::WatchOperation::SET, "new");
+    manager.notifyEvent("sku1", kvdb::WatchOperation::DEL, "");
+    manager.notifyEvent("sku12", kvdb::WatchOperation::DEL, "");
+    EXPECT_EQ(readAll(client), "NOTIFICATION EDIT order:17:status shipped\nNOTIFICATION DEL sku1\n");
+
+    manager.removeAllWatches(client);
+    EXPECT_EQ(manager.watchCount(), 0u);
+    manager.notifyEvent("sku2", kvdb::WatchOperation::SET, "x");
+    EXPECT_EQ(readAll(client, 50), "");
+}
+
+TEST_F(WatchTest, CoalesceDeliversFirstAndLatest) {
+    int client = newClient();
+    kvdb::WatchOptions options;
+    options.coalesceMs = 100;
+    manager.addWatch(client, "hot", kvdb::WatchOperation::ALL, kvdb::WatchKind::KEY, options);
+
+    for (int i = 0; i < 50; i++) {
+        manager.notifyEvent("hot", kvdb::WatchOperation::SET, std::to_string(i));
+    }
+    // first event right away, the last one when the window closes, everything in between is replaced
+    EXPECT_EQ(readAll(client, 500, 40), "NOTIFICATION SET hot 0\nNOTIFICATION SET hot 49\n");
+    EXPECT_EQ(manager.notificationsCoalesced(), 48u);
+}
+
+TEST_F(WatchTest, DropsWhenClientQueueIsFull) {
+    kvdb::WatchManager bounded(1, 1, 3);     // not started, so the events wait unmatched
+    int client = newClient();
+    bounded.addWatch(client, "k", kvdb::WatchOperation::SET);
+    for (int i = 0; i < 5; i++) {
+        bounded.notifyEvent("k", kvdb::WatchOperation::SET, std::to_string(i));
+    }
+    EXPECT_EQ(bounded.queueDepth(), 5u);
+
+    // the worker matches all five before delivering, the client's queue takes three of them
+    bounded.start();
+    EXPECT_EQ(readAll(client, 200, 66), "NOTIFICATION SET k 0\nNOTIFICATION SET k 1\nNOTIFICATION SET k 2\n");
+    EXPECT_EQ(bounded.notificationsDropped(), 2u);
+    bounded.stop();
+}
+
+TEST_F(WatchTest, SequencedWatchAndReplay) {
+    int client = newClient();
+    kvdb::WatchOptions options;
+    options.sequenced = true;
+    manager.addWatch(client, "k", kvdb::WatchOperation::ALL, kvdb::WatchKind::KEY, options);
+    manager.replay(client, {"NOTIFICATION 3 SET k a\n"});
+    manager.notifyEvent("k", kvdb::WatchOperation::DEL, "", 4);
+    EXPECT_EQ(readAll(client, 200, 44), "NOTIFICATION 3 SET k a\nNOTIFICATION 4 DEL k\n");
+}
+
+TEST(ChangeLog, KeepsLatestEntries) {
+    kvdb::ChangeLog log(3);
+    EXPECT_TRUE(log.covers(0));
+    for (int i = 0; i < 5; i++) {
+        EXPECT_EQ(log.append(kvdb::ChangeType::SET, "k" + std::to_string(i), "v"), (uint64_t)i + 1);
+    }
+    EXPECT_EQ(log.firstSequence(), 3u);
+    EXPECT_EQ(log.lastSequence(), 5u);
+    EXPECT_FALSE(log.covers(1));        // change 2 is gone
+    EXPECT_TRUE(log.covers(2));
+    EXPECT_TRUE(log.covers(5));
+    EXPECT_FALSE(log.covers(6));
+
+    std::string keys;
+    log.forEachSince(3, [&](const kvdb::ChangeEntry& change) { keys += change.key; });
+    EXPECT_EQ(keys, "k3k4");
+}
+
+TEST(WatchMatches, KeysPrefixesAndPatterns) {
+    using kvdb::WatchKind;
+    using kvdb::WatchOperation;
+    EXPECT_TRUE(kvdb::watchMatches({"a", WatchOperation::ALL, WatchKind::KEY}, "a", WatchOperation::DEL));
+    EXPECT_FALSE(kvdb::watchMatches({"a", WatchOperation::SET, WatchKind::KEY}, "a", WatchOperation::DEL));
+    EXPECT_TRUE(kvdb::watchMatches({"user:", WatchOperation::SET, WatchKind::PREFIX}, "user:1", WatchOperation::SET));
+    EXPECT_FALSE(kvdb::watchMatches({"user:", WatchOperation::SET, WatchKind::PREFIX}, "use", WatchOperation::SET));
+    EXPECT_TRUE(kvdb::watchMatches({"*:x", WatchOperation::ALL, WatchKind::PATTERN}, "k:x", WatchOperation::EDIT));
+}
+
+TEST(GlobMatch, Wildcards) {
+    EXPECT_TRUE(kvdb::globMatch("a*c", "abbbc"));
+    EXPECT_TRUE(kvdb::globMatch("a*", "a"));
+    EXPECT_TRUE(kvdb::globMatch("*:x", "k:x"));
+    EXPECT_TRUE(kvdb::globMatch("a?c", "abc"));
+    EXPECT_FALSE(kvdb::globMatch("a?c", "ac"));
+    EXPECT_FALSE(kvdb::globMatch("a*c", "abcd"));
+}
+
+TEST_F(WatchTest, SlowClientDoesNotHoldTheWorker) {
+    int slow = newClient();
+    int fast = newClient();
+    manager.addWatch(slow, "k", kvdb::WatchOperation::SET);
+    manager.addWatch(fast, "other", kvdb::WatchOperation::SET);
+    int size = 4096;
+    setsockopt(clientEnd(slow), SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(slow, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+    // the slow client reads nothing, its socket fills up part way through the value
+    std::string value(64 * 1024, 'x');
+    manager.notifyEvent("k", kvdb::WatchOperation::SET, value);
+    manager.notifyEvent("k", kvdb::WatchOperation::SET, "dropped");
+    manager.notifyEvent("other", kvdb::WatchOperation::SET, "v");
+    EXPECT_EQ(readAll(fast, 200, 22), "NOTIFICATION SET other v\n");
+
+    // the message that was cut is still finished once the client reads, the one after it is gone
+    std::string expected = "NOTIFICATION SET k " + value + "\n";
+    EXPECT_EQ(readAll(slow, 200, expected.size()), expected);
+    EXPECT_EQ(readAll(slow, 50), "");
+    EXPECT_EQ(manager.notificationsDropped(), 1u);
+}